@@ -68,7 +68,7 @@ static options parse_args(int argc, const char **argv)
     options opts;
     po::options_description desc;
     desc.add_options()
-        ("type", make_opt(opts.type), "Semaphore type (light | fd | pipe | eventfd | posix)")
+        ("type", make_opt(opts.type), "Semaphore type (light | fd | spin | pipe | eventfd | posix | futex | adaptive)")
         ("capacity", make_opt(opts.capacity), "Ring buffer capacity")
         ("items", make_opt(opts.items), "Items to transmit")
         ("producer-cpu,p", make_opt(opts.producer_cpu), "CPU core to bind producer to")
@@ -185,6 +185,12 @@ int main(int argc, const char **argv)
     else if (opts.type == "eventfd")
         run<spead2::ringbuffer<item_t, spead2::semaphore_eventfd, spead2::semaphore_eventfd>>(opts);
 #endif
+#if SPEAD2_USE_FUTEX
+    else if (opts.type == "futex")
+        run<spead2::ringbuffer<item_t, spead2::semaphore_futex, spead2::semaphore_futex>>(opts);
+#endif
+    else if (opts.type == "adaptive")
+        run<spead2::ringbuffer<item_t, spead2::semaphore_adaptive, spead2::semaphore_adaptive>>(opts);
     else
     {
         std::cerr << "Unknown semaphore type " << opts.type << "\n";
@@ -42,7 +42,7 @@ public:
         std::size_t size;
     };
 
-    unbounded_queue<packet, semaphore_fd> buffer;
+    mpsc_unbounded_queue<packet, semaphore_fd> buffer;
 
     /**
      * Indicate end-of-stream to receivers. It is an error to add any more
@@ -51,7 +51,7 @@ public:
     void stop();
 };
 
-extern template class unbounded_queue<inproc_queue::packet, semaphore_fd>;
+extern template class mpsc_unbounded_queue<inproc_queue::packet, semaphore_fd>;
 
 } // namespace spead2
 
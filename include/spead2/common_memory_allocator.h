@@ -21,6 +21,7 @@
 #ifndef SPEAD2_COMMON_MEMORY_ALLOCATOR_H
 #define SPEAD2_COMMON_MEMORY_ALLOCATOR_H
 
+#include <atomic>
 #include <memory>
 #include <cstdint>
 #include <cstddef>
@@ -92,6 +93,77 @@ private:
     virtual void free(std::uint8_t *ptr, void *user);
 };
 
+/**
+ * Options for @ref mmap_allocator. Apart from the flags, each option is a
+ * request: if the OS does not support it or refuses it (for example,
+ * because no huge pages are reserved, the NUMA node does not exist, or the
+ * memory lock limit is too low), the allocation still succeeds without it.
+ */
+class mmap_allocator_config
+{
+public:
+    /// Extra flags to pass on to mmap
+    void set_flags(int flags) { this->flags = flags; }
+    int get_flags() const { return flags; }
+
+    /**
+     * Try to use explicit huge pages (@c MAP_HUGETLB), falling back to normal
+     * pages if none are available.
+     */
+    void set_prefer_huge(bool prefer_huge) { this->prefer_huge = prefer_huge; }
+    bool get_prefer_huge() const { return prefer_huge; }
+
+    /**
+     * Set the size of the explicit huge pages (e.g. 2 MiB or 1 GiB). The
+     * default of 0 uses the system default huge page size. This has no
+     * effect unless @ref set_prefer_huge is enabled.
+     *
+     * @throws std::invalid_argument if @a huge_page_size is not zero or a power of 2
+     */
+    void set_huge_page_size(std::size_t huge_page_size);
+    std::size_t get_huge_page_size() const { return huge_page_size; }
+
+    /**
+     * Advise the kernel to back the memory with transparent huge pages
+     * (@c MADV_HUGEPAGE). This is used for memory that is not backed by
+     * explicit huge pages.
+     */
+    void set_transparent_huge(bool transparent_huge) { this->transparent_huge = transparent_huge; }
+    bool get_transparent_huge() const { return transparent_huge; }
+
+    /**
+     * Place the memory on a NUMA node (with @c mbind). The kernel falls back
+     * to other nodes if the node runs out of memory. The default of -1
+     * uses the process's memory policy.
+     */
+    void set_numa_node(int numa_node) { this->numa_node = numa_node; }
+    int get_numa_node() const { return numa_node; }
+
+    /// Lock the memory so that it cannot be swapped out (with @c mlock)
+    void set_lock(bool lock) { this->lock = lock; }
+    bool get_lock() const { return lock; }
+
+    /**
+     * Set whether to fault in the memory when it is allocated (the
+     * default). If disabled, the pages are only faulted in when first
+     * touched, which makes allocation cheap but the first use expensive. It
+     * is mainly useful together with @ref memory_pool::fill_async, so that
+     * the pages are faulted in by the pool's background task. Locked memory
+     * is always faulted in.
+     */
+    void set_populate(bool populate) { this->populate = populate; }
+    bool get_populate() const { return populate; }
+
+private:
+    int flags = 0;
+    bool prefer_huge = false;
+    std::size_t huge_page_size = 0;
+    bool transparent_huge = false;
+    int numa_node = -1;
+    bool lock = false;
+    bool populate = true;
+};
+
 /**
  * Allocator that uses mmap. This is useful for large allocations, where the
  * cost of going to the kernel (bypassing malloc) and the page-grained
@@ -100,8 +172,12 @@ private:
  * - pointers are page-aligned, which is useful for things like direct I/O
  * - on Linux it uses @c MAP_POPULATE, which avoids lots of cache pollution
  *   when pre-faulting the hard way.
- * - it is possible to specify additional flags, e.g. MAP_HUGETLB or
- *   MAP_LOCKED.
+ * - it can use huge pages, which reduce TLB misses when copying large heaps.
+ * - it can place memory on a particular NUMA node, such as the one closest
+ *   to the network interface, and lock it into memory.
+ * - it is possible to specify additional flags, e.g. MAP_LOCKED.
+ *
+ * See @ref mmap_allocator_config for the options.
  *
  * @internal
  *
@@ -113,6 +189,7 @@ class mmap_allocator : public memory_allocator
 public:
     const int flags;         ///< Requested flags given to constructor
     const bool prefer_huge;  ///< Whether to prefer huge pages
+    const mmap_allocator_config config;
 
     /**
      * Constructor.
@@ -124,9 +201,14 @@ public:
      */
     explicit mmap_allocator(int flags = 0, bool prefer_huge = false);
 
+    explicit mmap_allocator(const mmap_allocator_config &config);
+
     virtual pointer allocate(std::size_t size, void *hint) override;
 
 private:
+    /// Whether a warning has already been issued about an option falling back
+    std::atomic<bool> warned_transparent_huge{false}, warned_numa{false}, warned_lock{false};
+
     virtual void free(std::uint8_t *ptr, void *user) override;
 };
 
@@ -21,10 +21,13 @@
 #ifndef SPEAD2_COMMON_MEMORY_POOL_H
 #define SPEAD2_COMMON_MEMORY_POOL_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <mutex>
-#include <stack>
+#include <vector>
 #include <memory>
 #include <boost/asio.hpp>
 #include <boost/optional.hpp>
@@ -34,6 +37,39 @@
 namespace spead2
 {
 
+/// Statistics about a @ref memory_pool
+struct memory_pool_stats
+{
+    /**
+     * Number of buckets in @ref refill_histogram. Bucket @a i counts the
+     * refills that took less than 2<sup>@a i</sup> microseconds (and at
+     * least 2<sup>@a i - 1</sup>), except that the last bucket also counts
+     * all longer refills.
+     */
+    static constexpr std::size_t refill_histogram_buckets = 24;
+
+    /// Total number of allocations
+    std::uint64_t allocations = 0;
+    /// Allocations within the pool bounds that were satisfied from the pool
+    std::uint64_t hits = 0;
+    /// Allocations within the pool bounds that found the pool empty
+    std::uint64_t misses = 0;
+    /// Allocations outside the pool bounds, passed directly to the underlying allocator
+    std::uint64_t out_of_range = 0;
+    /// Frees that returned memory to the underlying allocator because the pool was full
+    std::uint64_t dropped_frees = 0;
+    /// Number of free allocations held in the pool
+    std::size_t current_free = 0;
+    /// Smallest value that @ref current_free has had since the pool was created
+    std::size_t min_free = 0;
+    /**
+     * Histogram of the times taken by background refills, from the pool
+     * falling below the low-water mark (or @ref memory_pool::fill_async
+     * being called) until the refill completed.
+     */
+    std::array<std::uint64_t, refill_histogram_buckets> refill_histogram{};
+};
+
 /**
  * Memory allocator that pre-allocates memory and recycles it. This wastes
  * memory but reduces the number of page faults. It has a lower bound and an
@@ -47,25 +83,85 @@ namespace spead2
  * drop its references, even if there is still memory that has been allocated
  * and not yet freed.
  *
- * This class is thread-safe.
+ * This class is thread-safe. To reduce contention when several threads
+ * allocate and free memory, free memory is held in a fixed set of 16
+ * mutex-protected caches (magazines), shared round-robin between threads:
+ * each thread is assigned a cache the first time it uses any pool, so
+ * threads only share a cache if there are more than 16 of them. The caches
+ * exchange memory with a shared depot in batches. When both are empty,
+ * memory is taken from the other caches before resorting to a new
+ * allocation. The caches are not used for small pools.
  */
 class memory_pool : public memory_allocator
 {
 private:
+    /// Number of caches, assigned to threads round-robin
+    static constexpr std::size_t num_caches = 16;
+    /// Upper bound on the capacity of a cache
+    static constexpr std::size_t max_magazine_size = 32;
+
+    /**
+     * Free memory for the threads assigned to this cache. Threads only
+     * share a cache if there are more than @ref num_caches of them, so the
+     * mutex is normally uncontended, but it is always taken.
+     */
+    struct cache
+    {
+        std::mutex mutex;
+        /// Free memory; these pointers are owned by the base allocator
+        std::vector<pointer> rounds;
+        std::atomic<std::uint64_t> hits{0};
+        std::atomic<std::uint64_t> misses{0};
+        std::atomic<std::uint64_t> out_of_range{0};
+        /// Keep caches in separate cache lines
+        std::uint8_t padding[64];
+    };
+
     boost::optional<io_service_ref> io_service;
     const std::size_t lower, upper, max_free, initial, low_water;
+    /// Capacity of each cache, or 0 if the caches are bypassed
+    const std::size_t magazine_size;
     const std::shared_ptr<memory_allocator> base_allocator;
     mutable std::mutex mutex;
-    /// Free pool; these pointers are owned by the base allocator
-    std::stack<pointer> pool;
-    bool refilling = false;
-    bool warn_on_empty = true;
+    /// Free memory shared by all threads; owned by the base allocator
+    std::vector<pointer> depot;
+    /// Free memory in the depot and all the caches
+    std::atomic<std::size_t> n_free{0};
+    /// Smallest value of @ref n_free seen
+    std::atomic<std::size_t> min_free;
+    std::atomic<std::uint64_t> dropped_frees{0};
+    std::atomic<std::uint64_t> refill_histogram[memory_pool_stats::refill_histogram_buckets] = {};
+    std::atomic<bool> refilling{false};
+    std::atomic<bool> warn_on_empty{true};
+    std::unique_ptr<cache[]> caches;
+
+    /// Capacity of the caches for a given @a max_free
+    static std::size_t choose_magazine_size(std::size_t max_free);
+    /// Cache for the calling thread
+    cache &get_cache() const;
+    /// Move a batch of memory from the depot to an empty cache (whose lock must be held)
+    void load_cache(cache &c);
+    /// Move a batch of memory from a full cache (whose lock must be held) to the depot
+    void unload_cache(cache &c);
+    /**
+     * Take free memory from the cache of another thread, when there is none
+     * in the depot. The lock on @a self must not be held.
+     */
+    pointer steal(const cache &self);
+    /// Start a background refill if the pool has fallen below the low-water mark
+    void check_low_water(std::size_t free);
+    /// Update @ref min_free after taking memory from the pool
+    void update_min_free(std::size_t free);
 
     virtual void free(std::uint8_t *ptr, void *user) override;
     // Makes ourself the owner
     pointer convert(pointer &&base);
-    static void refill(std::size_t upper, std::shared_ptr<memory_allocator> allocator,
-                       std::weak_ptr<memory_pool> self_weak);
+    /// Start a background task to allocate memory until there are @a target free
+    void start_refill(std::size_t target);
+    static void refill(std::size_t upper, std::size_t target,
+                       std::shared_ptr<memory_allocator> allocator,
+                       std::weak_ptr<memory_pool> self_weak,
+                       std::chrono::steady_clock::time_point start);
 
     memory_pool(boost::optional<io_service_ref> io_service, std::size_t lower, std::size_t upper, std::size_t max_free, std::size_t initial, std::size_t low_water,
                 std::shared_ptr<memory_allocator> allocator);
@@ -79,6 +175,112 @@ public:
     bool get_warn_on_empty() const;
     void set_warn_on_empty(bool warn);
     virtual pointer allocate(std::size_t size, void *hint) override;
+
+    /**
+     * Fill the pool in the background (using the io_service passed to the
+     * constructor) until it holds @a target free allocations, or
+     * @a max_free if that is smaller. This allows a pool to be constructed
+     * with few initial allocations and filled without blocking. The
+     * allocations made in the background are also faulted in there, so
+     * combining this with an @ref mmap_allocator that does not populate
+     * memory takes the cost of page faults for huge or NUMA-bound memory
+     * off the caller's thread. It has no effect if a background refill is
+     * already in progress.
+     *
+     * @throws std::invalid_argument if the pool was constructed without an io_service
+     */
+    void fill_async(std::size_t target);
+
+    /// Get a snapshot of the statistics
+    memory_pool_stats get_stats() const;
+};
+
+/**
+ * Memory allocator that serves a range of sizes from several
+ * @ref memory_pool "memory pools", one per size class. An allocation is
+ * satisfied by the smallest class that is large enough, so that small
+ * allocations do not tie up memory sized for the largest ones. Each class has
+ * its own free list, @a max_free, @a initial and @a low_water (with the same
+ * meanings as for @ref memory_pool). Allocations larger than the largest
+ * class are satisfied directly by the underlying allocator.
+ *
+ * Like @ref memory_pool, it must be managed by a std::shared_ptr, and it is
+ * thread-safe.
+ */
+class size_class_memory_pool : public memory_allocator
+{
+public:
+    /// Configuration of one size class
+    struct size_class
+    {
+        /// Size of the allocations made for the class (and the largest size it serves)
+        std::size_t size;
+        /// Maximum number of allocations held in the free list
+        std::size_t max_free;
+        /// Number of allocations to put in the free list initially
+        std::size_t initial;
+        /// Level at which to refill the free list in the background (requires an io_service)
+        std::size_t low_water;
+
+        size_class(std::size_t size, std::size_t max_free, std::size_t initial,
+                   std::size_t low_water = 0)
+            : size(size), max_free(max_free), initial(initial), low_water(low_water) {}
+    };
+
+private:
+    const std::vector<size_class> classes;
+    const std::shared_ptr<memory_allocator> base_allocator;
+    /// Pool for each entry of @ref classes
+    std::vector<std::shared_ptr<memory_pool>> pools;
+
+    size_class_memory_pool(boost::optional<io_service_ref> io_service,
+                           std::vector<size_class> classes,
+                           std::shared_ptr<memory_allocator> allocator);
+
+public:
+    /**
+     * Generate size classes with sizes that are powers of two, from the
+     * smallest power of two that is at least @a min_size up to the smallest
+     * that is at least @a max_size. The other parameters apply to every class.
+     */
+    static std::vector<size_class> power_of_two_classes(
+        std::size_t min_size, std::size_t max_size,
+        std::size_t max_free, std::size_t initial, std::size_t low_water = 0);
+
+    /**
+     * Constructor.
+     *
+     * @param classes      Size classes, in strictly increasing order of size
+     * @param allocator    Underlying memory allocator (defaults to @ref memory_allocator)
+     *
+     * @throws std::invalid_argument if the classes are empty or not in
+     * increasing order of size, or if any class has a non-zero @a low_water,
+     * @a initial greater than @a max_free, or a zero size
+     */
+    explicit size_class_memory_pool(std::vector<size_class> classes,
+                                    std::shared_ptr<memory_allocator> allocator = nullptr);
+
+    /**
+     * Constructor for classes that refill their free lists in the
+     * background, using tasks posted to @a io_service.
+     *
+     * @throws std::invalid_argument if the classes are empty or not in
+     * increasing order of size, or if any class has @a low_water greater
+     * than @a initial, @a initial greater than @a max_free, or a zero size
+     */
+    size_class_memory_pool(io_service_ref io_service, std::vector<size_class> classes,
+                           std::shared_ptr<memory_allocator> allocator = nullptr);
+
+    virtual pointer allocate(std::size_t size, void *hint) override;
+
+    std::size_t get_num_classes() const { return classes.size(); }
+    const size_class &get_class(std::size_t idx) const { return classes.at(idx); }
+    /// Get a snapshot of the statistics for one size class
+    memory_pool_stats get_stats(std::size_t idx) const;
+
+    bool get_warn_on_empty() const;
+    /// Set whether to warn when any of the classes is empty (see @ref memory_pool::set_warn_on_empty)
+    void set_warn_on_empty(bool warn);
 };
 
 } // namespace spead2
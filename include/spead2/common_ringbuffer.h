@@ -29,6 +29,8 @@
 #include <memory>
 #include <stdexcept>
 #include <utility>
+#include <vector>
+#include <chrono>
 #include <cassert>
 #include <climits>
 #include <iostream>
@@ -126,9 +128,26 @@ protected:
     template<typename... Args>
     void emplace_internal(Args&&... args);
 
+    /**
+     * Implementation of batched pushing, which doesn't touch semaphores. The
+     * items in [@a first, @a last) are moved into the ringbuffer while
+     * holding the tail lock once.
+     */
+    template<typename Iterator>
+    void emplace_many_internal(Iterator first, Iterator last);
+
     /// Implementation of popping functions, which doesn't touch semaphores
     T pop_internal();
 
+    /**
+     * Implementation of batched popping, which doesn't touch semaphores. Up
+     * to @a n items are appended to @a out while holding the head lock once.
+     * Fewer are returned only if the stop position is reached.
+     *
+     * @return the number of items appended
+     */
+    std::size_t pop_many_internal(std::vector<T> &out, std::size_t n);
+
     /// Implementation of stopping, without the semaphores
     void stop_internal();
 
@@ -238,6 +257,36 @@ T ringbuffer_base<T>::pop_internal()
     return result;
 }
 
+template<typename T>
+template<typename Iterator>
+void ringbuffer_base<T>::emplace_many_internal(Iterator first, Iterator last)
+{
+    std::lock_guard<std::mutex> lock(tail_mutex);
+    if (stopped)
+    {
+        throw ringbuffer_stopped();
+    }
+    for (; first != last; ++first)
+    {
+        new (get(tail)) T(std::move(*first));
+        tail = next(tail);
+    }
+}
+
+template<typename T>
+std::size_t ringbuffer_base<T>::pop_many_internal(std::vector<T> &out, std::size_t n)
+{
+    std::lock_guard<std::mutex> lock(head_mutex);
+    std::size_t i;
+    for (i = 0; i < n && head != stop_position; i++)
+    {
+        out.push_back(std::move(*get(head)));
+        get(head)->~T();
+        head = next(head);
+    }
+    return i;
+}
+
 template<typename T>
 void ringbuffer_base<T>::stop_internal()
 {
@@ -290,6 +339,15 @@ private:
     DataSemaphore data_sem;     ///< Number of filled slots
     SpaceSemaphore space_sem;   ///< Number of available slots
 
+    /**
+     * Finish a batched pop once one filled slot has been reserved from @a
+     * data_sem: reserve any others that are immediately available (up to @a
+     * max in total) and move them into @a out.
+     *
+     * @throw ringbuffer_stopped if the queue is empty and @ref stop was called
+     */
+    void pop_many_reserved(std::vector<T> &out, std::size_t max);
+
 public:
     explicit ringbuffer(std::size_t cap);
 
@@ -347,6 +405,37 @@ public:
      */
     T pop();
 
+    /**
+     * Append a sequence of items to the queue, blocking if necessary. The
+     * items are moved out of [@a first, @a last). Each time there is space,
+     * as many items as will fit are appended with a single lock acquisition.
+     *
+     * If @ref stop is called part-way through, the items pushed up to that
+     * point will still be delivered to consumers.
+     *
+     * @throw ringbuffer_stopped if @ref stop is called first
+     */
+    template<typename Iterator>
+    void push_many(Iterator first, Iterator last);
+
+    /**
+     * Retrieve up to @a max items from the queue, blocking until there is at
+     * least one or until the queue is stopped. Items that are already
+     * available are retrieved with a single lock acquisition, so this is
+     * cheaper than calling @ref pop repeatedly to drain a burst.
+     *
+     * @throw ringbuffer_stopped if the queue is empty and @ref stop was called
+     */
+    std::vector<T> pop_many(std::size_t max);
+
+    /**
+     * Like @ref pop_many, but waits for at most @a timeout for the first
+     * item. If it times out, an empty vector is returned.
+     *
+     * @throw ringbuffer_stopped if the queue is empty and @ref stop was called
+     */
+    std::vector<T> pop_many(std::size_t max, std::chrono::steady_clock::duration timeout);
+
     /**
      * Indicate that no more items will be produced. This does not immediately
      * stop consumers if there are still items in the queue; instead,
@@ -479,6 +568,85 @@ T ringbuffer<T, DataSemaphore, SpaceSemaphore>::try_pop()
     }
 }
 
+template<typename T, typename DataSemaphore, typename SpaceSemaphore>
+template<typename Iterator>
+void ringbuffer<T, DataSemaphore, SpaceSemaphore>::push_many(Iterator first, Iterator last)
+{
+    while (first != last)
+    {
+        // Block for one slot, then take any others that are free
+        semaphore_get(space_sem);
+        std::size_t n = 1;
+        Iterator chunk_end = first;
+        ++chunk_end;
+        while (chunk_end != last && space_sem.try_get() == 0)
+        {
+            ++chunk_end;
+            n++;
+        }
+        try
+        {
+            this->emplace_many_internal(first, chunk_end);
+        }
+        catch (ringbuffer_stopped &e)
+        {
+            // We didn't actually use the slots we reserved with space_sem
+            for (std::size_t i = 0; i < n; i++)
+                space_sem.put();
+            throw;
+        }
+        for (std::size_t i = 0; i < n; i++)
+            data_sem.put();
+        first = chunk_end;
+    }
+}
+
+template<typename T, typename DataSemaphore, typename SpaceSemaphore>
+void ringbuffer<T, DataSemaphore, SpaceSemaphore>::pop_many_reserved(
+    std::vector<T> &out, std::size_t max)
+{
+    std::size_t n = 1;
+    while (n < max && data_sem.try_get() == 0)
+        n++;
+    out.reserve(out.size() + n);
+    std::size_t popped = this->pop_many_internal(out, n);
+    for (std::size_t i = 0; i < popped; i++)
+        space_sem.put();
+    /* Reservations beyond the stop position were not consumed, so hand them
+     * on to the next waiter.
+     */
+    for (std::size_t i = popped; i < n; i++)
+        data_sem.put();
+    if (popped == 0)
+        throw ringbuffer_stopped();
+}
+
+template<typename T, typename DataSemaphore, typename SpaceSemaphore>
+std::vector<T> ringbuffer<T, DataSemaphore, SpaceSemaphore>::pop_many(std::size_t max)
+{
+    std::vector<T> out;
+    if (max == 0)
+        return out;
+    semaphore_get(data_sem);
+    pop_many_reserved(out, max);
+    return out;
+}
+
+template<typename T, typename DataSemaphore, typename SpaceSemaphore>
+std::vector<T> ringbuffer<T, DataSemaphore, SpaceSemaphore>::pop_many(
+    std::size_t max, std::chrono::steady_clock::duration timeout)
+{
+    std::vector<T> out;
+    if (max == 0)
+        return out;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    // Avoid any system calls (or releasing the GIL) if there is already data
+    if (data_sem.try_get() == -1 && !semaphore_get_until(data_sem, deadline))
+        return out;
+    pop_many_reserved(out, max);
+    return out;
+}
+
 template<typename T, typename DataSemaphore, typename SpaceSemaphore>
 void ringbuffer<T, DataSemaphore, SpaceSemaphore>::stop()
 {
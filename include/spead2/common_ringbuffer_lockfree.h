@@ -0,0 +1,612 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Lock-free ring buffers.
+ */
+
+#ifndef SPEAD2_COMMON_RINGBUFFER_LOCKFREE_H
+#define SPEAD2_COMMON_RINGBUFFER_LOCKFREE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <chrono>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <spead2/common_ringbuffer.h>
+
+namespace spead2
+{
+
+namespace detail
+{
+
+/**
+ * Blocks threads until a condition holds. Notifying is just a memory fence
+ * and a load unless some thread is actually waiting, so the kernel is only
+ * involved when a ring buffer is empty or full.
+ */
+class ringbuffer_waiter
+{
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<unsigned int> waiters{0};
+
+public:
+    /**
+     * Block until @a ready returns true. The state that @a ready examines
+     * must be updated before the corresponding call to @ref notify.
+     */
+    template<typename Predicate>
+    void wait(Predicate &&ready)
+    {
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        // Pairs with the fence in notify: either we see the update, or it sees us
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!ready())
+                cond.wait(lock);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Like @ref wait, but give up once @a deadline passes.
+     *
+     * @return whether @a ready returned true
+     */
+    template<typename Predicate>
+    bool wait_until(std::chrono::steady_clock::time_point deadline, Predicate &&ready)
+    {
+        bool result;
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            result = cond.wait_until(lock, deadline, ready);
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    /// Wake up any waiting threads so that they re-evaluate their conditions
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0)
+        {
+            // Taking the lock ensures that a waiter cannot miss the notification
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_all();
+        }
+    }
+};
+
+/**
+ * Bounded single-producer, single-consumer queue. Positions are counted
+ * monotonically and reduced modulo the capacity to find the slot. Each side
+ * caches the other side's position so that it only needs to read the shared
+ * cache line when the queue appears empty or full.
+ */
+template<typename T>
+class spsc_ring
+{
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_type;
+
+    const std::size_t cap;
+    const std::unique_ptr<storage_type[]> storage;
+    std::uint8_t padding0[64];
+    /// Number of items popped (written only by the consumer)
+    std::atomic<std::size_t> head{0};
+    /// Consumer's copy of @ref tail
+    std::size_t tail_cache = 0;
+    std::uint8_t padding1[64];
+    /// Number of items pushed (written only by the producer)
+    std::atomic<std::size_t> tail{0};
+    /// Producer's copy of @ref head
+    std::size_t head_cache = 0;
+    std::uint8_t padding2[64];
+
+    T *get(std::size_t pos) { return reinterpret_cast<T *>(&storage[pos % cap]); }
+
+public:
+    explicit spsc_ring(std::size_t cap) : cap(cap), storage(new storage_type[cap]) {}
+    ~spsc_ring();
+
+    std::size_t capacity() const { return cap; }
+    std::size_t size() const;
+    bool can_push() const;
+    bool can_pop() const;
+
+    /// Move @a value into the queue if there is space, otherwise leave it untouched
+    bool try_push(T &value);
+    /// Move the first item to the uninitialised memory at @a out, if there is one
+    bool try_pop(T *out);
+};
+
+template<typename T>
+spsc_ring<T>::~spsc_ring()
+{
+    std::size_t end = tail.load(std::memory_order_relaxed);
+    for (std::size_t pos = head.load(std::memory_order_relaxed); pos != end; pos++)
+        get(pos)->~T();
+}
+
+template<typename T>
+std::size_t spsc_ring<T>::size() const
+{
+    std::size_t h = head.load(std::memory_order_acquire);
+    std::size_t t = tail.load(std::memory_order_acquire);
+    return t - h <= cap ? t - h : 0;
+}
+
+template<typename T>
+bool spsc_ring<T>::can_push() const
+{
+    return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) < cap;
+}
+
+template<typename T>
+bool spsc_ring<T>::can_pop() const
+{
+    return tail.load(std::memory_order_acquire) != head.load(std::memory_order_relaxed);
+}
+
+template<typename T>
+bool spsc_ring<T>::try_push(T &value)
+{
+    std::size_t pos = tail.load(std::memory_order_relaxed);
+    if (pos - head_cache == cap)
+    {
+        head_cache = head.load(std::memory_order_acquire);
+        if (pos - head_cache == cap)
+            return false;
+    }
+    new (get(pos)) T(std::move(value));
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool spsc_ring<T>::try_pop(T *out)
+{
+    std::size_t pos = head.load(std::memory_order_relaxed);
+    if (pos == tail_cache)
+    {
+        tail_cache = tail.load(std::memory_order_acquire);
+        if (pos == tail_cache)
+            return false;
+    }
+    T *item = get(pos);
+    new (out) T(std::move(*item));
+    item->~T();
+    head.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Bounded multi-producer, multi-consumer queue (D. Vyukov's design). Each
+ * slot has a sequence number that tells producers and consumers whether it
+ * is their turn to use it, and positions are claimed with a
+ * compare-and-swap.
+ */
+template<typename T>
+class mpmc_ring
+{
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_type;
+
+    struct cell
+    {
+        /**
+         * Twice the position when the slot is ready for the producer at
+         * that position, and one more than that when it holds the item for
+         * the consumer at that position. Doubling keeps the two states
+         * distinct even when the capacity is 1.
+         */
+        std::atomic<std::size_t> seq;
+        storage_type data;
+
+        T *get() { return reinterpret_cast<T *>(&data); }
+    };
+
+    const std::size_t cap;
+    const std::unique_ptr<cell[]> cells;
+    std::uint8_t padding0[64];
+    /// Next position to pop
+    std::atomic<std::size_t> head{0};
+    std::uint8_t padding1[64];
+    /// Next position to push
+    std::atomic<std::size_t> tail{0};
+    std::uint8_t padding2[64];
+
+public:
+    explicit mpmc_ring(std::size_t cap);
+    ~mpmc_ring();
+
+    std::size_t capacity() const { return cap; }
+    std::size_t size() const;
+    bool can_push() const;
+    bool can_pop() const;
+
+    /// Move @a value into the queue if there is space, otherwise leave it untouched
+    bool try_push(T &value);
+    /// Move the first item to the uninitialised memory at @a out, if there is one
+    bool try_pop(T *out);
+};
+
+template<typename T>
+mpmc_ring<T>::mpmc_ring(std::size_t cap)
+    : cap(cap), cells(new cell[cap])
+{
+    for (std::size_t i = 0; i < cap; i++)
+        cells[i].seq.store(2 * i, std::memory_order_relaxed);
+}
+
+template<typename T>
+mpmc_ring<T>::~mpmc_ring()
+{
+    std::size_t end = tail.load(std::memory_order_relaxed);
+    for (std::size_t pos = head.load(std::memory_order_relaxed); pos != end; pos++)
+        cells[pos % cap].get()->~T();
+}
+
+template<typename T>
+std::size_t mpmc_ring<T>::size() const
+{
+    std::size_t h = head.load(std::memory_order_acquire);
+    std::size_t t = tail.load(std::memory_order_acquire);
+    return t - h <= cap ? t - h : 0;
+}
+
+template<typename T>
+bool mpmc_ring<T>::can_push() const
+{
+    std::size_t pos = tail.load(std::memory_order_relaxed);
+    return cells[pos % cap].seq.load(std::memory_order_acquire) == 2 * pos;
+}
+
+template<typename T>
+bool mpmc_ring<T>::can_pop() const
+{
+    std::size_t pos = head.load(std::memory_order_relaxed);
+    return cells[pos % cap].seq.load(std::memory_order_acquire) == 2 * pos + 1;
+}
+
+template<typename T>
+bool mpmc_ring<T>::try_push(T &value)
+{
+    std::size_t pos = tail.load(std::memory_order_relaxed);
+    cell *c;
+    while (true)
+    {
+        c = &cells[pos % cap];
+        std::size_t seq = c->seq.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq - 2 * pos);
+        if (diff == 0)
+        {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false;     // the consumer has not yet freed the slot
+        else
+            pos = tail.load(std::memory_order_relaxed);
+    }
+    new (c->get()) T(std::move(value));
+    c->seq.store(2 * pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool mpmc_ring<T>::try_pop(T *out)
+{
+    std::size_t pos = head.load(std::memory_order_relaxed);
+    cell *c;
+    while (true)
+    {
+        c = &cells[pos % cap];
+        std::size_t seq = c->seq.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq - (2 * pos + 1));
+        if (diff == 0)
+        {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false;     // the producer has not yet filled the slot
+        else
+            pos = head.load(std::memory_order_relaxed);
+    }
+    new (out) T(std::move(*c->get()));
+    c->get()->~T();
+    c->seq.store(2 * (pos + cap), std::memory_order_release);
+    return true;
+}
+
+} // namespace detail
+
+/**
+ * Ring buffer with the same interface as @ref ringbuffer, but built on a
+ * lock-free queue, so that pushing and popping do not take any locks or
+ * make system calls unless the queue is full (for pushes) or empty (for
+ * pops). It can be used as the @c Ringbuffer parameter of
+ * @ref recv::ring_stream. Use the @ref spsc_ringbuffer and
+ * @ref mpmc_ringbuffer aliases rather than this class directly.
+ *
+ * The main difference from @ref ringbuffer is in the interaction of
+ * @ref stop with pushes in other threads: an item pushed concurrently with
+ * @ref stop might not be seen by consumers (it is destroyed with the ring
+ * buffer). Items pushed before @ref stop returns are always delivered.
+ *
+ * The move constructor of @a T should not throw.
+ */
+template<typename T, typename Ring>
+class lockfree_ringbuffer
+{
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_type;
+
+    Ring ring;
+    std::atomic<bool> stopped{false};
+    /// Consumers waiting for data
+    detail::ringbuffer_waiter data_waiter;
+    /// Producers waiting for space
+    detail::ringbuffer_waiter space_waiter;
+
+    /// Move an item out of the temporary storage used by @ref pop_internal
+    static T take(storage_type &buffer);
+
+    /**
+     * Pop an item into @a buffer, if possible.
+     *
+     * @throw ringbuffer_stopped if the ring is empty and has been stopped
+     */
+    bool pop_internal(storage_type &buffer);
+
+    /// Append items to @a out, without blocking, until it holds @a max
+    void pop_available(std::vector<T> &out, std::size_t max);
+
+public:
+    explicit lockfree_ringbuffer(std::size_t cap);
+
+    /// Maximum number of items that can be held at once
+    std::size_t capacity() const { return ring.capacity(); }
+    /// Number of items currently held (only suitable for metrics)
+    std::size_t size() const { return ring.size(); }
+
+    /// @copydoc ringbuffer::try_push
+    void try_push(T &&value);
+    /// @copydoc ringbuffer::try_emplace
+    template<typename... Args>
+    void try_emplace(Args&&... args);
+    /// @copydoc ringbuffer::push
+    void push(T &&value);
+    /// @copydoc ringbuffer::emplace
+    template<typename... Args>
+    void emplace(Args&&... args);
+    /// @copydoc ringbuffer::try_pop
+    T try_pop();
+    /// @copydoc ringbuffer::pop
+    T pop();
+    /// @copydoc ringbuffer::push_many
+    template<typename Iterator>
+    void push_many(Iterator first, Iterator last);
+    /// @copydoc ringbuffer::pop_many(std::size_t)
+    std::vector<T> pop_many(std::size_t max);
+    /// @copydoc ringbuffer::pop_many(std::size_t, std::chrono::steady_clock::duration)
+    std::vector<T> pop_many(std::size_t max, std::chrono::steady_clock::duration timeout);
+    /// @copydoc ringbuffer::stop
+    void stop();
+};
+
+template<typename T, typename Ring>
+lockfree_ringbuffer<T, Ring>::lockfree_ringbuffer(std::size_t cap)
+    : ring(cap)
+{
+    assert(cap > 0);
+}
+
+template<typename T, typename Ring>
+T lockfree_ringbuffer<T, Ring>::take(storage_type &buffer)
+{
+    T *item = reinterpret_cast<T *>(&buffer);
+    T result(std::move(*item));
+    item->~T();
+    return result;
+}
+
+template<typename T, typename Ring>
+bool lockfree_ringbuffer<T, Ring>::pop_internal(storage_type &buffer)
+{
+    T *out = reinterpret_cast<T *>(&buffer);
+    if (ring.try_pop(out))
+    {
+        space_waiter.notify();
+        return true;
+    }
+    if (stopped.load(std::memory_order_acquire))
+    {
+        // Items pushed before the stop may have become visible in the meantime
+        if (ring.try_pop(out))
+        {
+            space_waiter.notify();
+            return true;
+        }
+        throw ringbuffer_stopped();
+    }
+    return false;
+}
+
+template<typename T, typename Ring>
+void lockfree_ringbuffer<T, Ring>::try_push(T &&value)
+{
+    if (stopped.load(std::memory_order_acquire))
+        throw ringbuffer_stopped();
+    if (!ring.try_push(value))
+    {
+        if (stopped.load(std::memory_order_acquire))
+            throw ringbuffer_stopped();
+        throw ringbuffer_full();
+    }
+    data_waiter.notify();
+}
+
+template<typename T, typename Ring>
+template<typename... Args>
+void lockfree_ringbuffer<T, Ring>::try_emplace(Args&&... args)
+{
+    try_push(T(std::forward<Args>(args)...));
+}
+
+template<typename T, typename Ring>
+void lockfree_ringbuffer<T, Ring>::push(T &&value)
+{
+    while (true)
+    {
+        if (stopped.load(std::memory_order_acquire))
+            throw ringbuffer_stopped();
+        if (ring.try_push(value))
+        {
+            data_waiter.notify();
+            return;
+        }
+        space_waiter.wait([this] {
+            return ring.can_push() || stopped.load(std::memory_order_acquire);
+        });
+    }
+}
+
+template<typename T, typename Ring>
+template<typename... Args>
+void lockfree_ringbuffer<T, Ring>::emplace(Args&&... args)
+{
+    push(T(std::forward<Args>(args)...));
+}
+
+template<typename T, typename Ring>
+T lockfree_ringbuffer<T, Ring>::try_pop()
+{
+    storage_type buffer;
+    if (!pop_internal(buffer))
+        throw ringbuffer_empty();
+    return take(buffer);
+}
+
+template<typename T, typename Ring>
+T lockfree_ringbuffer<T, Ring>::pop()
+{
+    storage_type buffer;
+    while (!pop_internal(buffer))
+    {
+        data_waiter.wait([this] {
+            return ring.can_pop() || stopped.load(std::memory_order_acquire);
+        });
+    }
+    return take(buffer);
+}
+
+template<typename T, typename Ring>
+void lockfree_ringbuffer<T, Ring>::pop_available(std::vector<T> &out, std::size_t max)
+{
+    storage_type buffer;
+    T *item = reinterpret_cast<T *>(&buffer);
+    bool popped = false;
+    while (out.size() < max && ring.try_pop(item))
+    {
+        out.push_back(take(buffer));
+        popped = true;
+    }
+    if (popped)
+        space_waiter.notify();
+}
+
+template<typename T, typename Ring>
+template<typename Iterator>
+void lockfree_ringbuffer<T, Ring>::push_many(Iterator first, Iterator last)
+{
+    for (; first != last; ++first)
+        push(std::move(*first));
+}
+
+template<typename T, typename Ring>
+std::vector<T> lockfree_ringbuffer<T, Ring>::pop_many(std::size_t max)
+{
+    std::vector<T> out;
+    if (max == 0)
+        return out;
+    out.push_back(pop());
+    pop_available(out, max);
+    return out;
+}
+
+template<typename T, typename Ring>
+std::vector<T> lockfree_ringbuffer<T, Ring>::pop_many(
+    std::size_t max, std::chrono::steady_clock::duration timeout)
+{
+    std::vector<T> out;
+    if (max == 0)
+        return out;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    storage_type buffer;
+    while (!pop_internal(buffer))
+    {
+        bool ready = data_waiter.wait_until(deadline, [this] {
+            return ring.can_pop() || stopped.load(std::memory_order_acquire);
+        });
+        if (!ready)
+            return out;
+    }
+    out.push_back(take(buffer));
+    pop_available(out, max);
+    return out;
+}
+
+template<typename T, typename Ring>
+void lockfree_ringbuffer<T, Ring>::stop()
+{
+    stopped.store(true, std::memory_order_release);
+    data_waiter.notify();
+    space_waiter.notify();
+}
+
+/**
+ * Lock-free ring buffer for a single producer and a single consumer (which
+ * need not always be the same threads, provided that pushes and pops are
+ * each serialised, as for the heaps pushed by a @ref recv::ring_stream).
+ * @ref lockfree_ringbuffer::stop may be called from any thread.
+ */
+template<typename T>
+using spsc_ringbuffer = lockfree_ringbuffer<T, detail::spsc_ring<T>>;
+
+/// Lock-free ring buffer for any number of producers and consumers
+template<typename T>
+using mpmc_ringbuffer = lockfree_ringbuffer<T, detail::mpmc_ring<T>>;
+
+} // namespace spead2
+
+#endif // SPEAD2_COMMON_RINGBUFFER_LOCKFREE_H
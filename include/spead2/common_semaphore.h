@@ -30,6 +30,8 @@
 #include <spead2/common_features.h>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <ctime>
 #if SPEAD2_USE_POSIX_SEMAPHORES
 # include <semaphore.h>
 #endif
@@ -63,6 +65,14 @@ public:
      */
     int get();
 
+    /**
+     * Decrement semaphore, blocking until at most @a deadline.
+     *
+     * @retval -1 if the deadline passed or a system call was interrupted
+     * @retval 0 on success
+     */
+    int get_until(std::chrono::steady_clock::time_point deadline);
+
     /**
      * Decrement semaphore if possible, but do not block.
      *
@@ -100,6 +110,9 @@ public:
     /// @copydoc semaphore_spin::get
     int get();
 
+    /// @copydoc semaphore_spin::get_until
+    int get_until(std::chrono::steady_clock::time_point deadline);
+
     /// @copydoc semaphore_spin::try_get
     int try_get();
 
@@ -134,6 +147,9 @@ public:
     /// @copydoc semaphore_spin::get
     int get();
 
+    /// @copydoc semaphore_spin::get_until
+    int get_until(std::chrono::steady_clock::time_point deadline);
+
     /// @copydoc semaphore_spin::try_get
     int try_get();
 
@@ -166,12 +182,59 @@ public:
     /// @copydoc semaphore_spin::get
     int get();
 
+    /// @copydoc semaphore_spin::get_until
+    int get_until(std::chrono::steady_clock::time_point deadline);
+
     /// @copydoc semaphore_spin::try_get
     int try_get();
 };
 
 #endif // SPEAD2_USE_POSIX_SEMAPHORES
 
+#if SPEAD2_USE_FUTEX
+/**
+ * Semaphore built directly on futex(2). The count is held in an atomic, so
+ * that uncontended operations never enter the kernel, and @ref put only makes
+ * a system call (waking exactly one thread) when some thread is blocked.
+ * Like @ref semaphore_posix, it does not support select()-like calls.
+ */
+class semaphore_futex
+{
+private:
+    /// Semaphore value, which is also the futex word
+    std::atomic<int> value;
+    /// Number of threads blocked (or about to block) in the kernel
+    std::atomic<unsigned int> waiters{0};
+
+    static_assert(sizeof(std::atomic<int>) == sizeof(int), "std::atomic<int> cannot be used as a futex");
+
+    /**
+     * Wait in the kernel while the value is zero, for at most @a timeout
+     * (if not null).
+     *
+     * @retval -1 if the wait timed out or was interrupted
+     * @retval 0 otherwise (including spurious wakeups)
+     */
+    int wait(const struct timespec *timeout);
+
+public:
+    explicit semaphore_futex(unsigned int initial = 0);
+
+    /// @copydoc semaphore_spin::put
+    void put();
+
+    /// @copydoc semaphore_spin::get
+    int get();
+
+    /// @copydoc semaphore_spin::get_until
+    int get_until(std::chrono::steady_clock::time_point deadline);
+
+    /// @copydoc semaphore_spin::try_get
+    int try_get();
+};
+
+#endif // SPEAD2_USE_FUTEX
+
 #if SPEAD2_USE_EVENTFD
 typedef semaphore_eventfd semaphore_fd;
 #else
@@ -192,11 +255,94 @@ public:
     using semaphore_fd::semaphore_fd;
     using semaphore_fd::put;
     using semaphore_fd::get;
+    using semaphore_fd::get_until;
     using semaphore_fd::try_get;
 };
 
 #endif // !SPEAD2_USE_POSIX_SEMAPHORES
 
+/**
+ * Semaphore that spins for a while before blocking, and only makes a system
+ * call in @ref put when some thread is actually blocked. The number of
+ * iterations to spin adapts to how long waits have recently taken to be
+ * satisfied, up to a configurable limit (spinning is disabled on a machine
+ * with a single CPU). Blocked threads sleep on a futex where available, and
+ * otherwise on a file descriptor.
+ *
+ * A file descriptor is available through @ref get_fd for use with
+ * select()-like calls. Once it has been requested, transitions between zero
+ * and non-zero also cost a system call, to keep the file descriptor
+ * readable while the semaphore is positive. It may occasionally be readable
+ * when the semaphore is zero, but a failed @ref try_get clears that.
+ */
+class semaphore_adaptive
+{
+private:
+    /// Semaphore value (also the futex word, if futexes are used)
+    std::atomic<unsigned int> value;
+    /// Number of threads blocked (or about to block) in @ref sleep
+    std::atomic<unsigned int> sleepers{0};
+    /// Running estimate of the spin iterations needed for a successful get
+    std::atomic<unsigned int> spin_estimate{0};
+    const unsigned int max_spin;
+    /// Set once @ref get_fd has been called
+    mutable std::atomic<bool> fd_exposed{false};
+    /**
+     * Signalled to make the fd readable, and (without futex support) to wake
+     * blocked threads.
+     */
+    mutable semaphore_fd doorbell;
+
+#if SPEAD2_USE_FUTEX
+    static_assert(sizeof(std::atomic<unsigned int>) == sizeof(int),
+                  "std::atomic<unsigned int> cannot be used as a futex");
+#endif
+
+    /// Decrement the value if it is positive, without blocking
+    bool take();
+    /// Spin for a while trying to @ref take, and update the spin estimate
+    bool spin();
+    /**
+     * Consume stale signals on @ref doorbell, then signal it again if the
+     * value is positive. Only used once the fd is exposed.
+     */
+    void clear() const;
+    /// Wake one thread blocked in @ref sleep
+    void wake();
+    /**
+     * Block while the value is zero, until woken by @ref wake or until
+     * @a deadline (if not null).
+     *
+     * @retval -1 if the deadline passed or a system call was interrupted
+     * @retval 0 otherwise (including spurious wakeups)
+     */
+    int sleep(const std::chrono::steady_clock::time_point *deadline);
+    /// Implementation of @ref get and @ref get_until
+    int get_internal(const std::chrono::steady_clock::time_point *deadline);
+
+public:
+    /// Default maximum number of iterations to spin before blocking
+    static constexpr unsigned int default_max_spin = 1024;
+
+    explicit semaphore_adaptive(unsigned int initial = 0,
+                                unsigned int max_spin = default_max_spin);
+
+    /// @copydoc semaphore_spin::put
+    void put();
+
+    /// @copydoc semaphore_spin::get
+    int get();
+
+    /// @copydoc semaphore_spin::get_until
+    int get_until(std::chrono::steady_clock::time_point deadline);
+
+    /// @copydoc semaphore_spin::try_get
+    int try_get();
+
+    /// @copydoc semaphore_pipe::get_fd
+    int get_fd() const;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 
 /// Gets a semaphore, restarting automatically on interruptions
@@ -208,6 +354,24 @@ static void semaphore_get(Semaphore &sem)
     }
 }
 
+/**
+ * Gets a semaphore, restarting automatically on interruptions, unless
+ * @a deadline passes first.
+ *
+ * @retval true if the semaphore was decremented
+ * @retval false if the deadline passed
+ */
+template<typename Semaphore>
+static bool semaphore_get_until(Semaphore &sem, std::chrono::steady_clock::time_point deadline)
+{
+    while (sem.get_until(deadline) == -1)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+    }
+    return true;
+}
+
 } // namespace spead2
 
 #endif // SPEAD2_COMMON_SEMAPHORE_H
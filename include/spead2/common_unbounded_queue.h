@@ -27,6 +27,10 @@
 #include <utility>
 #include <mutex>
 #include <queue>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
 #include <spead2/common_semaphore.h>
 #include <spead2/common_ringbuffer.h>
 
@@ -46,7 +50,7 @@ template<typename T, typename DataSemaphore = semaphore>
 class unbounded_queue
 {
 private:
-    semaphore_fd data_sem;
+    DataSemaphore data_sem;
     std::mutex mutex;
     bool stopped = false;
     std::queue<T> data;
@@ -190,6 +194,253 @@ void unbounded_queue<T, DataSemaphore>::stop()
     }
 }
 
+/**
+ * Unbounded queue with the same interface as @ref unbounded_queue, designed
+ * for many producers feeding a single consumer at a high rate.
+ *
+ * Items are kept in a singly-linked list, and producers append to it with a
+ * single atomic exchange, without taking any locks. The data semaphore is
+ * not a count of items: it is only signalled once the consumer has found the
+ * queue empty and gone idle, and any stale signal is discarded on the next
+ * idle transition. While the consumer keeps up, neither side makes any
+ * system calls other than for memory allocation, and if the semaphore is
+ * polled through a file descriptor, the descriptor remains readable until
+ * the queue has been drained.
+ *
+ * Multiple consumers are supported, but they are serialised by a mutex.
+ *
+ * A push that races with @ref stop either throws @ref ringbuffer_stopped or
+ * is delivered, as for @ref unbounded_queue. Producers register themselves
+ * while they check for a stop and link their item, and a consumer that
+ * sees the stop waits for them to finish before declaring the queue
+ * drained.
+ *
+ * Each push allocates a list node on the heap, which the consumer frees.
+ * This is in addition to any allocation made by the item itself (such as
+ * the payload of an @ref inproc_queue::packet).
+ */
+template<typename T, typename DataSemaphore = semaphore>
+class mpsc_unbounded_queue
+{
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_type;
+
+    struct node
+    {
+        std::atomic<node *> next{nullptr};
+        storage_type value;  ///< Constructed for every node after @ref head
+    };
+
+    DataSemaphore data_sem;
+    /// Serialises consumers (uncontended when there is only one)
+    std::mutex consumer_mutex;
+    /// Node preceding the oldest item, whose value is not constructed (protected by @ref consumer_mutex)
+    node *head;
+    /// Most recently pushed node
+    std::atomic<node *> tail;
+    std::atomic<bool> stopped{false};
+    /// Number of producers between checking @ref stopped and linking their node
+    std::atomic<std::size_t> pushers{0};
+    /**
+     * Set by a consumer that found the queue empty, to request a signal on
+     * @ref data_sem. It starts set, since a consumer may already be polling
+     * before it has tried to pop anything.
+     */
+    std::atomic<bool> idle{true};
+
+    /// Keeps @ref pushers incremented for its lifetime
+    class push_guard
+    {
+    private:
+        std::atomic<std::size_t> &pushers;
+
+    public:
+        explicit push_guard(std::atomic<std::size_t> &pushers) : pushers(pushers)
+        {
+            pushers.fetch_add(1, std::memory_order_seq_cst);
+        }
+
+        ~push_guard()
+        {
+            pushers.fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    /// Link a node containing an item onto the tail
+    void push_node(std::unique_ptr<node> &&n);
+
+    /**
+     * Move the oldest item into @a buffer, if any item is visible. The caller
+     * must hold @ref consumer_mutex.
+     */
+    bool pop_node(storage_type &buffer);
+
+    /// Move an item out of the temporary storage used by @ref pop_node
+    static T take(storage_type &buffer);
+
+public:
+    mpsc_unbounded_queue();
+    ~mpsc_unbounded_queue();
+
+    /// @copydoc unbounded_queue::push
+    void push(T &&value);
+
+    /// @copydoc unbounded_queue::emplace
+    template<typename... Args>
+    void emplace(Args&&... args);
+
+    /// @copydoc unbounded_queue::try_pop
+    T try_pop();
+
+    /// @copydoc unbounded_queue::pop
+    T pop();
+
+    /// @copydoc unbounded_queue::stop
+    void stop();
+
+    /// Get access to the data semaphore
+    const DataSemaphore &get_data_sem() const { return data_sem; }
+};
+
+template<typename T, typename DataSemaphore>
+mpsc_unbounded_queue<T, DataSemaphore>::mpsc_unbounded_queue()
+    : head(new node), tail(head)
+{
+}
+
+template<typename T, typename DataSemaphore>
+mpsc_unbounded_queue<T, DataSemaphore>::~mpsc_unbounded_queue()
+{
+    node *next = head->next.load(std::memory_order_relaxed);
+    delete head;
+    while (next)
+    {
+        node *n = next;
+        next = n->next.load(std::memory_order_relaxed);
+        reinterpret_cast<T *>(&n->value)->~T();
+        delete n;
+    }
+}
+
+template<typename T, typename DataSemaphore>
+T mpsc_unbounded_queue<T, DataSemaphore>::take(storage_type &buffer)
+{
+    T *item = reinterpret_cast<T *>(&buffer);
+    T result(std::move(*item));
+    item->~T();
+    return result;
+}
+
+template<typename T, typename DataSemaphore>
+void mpsc_unbounded_queue<T, DataSemaphore>::push_node(std::unique_ptr<node> &&n)
+{
+    node *ptr = n.release();
+    node *prev = tail.exchange(ptr, std::memory_order_acq_rel);
+    /* Until this store, the consumer sees the queue end at prev. That is
+     * safe, because we check for an idle consumer only after it.
+     */
+    prev->next.store(ptr, std::memory_order_release);
+    // Pairs with the fence in try_pop: either it sees the item, or we see it idle
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle.load(std::memory_order_relaxed) && idle.exchange(false, std::memory_order_relaxed))
+        data_sem.put();
+}
+
+template<typename T, typename DataSemaphore>
+void mpsc_unbounded_queue<T, DataSemaphore>::push(T &&value)
+{
+    emplace(std::move(value));
+}
+
+template<typename T, typename DataSemaphore>
+template<typename... Args>
+void mpsc_unbounded_queue<T, DataSemaphore>::emplace(Args&&... args)
+{
+    std::unique_ptr<node> n(new node);
+    /* Either we see the stop, or a consumer that sees it waits for us to
+     * link the node (see try_pop).
+     */
+    push_guard guard(pushers);
+    if (stopped.load(std::memory_order_seq_cst))
+        throw ringbuffer_stopped();
+    new (&n->value) T(std::forward<Args>(args)...);
+    push_node(std::move(n));
+}
+
+template<typename T, typename DataSemaphore>
+bool mpsc_unbounded_queue<T, DataSemaphore>::pop_node(storage_type &buffer)
+{
+    node *next = head->next.load(std::memory_order_acquire);
+    if (!next)
+        return false;
+    T *item = reinterpret_cast<T *>(&next->value);
+    new (&buffer) T(std::move(*item));
+    item->~T();
+    delete head;
+    head = next;
+    return true;
+}
+
+template<typename T, typename DataSemaphore>
+T mpsc_unbounded_queue<T, DataSemaphore>::try_pop()
+{
+    std::lock_guard<std::mutex> lock(consumer_mutex);
+    storage_type buffer;
+    if (pop_node(buffer))
+        return take(buffer);
+
+    /* Going idle. Discard any signal left over from a previous idle period
+     * (so that a polled file descriptor stops being readable), then ask
+     * producers for a new one and check again in case we raced with them.
+     */
+    while (data_sem.try_get() == 0)
+    {
+    }
+    idle.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pop_node(buffer))
+    {
+        idle.store(false, std::memory_order_relaxed);
+        return take(buffer);
+    }
+    if (stopped.load(std::memory_order_seq_cst))
+    {
+        /* Producers that did not see the stop may still be linking their
+         * items. Once they have finished, no more items can arrive.
+         */
+        while (pushers.load(std::memory_order_seq_cst) != 0)
+            std::this_thread::yield();
+        if (pop_node(buffer))
+            return take(buffer);
+        data_sem.put();   // keep other consumers (and pollers) awake
+        throw ringbuffer_stopped();
+    }
+    throw ringbuffer_empty();
+}
+
+template<typename T, typename DataSemaphore>
+T mpsc_unbounded_queue<T, DataSemaphore>::pop()
+{
+    while (true)
+    {
+        try
+        {
+            return try_pop();
+        }
+        catch (ringbuffer_empty &)
+        {
+        }
+        semaphore_get(data_sem);
+    }
+}
+
+template<typename T, typename DataSemaphore>
+void mpsc_unbounded_queue<T, DataSemaphore>::stop()
+{
+    if (!stopped.exchange(true, std::memory_order_seq_cst))
+        data_sem.put();  // wakes up waiters
+}
+
 } // namespace spead2
 
 #endif // SPEAD2_COMMON_UNBOUNDED_QUEUE_H
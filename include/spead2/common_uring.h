@@ -0,0 +1,134 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Minimal wrapper around the Linux io_uring interface. It talks to the
+ * kernel directly rather than through liburing, and only provides what the
+ * senders need.
+ */
+
+#ifndef SPEAD2_COMMON_URING_H
+#define SPEAD2_COMMON_URING_H
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <spead2/common_features.h>
+
+#if SPEAD2_USE_URING
+
+#include <cstddef>
+#include <linux/io_uring.h>
+#include <boost/noncopyable.hpp>
+
+namespace spead2
+{
+
+/**
+ * An io_uring instance, with its submission and completion rings mapped.
+ *
+ * It is not thread-safe: at most one thread may submit to or reap from it
+ * at a time.
+ */
+class io_uring_t : public boost::noncopyable
+{
+private:
+    int fd = -1;
+    unsigned int features = 0;
+
+    void *sq_ring_ptr = nullptr;
+    std::size_t sq_ring_size = 0;
+    void *cq_ring_ptr = nullptr;
+    std::size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sqes_size = 0;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    io_uring_cqe *cqes;
+
+    /// Tail of SQEs that have been handed out by @ref get_sqe but not yet submitted
+    unsigned int sqe_tail = 0;
+
+    void unmap();
+
+public:
+    /**
+     * Constructor.
+     *
+     * @param entries   Minimum number of submission queue entries
+     *
+     * @throws std::system_error if io_uring is not supported by the kernel
+     */
+    explicit io_uring_t(unsigned int entries);
+    ~io_uring_t();
+
+    /**
+     * Get a submission queue entry to fill in. The entry is zeroed. It is
+     * not passed to the kernel until @ref submit is called.
+     *
+     * @returns a pointer to the entry, or @c nullptr if the queue is full
+     */
+    io_uring_sqe *get_sqe();
+
+    /**
+     * Pass all entries obtained from @ref get_sqe to the kernel.
+     *
+     * @returns the number of entries consumed by the kernel
+     * @throws std::system_error on failure
+     */
+    unsigned int submit();
+
+    /**
+     * Call @a callback on every available completion queue entry, then
+     * remove them from the queue. It does not block.
+     *
+     * @returns the number of entries processed
+     */
+    template<typename F>
+    unsigned int reap(F &&callback)
+    {
+        unsigned int head = *cq_head;
+        unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned int n = tail - head;
+        for (; head != tail; head++)
+            callback(cqes[head & cq_mask]);
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    /// Register file descriptors, which are then referenced by index in SQEs
+    void register_files(const int *fds, unsigned int n_fds);
+
+    /// Register an eventfd that is signalled when completions are posted
+    void register_eventfd(int event_fd);
+
+    /// Kernel feature flags (IORING_FEAT_*)
+    unsigned int get_features() const { return features; }
+};
+
+} // namespace spead2
+
+#endif // SPEAD2_USE_URING
+#endif // SPEAD2_COMMON_URING_H
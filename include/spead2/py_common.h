@@ -33,6 +33,7 @@
 #include <stdexcept>
 #include <type_traits>
 #include <functional>
+#include <chrono>
 #include <spead2/common_memory_allocator.h>
 #include <spead2/common_memory_pool.h>
 #include <spead2/common_thread_pool.h>
@@ -163,6 +164,7 @@ class semaphore_gil : public Semaphore
 public:
     using Semaphore::Semaphore;
     int get();
+    int get_until(std::chrono::steady_clock::time_point deadline);
 };
 
 template<typename Semaphore>
@@ -182,6 +184,23 @@ int semaphore_gil<Semaphore>::get()
     return result;
 }
 
+template<typename Semaphore>
+int semaphore_gil<Semaphore>::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    int result;
+    {
+        pybind11::gil_scoped_release gil;
+        result = Semaphore::get_until(deadline);
+    }
+    if (result == -1)
+    {
+        // Allow SIGINT to abort the wait
+        if (PyErr_CheckSignals() == -1)
+            throw pybind11::error_already_set();
+    }
+    return result;
+}
+
 /**
  * Logger function object that passes log messages to Python. To avoid blocking
  * the caller while waiting for the GIL, it passes the log messages through a
@@ -24,8 +24,13 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
 #include <vector>
 #include <map>
+#include <utility>
+#include <functional>
 #include <spead2/common_defines.h>
 #include <spead2/common_flavour.h>
 #include <spead2/common_memory_allocator.h>
@@ -54,6 +59,116 @@ struct item
     bool is_immediate;
 };
 
+class heap_metadata_pool;
+
+/**
+ * Allocator for the nodes of the maps and sets used while assembling heaps.
+ * If it has a @ref heap_metadata_pool, nodes are recycled through it,
+ * otherwise it uses plain @c new.
+ */
+template<typename T>
+class metadata_allocator
+{
+    template<typename U> friend class metadata_allocator;
+private:
+    std::shared_ptr<heap_metadata_pool> pool;
+
+public:
+    typedef T value_type;
+    // The allocator must follow the container when it is moved into a heap
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    metadata_allocator() = default;
+    explicit metadata_allocator(std::shared_ptr<heap_metadata_pool> pool) : pool(std::move(pool)) {}
+    template<typename U>
+    metadata_allocator(const metadata_allocator<U> &other) : pool(other.pool) {}
+
+    T *allocate(std::size_t n);
+    void deallocate(T *ptr, std::size_t n);
+
+    template<typename U>
+    bool operator==(const metadata_allocator<U> &other) const { return pool == other.pool; }
+    template<typename U>
+    bool operator!=(const metadata_allocator<U> &other) const { return pool != other.pool; }
+};
+
+/// Contiguous ranges of payload, mapping the start of each to its end
+typedef std::map<s_item_pointer_t, s_item_pointer_t, std::less<s_item_pointer_t>,
+                 metadata_allocator<std::pair<const s_item_pointer_t, s_item_pointer_t>>>
+    payload_range_map;
+
+/**
+ * Free lists of the storage used for the metadata of heaps (everything
+ * except the payload): the item lists and immediate values of @ref heap,
+ * and the item pointer lists and payload ranges of @ref live_heap. A stream
+ * owns one and passes it to its heaps, which return their storage to it when
+ * they are destroyed (even if that happens after the stream is destroyed).
+ * Once the free lists have warmed up, assembling a heap requires no memory
+ * allocation other than for the payload.
+ *
+ * Up to @a max_free entries of each type are retained. This class is
+ * thread-safe.
+ */
+class heap_metadata_pool
+{
+public:
+    static constexpr std::size_t default_max_free = 64;
+    /// Largest map or set node that is recycled
+    static constexpr std::size_t max_node_size = 64;
+
+    explicit heap_metadata_pool(std::size_t max_free = default_max_free);
+    ~heap_metadata_pool();
+
+    /// Get an empty vector (possibly with capacity) for @ref heap_base items
+    std::vector<item> take_items();
+    /// Get an empty vector (possibly with capacity) for immediate values
+    std::vector<std::uint8_t> take_bytes();
+    /// Get an empty vector (possibly with capacity) for item pointers
+    std::vector<item_pointer_t> take_pointers();
+    void give_items(std::vector<item> &&items);
+    void give_bytes(std::vector<std::uint8_t> &&bytes);
+    void give_pointers(std::vector<item_pointer_t> &&pointers);
+
+    /// Allocate memory for a map or set node (see @ref metadata_allocator)
+    void *allocate_node(std::size_t size);
+    /// Free memory returned by @ref allocate_node
+    void deallocate_node(void *ptr, std::size_t size);
+
+private:
+    const std::size_t max_free;
+    std::mutex mutex;
+    std::vector<std::vector<item>> free_items;
+    std::vector<std::vector<std::uint8_t>> free_bytes;
+    std::vector<std::vector<item_pointer_t>> free_pointers;
+    /// Memory blocks of size @ref max_node_size
+    std::vector<void *> free_nodes;
+
+    template<typename T>
+    T take(std::vector<T> &free);
+    template<typename T>
+    void give(std::vector<T> &free, T &&value);
+};
+
+template<typename T>
+T *metadata_allocator<T>::allocate(std::size_t n)
+{
+    if (pool && n == 1)
+        return static_cast<T *>(pool->allocate_node(sizeof(T)));
+    else
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+}
+
+template<typename T>
+void metadata_allocator<T>::deallocate(T *ptr, std::size_t n)
+{
+    if (pool && n == 1)
+        pool->deallocate_node(ptr, sizeof(T));
+    else
+        ::operator delete(ptr);
+}
+
 /**
  * Base class for @ref heap and @ref incomplete_heap
  */
@@ -62,6 +177,8 @@ class heap_base
 private:
     s_item_pointer_t cnt;       ///< Heap ID
     flavour flavour_;           ///< Flavour
+    /// Pool to which @ref items and @ref immediate_payload are returned (may be null)
+    std::shared_ptr<heap_metadata_pool> metadata;
     /**
      * Extracted items. The pointers in the items point into either @ref
      * payload, @ref immediate_payload_inline or @ref immediate_payload.
@@ -76,11 +193,13 @@ private:
      * storage is accessed via the items.
      */
     std::uint8_t immediate_payload_inline[24];   // 4 items in SPEAD-64-48
-    std::unique_ptr<std::uint8_t[]> immediate_payload;
+    std::vector<std::uint8_t> immediate_payload;
     /**@}*/
 
     /* Copy inline immediate items and fix up pointers to it */
     void transfer_immediates(heap_base &&other) noexcept;
+    /// Return @ref items and @ref immediate_payload to @ref metadata
+    void recycle() noexcept;
 
 protected:
     /// Create the structures from a live heap, destroying it in the process.
@@ -95,6 +214,7 @@ public:
     heap_base() = default;
     heap_base(heap_base &&other) noexcept;
     heap_base &operator=(heap_base &&other) noexcept;
+    ~heap_base();
 
     /// Get heap ID
     s_item_pointer_t get_cnt() const { return cnt; }
@@ -170,7 +290,7 @@ private:
      *
      * @see @ref live_heap::payload_ranges.
      */
-    std::map<s_item_pointer_t, s_item_pointer_t> payload_ranges;
+    payload_range_map payload_ranges;
 
     /// Heap payload length encoded in packets (-1 for unknown)
     s_item_pointer_t heap_length;
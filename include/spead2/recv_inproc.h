@@ -38,6 +38,9 @@ namespace recv
 class inproc_reader : public reader
 {
 private:
+    /// Maximum number of packets to process per wakeup
+    static constexpr std::size_t max_batch = 64;
+
     std::shared_ptr<inproc_queue> queue;
     boost::asio::posix::stream_descriptor data_sem_wrapper;
 
@@ -34,6 +34,7 @@
 #include <spead2/common_memory_allocator.h>
 #include <spead2/recv_packet.h>
 #include <spead2/recv_utils.h>
+#include <spead2/recv_heap.h>
 
 namespace spead2
 {
@@ -50,8 +51,6 @@ namespace recv
 typedef std::function<void(const spead2::memory_allocator::pointer &allocation,
                            const packet_header &packet)> packet_memcpy_function;
 
-class heap;
-
 /**
  * A SPEAD heap that is in the process of being received. Once it is fully
  * received, it is converted to a @ref heap for further processing.
@@ -98,6 +97,8 @@ private:
     pointer_decoder decoder;
     /// Protocol bugs to accept
     bug_compat_mask bug_compat;
+    /// Pool for recycling metadata storage (may be null)
+    std::shared_ptr<heap_metadata_pool> metadata;
     /// True if a stream control packet indicating end-of-heap was found
     bool end_of_stream = false;
     /**
@@ -130,7 +131,7 @@ private:
 
     std::array<item_pointer_t, max_inline_pointers> inline_pointers;
     std::vector<item_pointer_t> external_pointers;
-    std::set<item_pointer_t> seen_pointers;
+    std::set<item_pointer_t, std::less<item_pointer_t>, metadata_allocator<item_pointer_t>> seen_pointers;
 
     /**@}*/
 
@@ -141,7 +142,7 @@ private:
      * more-or-less in order (or more-or-less in order for each of a small
      * number of streams) the map is not expected to grow large.
      */
-    std::map<s_item_pointer_t, s_item_pointer_t> payload_ranges;
+    payload_range_map payload_ranges;
 
     /**
      * Make sure at least @a size bytes are allocated for payload. If
@@ -168,9 +169,18 @@ public:
      *
      * @param initial_packet  First packet that will be added.
      * @param bug_compat   Bugs to expect in the protocol
+     * @param metadata     Pool from which to take storage for item pointers
+     *                     and payload ranges (and which is passed on to the
+     *                     frozen heap). If null, storage is allocated
+     *                     normally.
      */
     explicit live_heap(const packet_header &initial_packet,
-                       bug_compat_mask bug_compat);
+                       bug_compat_mask bug_compat,
+                       std::shared_ptr<heap_metadata_pool> metadata = nullptr);
+
+    live_heap(live_heap &&other) = default;
+    live_heap &operator=(live_heap &&other) = default;
+    ~live_heap();
 
     /**
      * Attempt to add a packet to the heap. The packet must have been
@@ -28,6 +28,8 @@
 #include <spead2/recv_heap.h>
 #include <spead2/recv_stream.h>
 #include <utility>
+#include <vector>
+#include <chrono>
 
 namespace spead2
 {
@@ -57,7 +59,7 @@ public:
  *
  * This class is thread-safe.
  */
-template<typename Ringbuffer = ringbuffer<live_heap> >
+template<typename Ringbuffer = ringbuffer<live_heap, semaphore_adaptive, semaphore_adaptive> >
 class ring_stream : public ring_stream_base
 {
 private:
@@ -66,6 +68,9 @@ private:
 
     virtual void heap_ready(live_heap &&) override;
 
+    /// Freeze the contiguous heaps in @a heaps and append them to @a out
+    void freeze_contiguous(std::vector<live_heap> &&heaps, std::vector<heap> &out);
+
 public:
     /**
      * Constructor.
@@ -125,6 +130,44 @@ public:
      */
     live_heap try_pop_live();
 
+    /**
+     * Wait until a contiguous heap is available, then return it together
+     * with any others that are already available, up to @a max heaps in
+     * total (incomplete heaps are discarded). This costs a single
+     * synchronisation with the ring buffer rather than one per heap.
+     *
+     * @throw ringbuffer_stopped if @ref stop has been called and
+     * there are no more contiguous heaps.
+     */
+    std::vector<heap> pop_many(std::size_t max);
+
+    /**
+     * Like @ref pop_many(std::size_t), but waits for at most @a timeout.
+     * If no contiguous heap arrives in that time, returns an empty vector.
+     *
+     * @throw ringbuffer_stopped if @ref stop has been called and
+     * there are no more contiguous heaps.
+     */
+    std::vector<heap> pop_many(std::size_t max, std::chrono::steady_clock::duration timeout);
+
+    /**
+     * Wait until a heap is available, then return it together with any
+     * others that are already available, up to @a max heaps in total.
+     *
+     * @throw ringbuffer_stopped if @ref stop has been called and
+     * there are no more heaps.
+     */
+    std::vector<live_heap> pop_many_live(std::size_t max);
+
+    /**
+     * Like @ref pop_many_live(std::size_t), but waits for at most @a timeout.
+     * If no heap arrives in that time, returns an empty vector.
+     *
+     * @throw ringbuffer_stopped if @ref stop has been called and
+     * there are no more heaps.
+     */
+    std::vector<live_heap> pop_many_live(std::size_t max, std::chrono::steady_clock::duration timeout);
+
     virtual void stop_received() override;
 
     virtual void stop() override;
@@ -234,6 +277,58 @@ live_heap ring_stream<Ringbuffer>::try_pop_live()
     return ready_heaps.try_pop();
 }
 
+template<typename Ringbuffer>
+void ring_stream<Ringbuffer>::freeze_contiguous(std::vector<live_heap> &&heaps, std::vector<heap> &out)
+{
+    out.reserve(out.size() + heaps.size());
+    for (live_heap &h : heaps)
+    {
+        if (h.is_contiguous())
+            out.emplace_back(std::move(h));
+        else
+            log_info("received incomplete heap %d", h.get_cnt());
+    }
+}
+
+template<typename Ringbuffer>
+std::vector<heap> ring_stream<Ringbuffer>::pop_many(std::size_t max)
+{
+    std::vector<heap> out;
+    while (out.empty() && max > 0)
+        freeze_contiguous(ready_heaps.pop_many(max), out);
+    return out;
+}
+
+template<typename Ringbuffer>
+std::vector<heap> ring_stream<Ringbuffer>::pop_many(
+    std::size_t max, std::chrono::steady_clock::duration timeout)
+{
+    std::vector<heap> out;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (out.empty() && max > 0)
+    {
+        std::vector<live_heap> heaps = ready_heaps.pop_many(
+            max, deadline - std::chrono::steady_clock::now());
+        if (heaps.empty())
+            break;    // timed out
+        freeze_contiguous(std::move(heaps), out);
+    }
+    return out;
+}
+
+template<typename Ringbuffer>
+std::vector<live_heap> ring_stream<Ringbuffer>::pop_many_live(std::size_t max)
+{
+    return ready_heaps.pop_many(max);
+}
+
+template<typename Ringbuffer>
+std::vector<live_heap> ring_stream<Ringbuffer>::pop_many_live(
+    std::size_t max, std::chrono::steady_clock::duration timeout)
+{
+    return ready_heaps.pop_many(max, timeout);
+}
+
 template<typename Ringbuffer>
 void ring_stream<Ringbuffer>::stop_received()
 {
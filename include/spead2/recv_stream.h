@@ -212,6 +212,9 @@ private:
     /// Memory allocator used by heaps.
     std::shared_ptr<memory_allocator> allocator;
 
+    /// Recycled storage for heap metadata, shared with the heaps
+    const std::shared_ptr<heap_metadata_pool> metadata;
+
     /// @ref stop_received has been called, either externally or by stream control
     bool stopped = false;
 
@@ -30,6 +30,7 @@
 #include <cassert>
 #include <spead2/common_defines.h>
 #include <spead2/common_flavour.h>
+#include <spead2/common_memory_allocator.h>
 
 namespace spead2
 {
@@ -37,9 +38,26 @@ namespace send
 {
 
 class packet_generator;
+class heap_plan;
+
+/**
+ * A contiguous piece of an item value that is split across several buffers.
+ */
+struct item_fragment
+{
+    /// Pointer to the data
+    const std::uint8_t *ptr;
+    /// Number of bytes of data
+    std::size_t length;
+};
 
 /**
  * An item to be inserted into a heap. An item does *not* own its memory.
+ *
+ * The value of an item may either be contiguous, or be split into a list of
+ * fragments that are concatenated to form the value. Fragmented values are
+ * sent directly from the fragments, without first being copied together.
+ * The fragment list is also not owned by the item.
  */
 struct item
 {
@@ -64,10 +82,14 @@ struct item
     {
         struct
         {
-            /// Pointer to the value
+            /// Pointer to the value (@c nullptr if it is fragmented)
             const std::uint8_t *ptr;
-            /// Length of the value
+            /// Length of the value (total length if it is fragmented)
             std::size_t length;
+            /// Fragments making up the value, or @c nullptr if it is contiguous
+            const item_fragment *fragments;
+            /// Number of elements in @ref fragments
+            std::size_t n_fragments;
         } buffer;
 
         /**
@@ -90,6 +112,25 @@ struct item
     {
         data.buffer.ptr = reinterpret_cast<const std::uint8_t *>(ptr);
         data.buffer.length = length;
+        data.buffer.fragments = nullptr;
+        data.buffer.n_fragments = 0;
+    }
+
+    /**
+     * Create an item whose value is the concatenation of @a n_fragments
+     * fragments. The fragment array must remain valid for as long as the
+     * item is used.
+     */
+    item(s_item_pointer_t id, const item_fragment *fragments, std::size_t n_fragments,
+         bool allow_immediate)
+        : id(id), is_inline(false), allow_immediate(allow_immediate)
+    {
+        data.buffer.ptr = nullptr;
+        data.buffer.length = 0;
+        for (std::size_t i = 0; i < n_fragments; i++)
+            data.buffer.length += fragments[i].length;
+        data.buffer.fragments = fragments;
+        data.buffer.n_fragments = n_fragments;
     }
 
     /**
@@ -116,6 +157,37 @@ struct item
         : item(id, value.data(), value.size(), allow_immediate)
     {
     }
+
+    /**
+     * Construct an item referencing the fragments in a vector.
+     */
+    item(s_item_pointer_t id, const std::vector<item_fragment> &fragments, bool allow_immediate)
+        : item(id, fragments.data(), fragments.size(), allow_immediate)
+    {
+    }
+
+    /**
+     * Number of fragments in the value, where a contiguous value counts as
+     * a single fragment. This must not be used if @ref is_inline is true.
+     */
+    std::size_t num_fragments() const
+    {
+        assert(!is_inline);
+        return data.buffer.fragments ? data.buffer.n_fragments : 1;
+    }
+
+    /**
+     * Get a fragment of the value, where a contiguous value counts as a
+     * single fragment. This must not be used if @ref is_inline is true.
+     */
+    item_fragment get_fragment(std::size_t idx) const
+    {
+        assert(idx < num_fragments());
+        if (data.buffer.fragments)
+            return data.buffer.fragments[idx];
+        else
+            return item_fragment{data.buffer.ptr, data.buffer.length};
+    }
 };
 
 /**
@@ -124,6 +196,7 @@ struct item
 class heap
 {
     friend class packet_generator;
+    friend class heap_plan;
 private:
     flavour flavour_;
     bool repeat_pointers = false;
@@ -135,6 +208,13 @@ private:
      * needed. Items may point to either this storage or external storage.
      */
     std::vector<std::unique_ptr<std::uint8_t[]> > storage;
+    /**
+     * Transient storage obtained from a @ref memory_allocator, which is
+     * returned to the allocator when the heap is no longer needed.
+     */
+    std::vector<memory_allocator::pointer> allocations;
+    /// Precomputed packetisation, if any
+    std::shared_ptr<const heap_plan> plan;
 
 public:
     /// Opaque handle type for retrieving previously added items.
@@ -203,6 +283,32 @@ public:
         storage.push_back(std::move(pointer));
     }
 
+    /**
+     * Take over ownership of @a pointer and arrange for it to be returned
+     * to its allocator when the heap is freed.
+     */
+    void add_pointer(memory_allocator::pointer &&pointer)
+    {
+        allocations.push_back(std::move(pointer));
+    }
+
+    /**
+     * Allocate @a size bytes from @a allocator, owned by the heap. This is
+     * intended for use with a @ref memory_pool, so that item values can be
+     * stored without allocating memory in the steady state: the memory is
+     * returned to the pool when the heap is freed. Combined with the
+     * overload of @ref stream::async_send_heap that takes a
+     * <code>std::shared_ptr</code>, this happens as soon as the stream has
+     * finished with the heap.
+     *
+     * @return Pointer to the memory, which remains valid for the lifetime of the heap
+     */
+    std::uint8_t *allocate(const std::shared_ptr<memory_allocator> &allocator, std::size_t size)
+    {
+        allocations.push_back(allocator->allocate(size, nullptr));
+        return allocations.back().get();
+    }
+
     /**
      * Encode a descriptor to an item and add it to the heap.
      */
@@ -224,6 +330,9 @@ public:
         add_item(STREAM_CTRL_ID, CTRL_STREAM_STOP);
     }
 
+    /// Whether the heap contains an end-of-stream control item (see @ref add_end)
+    bool is_end() const;
+
     /**
      * Enable/disable repetition of item pointers in all packets.
      *
@@ -246,6 +355,22 @@ public:
     {
         return repeat_pointers;
     }
+
+    /**
+     * Attach a precomputed @ref heap_plan, which will be used to generate
+     * the packets if it matches the heap at the time it is sent (otherwise
+     * it is ignored). A plan may be shared by many heaps.
+     */
+    void set_plan(std::shared_ptr<const heap_plan> plan)
+    {
+        this->plan = std::move(plan);
+    }
+
+    /// Return the plan set by @ref set_plan.
+    const std::shared_ptr<const heap_plan> &get_plan() const
+    {
+        return plan;
+    }
 };
 
 } // namespace send
@@ -27,6 +27,8 @@
 #include <cstdint>
 #include <boost/asio/buffer.hpp>
 #include <spead2/common_defines.h>
+#include <spead2/common_flavour.h>
+#include <spead2/send_utils.h>
 
 namespace spead2
 {
@@ -34,27 +36,26 @@ namespace send
 {
 
 class heap;
+class heap_plan;
 
 /**
- * A packet ready for sending on the network. It contains some internally
- * held data, and const buffer sequence that contains a mix of pointers to
- * the internal data and pointers to the heap's items.
+ * A packet ready for sending on the network. It is a const buffer sequence
+ * that contains a mix of pointers to the packet header (which is written
+ * into storage provided by the caller of @ref packet_generator::next_packet)
+ * and pointers to the heap's items. It does not own any memory.
  *
  * If @a buffers is empty, it indicates the end of the heap.
- *
- * @todo Investigate whether number of new calls could be reduced by using
- * a pool for the case of packets with no item pointers other than the
- * per-packet ones.
  */
 struct packet
 {
-    std::unique_ptr<std::uint8_t[]> data;
     std::vector<boost::asio::const_buffer> buffers;
 };
 
 class packet_generator
 {
 private:
+    friend class heap_plan;
+
     // 8 bytes header, item pointerh for heap cnt, heap size, payload offset, payload size
     static constexpr std::size_t prefix_size = 8 + 4 * sizeof(item_pointer_t);
 
@@ -63,11 +64,23 @@ private:
     std::size_t max_packet_size;
     std::size_t max_item_pointers_per_packet;
 
+    /* Values that are the same for every packet in the heap, computed once
+     * by the constructor.
+     */
+    const pointer_encoder encoder;
+    const std::size_t max_immediate_size;
+    /// Packet header (host endian), excluding the number of item pointers
+    std::uint64_t header_base;
+    /// Encoded (big endian) item pointers for the heap cnt and heap length
+    item_pointer_t cnt_pointer, heap_length_pointer;
+
     /// Next item pointer to send
     std::size_t next_item_pointer = 0;
     /// Current item payload being sent
     std::size_t next_item = 0;
-    /// Amount of next_item already sent
+    /// Current fragment of next_item being sent
+    std::size_t next_fragment = 0;
+    /// Amount of next_fragment already sent
     std::size_t next_item_offset = 0;
     /// Address at which payload for the next item will be found
     std::size_t next_address = 0;
@@ -77,11 +90,167 @@ private:
     /// There is payload padding, so we need to add a NULL item pointer
     bool need_null_item = false;
 
+    /// Plan to follow instead of computing the packets, if any
+    const heap_plan *plan = nullptr;
+    /// Next packet to generate from @ref plan
+    std::size_t next_plan_packet = 0;
+
+    packet_generator(const heap &h, item_pointer_t cnt, std::size_t max_packet_size,
+                     const heap_plan *plan);
+
+    /**
+     * Append @a length bytes of payload (starting at @ref next_item) to
+     * @a out. If the padding is reached, it is written to @a padding.
+     */
+    void add_payload(packet &out, std::size_t length, item_pointer_t *padding);
+
 public:
+    /**
+     * Constructor. If the heap has a @ref heap_plan that matches it, the
+     * packets are generated from the plan.
+     */
     packet_generator(const heap &h, item_pointer_t cnt, std::size_t max_packet_size);
 
+    /**
+     * Number of bytes of scratch space that @ref next_packet may need for
+     * packet headers, given the maximum packet size.
+     */
+    static std::size_t max_header_size(std::size_t max_packet_size);
+
+    std::size_t get_max_packet_size() const { return max_packet_size; }
+
     bool has_next_packet() const;
-    packet next_packet();
+
+    /**
+     * Generate the next packet into @a out, reusing its storage. The
+     * header is written to @a scratch, which must have space for at least
+     * @ref max_header_size bytes, be 8-byte aligned, and remain valid for as
+     * long as the packet is used.
+     *
+     * @return the number of bytes at the start of @a scratch that the packet
+     * uses (a multiple of 8, and zero if there was no packet to generate)
+     */
+    std::size_t next_packet(packet &out, std::uint8_t *scratch);
+
+    /**
+     * Generate up to @a max packets (fewer if the heap ends first) into
+     * the packets pointed to by @a out. This is equivalent to calling
+     * @ref next_packet repeatedly, with the headers written consecutively
+     * from @a headers so that they form a single contiguous block, which
+     * is advanced past the headers that were written. It must have space
+     * for @a max times @ref max_header_size bytes.
+     *
+     * Once all the item pointers of a heap have been sent, the remaining
+     * packets differ only in their payload offset and length, and they are
+     * encoded in a single pass.
+     *
+     * @return the number of packets generated
+     */
+    std::size_t next_packets(packet *const *out, std::size_t max, std::uint8_t *&headers);
+};
+
+/**
+ * Precomputed division of a heap into packets. It is built from a template
+ * heap, and can then be used for any heap with the same layout (flavour,
+ * item IDs, item sizes, fragment sizes of addressed items, and the choice
+ * of immediate or addressed encoding), typically by attaching it with
+ * @ref heap::set_plan. Packet headers are encoded once, and generating a
+ * packet then only involves copying the header, patching in the heap
+ * counter and any immediate values, and pointing at the item data.
+ *
+ * If @a snapshot is passed to the constructor, the item values of the
+ * template heap are copied into the plan and sent in place of the values
+ * in the heap being transmitted (only the heap counter varies). This is
+ * intended for heaps whose content never changes, such as descriptors.
+ */
+class heap_plan
+{
+private:
+    friend class packet_generator;
+
+    /// Layout of an item, used to check whether a heap matches the plan
+    struct item_layout
+    {
+        s_item_pointer_t id;
+        bool is_inline;
+        bool immediate;
+        std::size_t length;
+        /// Index of the first element of @ref fragment_lengths for the item (if not immediate)
+        std::size_t first_fragment;
+        /// Number of fragments in the item (zero if immediate)
+        std::size_t n_fragments;
+    };
+
+    /// Item pointer that has to be re-encoded for each heap
+    struct patch
+    {
+        std::size_t offset;     ///< Byte offset in the header
+        std::size_t item;       ///< Index of the item in the heap
+    };
+
+    /// Piece of packet payload
+    struct segment
+    {
+        /// Pointer to snapshotted data, or @c nullptr to use the item
+        const std::uint8_t *ptr;
+        /// Index of the item in the heap, or @ref padding_item
+        std::size_t item;
+        /// Index of the fragment within the item
+        std::size_t fragment;
+        /// Byte offset within the fragment
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    struct packet_plan
+    {
+        std::size_t header_offset, header_size;
+        std::size_t first_patch, n_patches;
+        std::size_t first_segment, n_segments;
+    };
+
+    static constexpr std::size_t padding_item = std::size_t(-1);
+
+    flavour flavour_;
+    pointer_encoder encoder;
+    bool repeat_pointers;
+    std::size_t max_packet_size;
+    std::vector<item_layout> layout;
+    /// Lengths of the fragments of the addressed items, in item order
+    std::vector<std::size_t> fragment_lengths;
+    std::vector<std::uint8_t> headers;
+    std::vector<patch> patches;
+    std::vector<segment> segments;
+    std::vector<packet_plan> packets;
+    std::unique_ptr<std::uint8_t[]> snapshot_data;
+
+    /**
+     * Implementation of @ref packet_generator::next_packet, given the
+     * encoded (big endian) item pointer for the heap cnt.
+     */
+    void next_packet(std::size_t index, const heap &h, item_pointer_t cnt_pointer,
+                     packet &out, std::uint8_t *scratch) const;
+
+public:
+    /**
+     * Build a plan from a template heap.
+     *
+     * @param h               Template heap
+     * @param max_packet_size Maximum packet size of the streams that will use the plan
+     * @param snapshot        Copy the item values into the plan
+     *
+     * @throws std::invalid_argument if the heap cannot be packetised with @a max_packet_size
+     */
+    heap_plan(const heap &h, std::size_t max_packet_size, bool snapshot = false);
+
+    /// Whether @a h can be sent with this plan, with the given packet size
+    bool matches(const heap &h, std::size_t max_packet_size) const;
+
+    /// Number of packets in each heap
+    std::size_t get_n_packets() const { return packets.size(); }
+
+    /// Whether the item values were copied into the plan
+    bool is_snapshot() const { return bool(snapshot_data); }
 };
 
 } // namespace send
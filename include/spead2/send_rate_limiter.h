@@ -0,0 +1,134 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#ifndef SPEAD2_SEND_RATE_LIMITER_H
+#define SPEAD2_SEND_RATE_LIMITER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace spead2
+{
+
+namespace unittest { namespace send { namespace rate_limiter
+{
+    struct redistribute;
+}}}
+
+namespace send
+{
+
+class stream_impl_base;
+
+/**
+ * Rate limit shared by several send streams, such as all the streams using
+ * one network link. Streams are attached by passing the limiter to their
+ * @ref stream_config.
+ *
+ * Each stream is assigned a share of the total rate while it has heaps to
+ * send. Streams first receive their minimum guaranteed rates, and the
+ * remainder is divided in proportion to their weights. Streams whose queues
+ * are empty do not count, so their bandwidth is automatically given to the
+ * busy streams. In addition, the total transmitted by all the streams is
+ * bounded by a token bucket with the given rate and burst size.
+ *
+ * A stream that also has its own rate in its @ref stream_config never
+ * exceeds that rate, even if its share is larger.
+ *
+ * All the functions are thread-safe.
+ */
+class shared_rate_limiter
+{
+    friend class stream_impl_base;
+    friend struct ::spead2::unittest::send::rate_limiter::redistribute;
+public:
+    typedef std::chrono::high_resolution_clock clock_type;
+
+    static constexpr std::size_t default_burst_size = 65536;
+
+    /**
+     * Constructor.
+     *
+     * @param rate         Total rate, in bytes per second
+     * @param burst_size   Number of bytes the streams together may send ahead of @a rate
+     *
+     * @throws std::invalid_argument if @a rate is not positive and finite
+     */
+    explicit shared_rate_limiter(double rate, std::size_t burst_size = default_burst_size);
+
+    double get_rate() const { return rate; }
+    std::size_t get_burst_size() const { return burst_size; }
+
+    /// Number of attached streams
+    std::size_t get_num_streams() const;
+    /// Number of attached streams that currently have heaps to send
+    std::size_t get_num_active() const;
+    /// Sum of the minimum rates of the attached streams
+    double get_reserved_rate() const;
+
+private:
+    /// State of an attached stream
+    struct member
+    {
+        double weight = 1.0;
+        double min_rate = 0.0;
+        bool active = false;
+    };
+
+    const double rate;
+    const std::size_t burst_size;
+    /// Time it takes to send @ref burst_size bytes at @ref rate
+    const clock_type::duration burst_time;
+
+    mutable std::mutex mutex;
+    std::size_t num_streams = 0;
+    std::size_t num_active = 0;
+    double reserved_rate = 0.0;
+    /// Sum of weights of active streams
+    double active_weight = 0.0;
+    /// Sum of minimum rates of active streams
+    double active_min_rate = 0.0;
+    /// Time at which everything reserved so far will have been sent at @ref rate
+    clock_type::time_point link_time;
+
+    /**
+     * Attach a stream.
+     *
+     * @throws std::invalid_argument if the minimum rates would exceed the total
+     */
+    void attach(member &m, double weight, double min_rate);
+    void detach(member &m);
+    /// Mark a stream as having heaps to send or not
+    void set_active(member &m, bool active);
+    /// Rate currently allocated to a stream
+    double get_share(const member &m) const;
+    /**
+     * Account for @a bytes sent by any stream, and return the earliest time
+     * at which the next burst may start.
+     */
+    clock_type::time_point reserve(std::uint64_t bytes, clock_type::time_point now);
+};
+
+} // namespace send
+} // namespace spead2
+
+#endif // SPEAD2_SEND_RATE_LIMITER_H
@@ -22,11 +22,15 @@
 #define SPEAD2_SEND_STREAM_H
 
 #include <functional>
+#include <cstdint>
+#include <array>
 #include <utility>
 #include <vector>
+#include <map>
 #include <memory>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 #include <iterator>
 #include <type_traits>
 #include <condition_variable>
@@ -38,6 +42,7 @@
 #include <boost/utility/in_place_factory.hpp>
 #include <spead2/send_heap.h>
 #include <spead2/send_packet.h>
+#include <spead2/send_rate_limiter.h>
 #include <spead2/common_logging.h>
 #include <spead2/common_defines.h>
 #include <spead2/common_thread_pool.h>
@@ -55,6 +60,10 @@ public:
     static constexpr std::size_t default_max_heaps = 4;
     static constexpr std::size_t default_burst_size = 65536;
     static constexpr double default_burst_rate_ratio = 1.05;
+    static constexpr std::size_t default_max_interleave = 1;
+    static constexpr double default_spin_time = 0.0;
+    static constexpr double default_rate_weight = 1.0;
+    static constexpr std::size_t default_num_priorities = 1;
 
     void set_max_packet_size(std::size_t max_packet_size);
     std::size_t get_max_packet_size() const { return max_packet_size; }
@@ -67,6 +76,52 @@ public:
     void set_burst_rate_ratio(double burst_rate_ratio);
     double get_burst_rate_ratio() const { return burst_rate_ratio; }
 
+    /**
+     * Set the number of queued heaps whose packets may be interleaved. With
+     * the default of 1, all the packets of a heap are sent before the next
+     * heap is started. With larger values, packets are taken round-robin
+     * from up to this many heaps, which spreads the load on receivers that
+     * assemble several heaps in parallel. Heaps still complete in order,
+     * and an end-of-stream heap is never interleaved with other heaps.
+     */
+    void set_max_interleave(std::size_t max_interleave);
+    std::size_t get_max_interleave() const { return max_interleave; }
+
+    /**
+     * Set the time (in seconds) before each rate-limited burst for which
+     * the sending thread busy-waits instead of sleeping. Timer wake-ups are
+     * typically tens of microseconds late, so a spin time of that order
+     * makes bursts start much closer to their scheduled time, at the cost
+     * of keeping a CPU core busy. This makes small burst sizes practical;
+     * with a burst size no larger than the packet size, every packet is
+     * individually spaced. The default of 0 disables spinning.
+     */
+    void set_spin_time(double spin_time);
+    double get_spin_time() const { return spin_time; }
+
+    /**
+     * Share a rate limit with other streams. If @a rate_limiter is non-null,
+     * the stream is paced at the share of its rate that it is allocated
+     * (see @ref shared_rate_limiter), capped at the stream's own rate if
+     * that is non-zero.
+     */
+    void set_rate_limiter(std::shared_ptr<shared_rate_limiter> rate_limiter);
+    const std::shared_ptr<shared_rate_limiter> &get_rate_limiter() const { return rate_limiter; }
+    /// Set the weight for dividing the shared rate between streams
+    void set_rate_weight(double rate_weight);
+    double get_rate_weight() const { return rate_weight; }
+    /// Set the rate (in bytes per second) guaranteed to the stream from the shared rate
+    void set_min_rate(double min_rate);
+    double get_min_rate() const { return min_rate; }
+
+    /**
+     * Set the number of priority levels for heaps (see
+     * @ref stream::async_send_heap). Each level has its own queue of
+     * @ref get_max_heaps slots.
+     */
+    void set_num_priorities(std::size_t num_priorities);
+    std::size_t get_num_priorities() const { return num_priorities; }
+
     /// Get product of rate and burst_rate_ratio
     double get_burst_rate() const;
 
@@ -75,7 +130,13 @@ public:
         double rate = 0.0,
         std::size_t burst_size = default_burst_size,
         std::size_t max_heaps = default_max_heaps,
-        double burst_rate_ratio = default_burst_rate_ratio);
+        double burst_rate_ratio = default_burst_rate_ratio,
+        std::size_t max_interleave = default_max_interleave,
+        double spin_time = default_spin_time,
+        std::shared_ptr<shared_rate_limiter> rate_limiter = nullptr,
+        double rate_weight = default_rate_weight,
+        double min_rate = 0.0,
+        std::size_t num_priorities = default_num_priorities);
 
 private:
     std::size_t max_packet_size = default_max_packet_size;
@@ -83,6 +144,72 @@ private:
     std::size_t burst_size = default_burst_size;
     std::size_t max_heaps = default_max_heaps;
     double burst_rate_ratio = default_burst_rate_ratio;
+    std::size_t max_interleave = default_max_interleave;
+    double spin_time = default_spin_time;
+    std::shared_ptr<shared_rate_limiter> rate_limiter;
+    double rate_weight = default_rate_weight;
+    double min_rate = 0.0;
+    std::size_t num_priorities = default_num_priorities;
+};
+
+/**
+ * Statistics about how closely a stream follows its rate limit. Only
+ * bursts that are held back by the rate limit are counted.
+ *
+ * The histograms have power-of-two buckets: bucket 0 counts values under
+ * 1&nbsp;&micro;s, bucket @em i counts values in [2<sup>@em i-1</sup>,
+ * 2<sup>@em i</sup>) &micro;s, and the last bucket also counts everything
+ * larger.
+ */
+struct pacing_stats
+{
+    static constexpr std::size_t histogram_buckets = 16;
+    typedef std::array<std::uint64_t, histogram_buckets> histogram;
+
+    /// Number of rate-limited bursts
+    std::uint64_t bursts = 0;
+    /// Time by which each burst started after its scheduled time
+    histogram lateness{};
+    /// Time between the starts of consecutive bursts
+    histogram gap{};
+    /// Sum of the lateness of all bursts, in seconds
+    double total_lateness = 0.0;
+    /// Largest lateness of any burst, in seconds
+    double max_lateness = 0.0;
+};
+
+/**
+ * A heap to send with @ref stream::async_send_heaps, together with its cnt.
+ * It does not own the heap.
+ */
+struct heap_reference
+{
+    const heap &h;
+    /// Heap cnt, or -1 to assign it automatically
+    s_item_pointer_t cnt;
+    /// Destination (see @ref stream::async_send_heap)
+    std::size_t substream_index;
+
+    /// Shared ownership of @ref h, if the stream should keep it alive
+    std::shared_ptr<const heap> owner;
+
+    heap_reference(const heap &h, s_item_pointer_t cnt = -1, std::size_t substream_index = 0)
+        : h(h), cnt(cnt), substream_index(substream_index) {}
+
+    /**
+     * Reference a heap that the stream holds on to until it has finished
+     * with it (see @ref stream::async_send_heap).
+     */
+    heap_reference(std::shared_ptr<const heap> owner, s_item_pointer_t cnt = -1,
+                   std::size_t substream_index = 0)
+        : h(*owner), cnt(cnt), substream_index(substream_index), owner(std::move(owner)) {}
+};
+
+/// Outcome of sending one heap of a group passed to @ref stream::async_send_heaps
+struct heap_result
+{
+    boost::system::error_code ec;
+    item_pointer_t bytes_transferred = 0;
 };
 
 /**
@@ -95,10 +222,15 @@ private:
 
 protected:
     typedef std::function<void(const boost::system::error_code &ec, item_pointer_t bytes_transferred)> completion_handler;
+    /// Completion handler for @ref async_send_heaps, with one result per heap
+    typedef std::function<void(const std::vector<heap_result> &results)> group_completion_handler;
 
     explicit stream(io_service_ref io_service);
 
 public:
+    /// Value for @a substream_index that sends a heap to every substream
+    static constexpr std::size_t all_substreams = std::size_t(-1);
+
     /// Retrieve the io_service used for processing the stream
     boost::asio::io_service &get_io_service() const { return *io_service; }
 
@@ -136,10 +268,69 @@ public:
      * contribute to a single stream and must keep their heap cnts disjoint,
      * which the automatic assignment would not do.
      *
+     * Streams with several destinations (such as a @ref udp_stream
+     * constructed with a list of endpoints) send the heap to the one
+     * selected by @a substream_index, or to all of them if it is
+     * @ref all_substreams. In the latter case the packets are generated
+     * only once. An out-of-range index causes the heap to be rejected with
+     * @c boost::asio::error::invalid_argument.
+     *
+     * If the stream is configured with several priority levels (see
+     * @ref stream_config::set_num_priorities), @a priority selects the level,
+     * with higher values being more urgent. Packets are always taken from
+     * the most urgent heaps available, so a heap may overtake less urgent
+     * heaps, even part way through them; they still share the rate limit.
+     * Completion handlers are only guaranteed to be called in order for
+     * heaps with the same priority. Note that receivers discard incomplete
+     * heaps when the stream ends, so an end-of-stream heap must not be
+     * given a higher priority than data heaps that are still queued. An
+     * out-of-range priority causes the heap to be rejected with
+     * @c boost::asio::error::invalid_argument.
+     *
      * @retval  false  If the heap was immediately discarded
      * @retval  true   If the heap was enqueued
      */
-    virtual bool async_send_heap(const heap &h, completion_handler handler, s_item_pointer_t cnt = -1) = 0;
+    virtual bool async_send_heap(const heap &h, completion_handler handler, s_item_pointer_t cnt = -1,
+                                 std::size_t substream_index = 0, std::size_t priority = 0) = 0;
+
+    /**
+     * Send a heap asynchronously, sharing ownership of it with the stream.
+     * This is the same as the overload taking a reference, except that the
+     * caller does not need to keep the heap alive: the stream drops its
+     * reference as soon as it has finished with the heap (before @a handler
+     * is called). If the heap holds memory from a @ref memory_pool (see
+     * @ref heap::allocate), that memory is then returned to the pool.
+     */
+    virtual bool async_send_heap(std::shared_ptr<const heap> h, completion_handler handler,
+                                 s_item_pointer_t cnt = -1,
+                                 std::size_t substream_index = 0, std::size_t priority = 0) = 0;
+
+    /**
+     * Send a group of heaps asynchronously, with a single @a handler called
+     * once all of them have completed. The heaps are enqueued atomically:
+     * either they are all accepted, or none are, in which case every result
+     * has the same error (as for @ref async_send_heap). The heaps are sent
+     * consecutively, in order, and the results passed to @a handler are in
+     * the same order as @a heaps.
+     *
+     * This has less per-heap overhead than making a call to
+     * @ref async_send_heap for each heap. The group may not contain more
+     * heaps than the maximum queue depth. All the heaps have the same
+     * @a priority (see @ref async_send_heap). Heaps referenced through a
+     * <code>std::shared_ptr</code> are kept alive by the stream until it
+     * has finished with them.
+     *
+     * @retval  false  If the heaps were immediately discarded
+     * @retval  true   If the heaps were enqueued
+     */
+    virtual bool async_send_heaps(const std::vector<heap_reference> &heaps,
+                                  group_completion_handler handler, std::size_t priority = 0) = 0;
+
+    /// Number of destinations that heaps can be directed to
+    virtual std::size_t get_num_substreams() const = 0;
+
+    /// Retrieve statistics about rate limiting. This function is thread-safe.
+    virtual pacing_stats get_pacing_stats() const = 0;
 
     /**
      * Block until all enqueued heaps have been sent. This function is
@@ -170,32 +361,118 @@ private:
         EMPTY
     };
 
-    typedef boost::asio::basic_waitable_timer<std::chrono::high_resolution_clock> timer_type;
+    /// State shared by the heaps passed to a single call to @ref async_send_heaps
+    struct heap_group
+    {
+        std::vector<heap_result> results;
+        group_completion_handler handler;
+    };
 
     struct queue_item
     {
         const heap &h;
-        item_pointer_t cnt;
+        /// Heap cnt, or negative until an automatic cnt is assigned
+        s_item_pointer_t cnt;
+        /// Latest generation of @ref cnt_sequences when the heap was enqueued
+        std::uint64_t cnt_generation = 0;
+        std::size_t substream_index;
+        /// Index of the @ref lane holding this item
+        std::size_t priority;
         completion_handler handler;
         item_pointer_t bytes_sent = 0;
+        /**
+         * Packet generator, while packets are being generated from this
+         * heap. When non-empty, it must always have a next packet.
+         */
+        boost::optional<packet_generator> gen;
+        /// All packets have been sent, or the heap was aborted by an error
+        bool finished = false;
+        /// Result to report when the heap is completed
+        boost::system::error_code result;
+        /// Group this heap belongs to, if any (in which case @a handler is empty)
+        heap_group *group = nullptr;
+        /// Index of this heap within @a group
+        std::size_t group_index = 0;
+        /// Keeps @a h alive, if the stream shares ownership of it
+        std::shared_ptr<const heap> owner;
 
         queue_item() = default;
-        queue_item(const heap &h, item_pointer_t cnt, completion_handler &&handler) noexcept
-            : h(std::move(h)), cnt(cnt), handler(std::move(handler))
+        queue_item(const heap &h, s_item_pointer_t cnt, std::size_t substream_index,
+                   std::size_t priority, completion_handler &&handler) noexcept
+            : h(std::move(h)), cnt(cnt), substream_index(substream_index), priority(priority),
+            handler(std::move(handler))
+        {
+        }
+
+        queue_item(const heap &h, s_item_pointer_t cnt, std::size_t substream_index,
+                   std::size_t priority, heap_group *group, std::size_t group_index) noexcept
+            : h(h), cnt(cnt), substream_index(substream_index), priority(priority),
+            group(group), group_index(group_index)
         {
         }
     };
 
     typedef std::aligned_storage<sizeof(queue_item), alignof(queue_item)>::type queue_item_storage;
 
+    /**
+     * Slot in the queue. The sequence number implements a bounded
+     * multi-producer, single-consumer queue (due to Dmitry Vyukov). For the
+     * slot holding position @em pos (modulo the capacity):
+     * - @a sequence == @em pos: the slot is free for a producer to claim;
+     * - @a sequence == @em pos + 1: the item has been constructed and can be
+     *   consumed;
+     * - otherwise the slot is still occupied by an earlier item (the queue is
+     *   full) or has been claimed by another producer.
+     */
+    struct queue_slot
+    {
+        std::atomic<std::size_t> sequence;
+        queue_item_storage storage;
+    };
+
+    /**
+     * Queue for one priority level, together with the consumer's state for
+     * it. The queue is circular with config.max_heaps slots. Positions are
+     * counters that increase without bound, and are reduced modulo the
+     * capacity to find the slot. Items from @ref queue_head up to (but
+     * excluding) the first position that has not been published are
+     * constructed in place, while the rest is uninitialised raw storage.
+     * Producers never take a lock; only the thread running
+     * @ref stream_impl::do_next consumes.
+     */
+    struct lane
+    {
+        std::unique_ptr<queue_slot[]> queue;
+        /// Position of the oldest heap that has not been completed (consumer only)
+        std::size_t queue_head = 0;
+        /// Next position for a producer to claim
+        std::atomic<std::size_t> queue_tail{0};
+        /// Position of the next heap to start generating packets from (consumer only)
+        std::size_t active = 0;
+        /**
+         * Heaps that packets are currently being generated from, in queue
+         * order (at most config.max_interleave). Each has a non-empty
+         * generator.
+         */
+        std::vector<queue_item *> active_heaps;
+        /// Index in @ref active_heaps of the heap to take the next packet from
+        std::size_t next_active_heap = 0;
+    };
+
 protected:
+    typedef boost::asio::basic_waitable_timer<std::chrono::high_resolution_clock> timer_type;
+
     struct transmit_packet
     {
         packet pkt;
         std::size_t size;
         bool last;          // if this is the last packet in the heap
+        /// Destination, or @ref stream::all_substreams
+        std::size_t substream_index;
         queue_item *item;
         boost::system::error_code result;
+        /// Time at which the rate limit allows the packet to leave (see @ref enable_send_times)
+        timer_type::time_point send_time;
     };
 
     std::unique_ptr<transmit_packet[]> current_packets;
@@ -204,27 +481,41 @@ protected:
 
 private:
     const stream_config config;
-    const double seconds_per_byte_burst, seconds_per_byte;
-
+    const std::size_t num_substreams;
     /**
-     * Protects access to
-     * - @ref queue_head and @ref queue_tail
-     * - @ref state
-     * - @ref next_cnt and @ref step_cnt
+     * Storage for the headers of @ref current_packets, with room for
+     * @ref header_slot_size bytes per packet. The headers are packed one
+     * after the other, so that those of a batch form one contiguous block,
+     * and the storage is reused once the packets have been processed, so
+     * that generating a packet does not need to allocate memory.
      */
-    std::mutex queue_mutex;
+    std::unique_ptr<std::uint64_t[]> header_arena;
+    const std::size_t header_slot_size;
+    /// Pointers to the packets in @ref current_packets, for @ref packet_generator::next_packets
+    std::unique_ptr<packet *[]> current_packet_ptrs;
     /**
-     * Circular queue with config.max_heaps + 1 slots, which must never be full
-     * (because that can't be distinguished from empty). Items from @ref
-     * queue_head to @ref queue_tail are constructed in place, while the rest
-     * is uninitialised raw storage.
+     * Lanes of the heaps that finished in @ref process_results, in the order
+     * in which they finished (at most one entry per packet).
      */
-    std::unique_ptr<queue_item_storage[]> queue;
-    /// Bounds of the queue
-    std::size_t queue_head = 0, queue_tail = 0;
-    /// Item holding data for the next packet to send
-    std::size_t active = 0;   // queue slot for next packet to send
-    state_t state = state_t::EMPTY;
+    std::unique_ptr<std::size_t[]> finished_lanes;
+    /// Inverse rates; these change over time if there is a shared rate limiter
+    double seconds_per_byte_burst, seconds_per_byte;
+    /// Membership of config.get_rate_limiter(), if there is one
+    shared_rate_limiter::member limiter_member;
+    /// Time before each burst to busy-wait rather than sleep
+    const timer_type::duration spin_time;
+
+    /// One queue per priority level, from least to most urgent
+    std::unique_ptr<lane[]> lanes;
+    /**
+     * Current state. Producers only change it from @c EMPTY to @c QUEUED,
+     * and whichever thread makes that transition is responsible for
+     * scheduling @ref stream_impl::do_next. All other transitions are made
+     * by the consumer.
+     */
+    std::atomic<state_t> state{state_t::EMPTY};
+    /// Protects the transition to @c EMPTY, for the benefit of @ref flush
+    std::mutex flush_mutex;
     timer_type timer;
     /// Time at which next burst should be sent, considering the burst rate
     timer_type::time_point send_time_burst;
@@ -232,55 +523,124 @@ private:
     timer_type::time_point send_time;
     /// Number of bytes sent since send_time and sent_time_burst were updated
     std::uint64_t rate_bytes = 0;
-    /// Heap cnt for the next heap to send
-    item_pointer_t next_cnt = 1;
-    /// Increment to next_cnt after each heap
-    item_pointer_t step_cnt = 1;
+    /// Time at which the burst being slept for should start (state @c SLEEPING)
+    timer_type::time_point sleep_target;
+    /// Start time of the previous rate-limited burst (zero if none)
+    timer_type::time_point last_burst;
+    /// Whether to fill in @ref transmit_packet::send_time
+    bool send_times_enabled = false;
+    /// How far ahead of the rate limit packets may be passed to the derived class
+    timer_type::duration lookahead = timer_type::duration::zero();
+    pacing_stats stats;
+    /// Protects @ref stats
+    mutable std::mutex stats_mutex;
+    /// Linear sequence of automatic heap cnts (see @ref set_cnt_sequence)
+    struct cnt_sequence
+    {
+        item_pointer_t next;
+        item_pointer_t step;
+    };
     /**
-     * Packet generator for the active heap. It may be empty at any time, which
-     * indicates that it should be initialised from the heap indicated by
-     * @ref active.
-     *
-     * When non-empty, it must always have a next packet i.e. after
-     * exhausting it, it must be cleared/changed.
+     * Sequences passed to @ref set_cnt_sequence, indexed by generation
+     * (starting with the default sequence as generation 0). A heap with an
+     * automatic cnt records the latest generation when it is enqueued, and
+     * takes the next cnt from that sequence when it starts to be sent.
+     * Producers thus need no coordination, and automatic cnts follow the
+     * order in which heaps are sent. Older generations are discarded when
+     * the queue empties. Entries are only modified by the sending thread.
      */
-    boost::optional<packet_generator> gen;
+    std::map<std::uint64_t, cnt_sequence> cnt_sequences;
+    /// Protects the structure (but not the values) of @ref cnt_sequences
+    std::mutex cnt_mutex;
+    /// Latest generation in @ref cnt_sequences
+    std::atomic<std::uint64_t> cnt_generation{0};
+    /// Element of @ref cnt_sequences last used by the sending thread, if still present
+    cnt_sequence *active_cnt_sequence = nullptr;
+    /// Generation of @ref active_cnt_sequence
+    std::uint64_t active_cnt_generation = 0;
     /// Signalled when transitioning to EMPTY state
     std::condition_variable heap_empty;
 
-    /// Get next slot position in queue
-    std::size_t next_queue_slot(std::size_t cur) const;
+    /// Access an item from a queue, given its position
+    queue_item *get_queue(lane &l, std::size_t pos);
+
+    /// Whether the item at @a pos has been published by its producer
+    bool queue_ready(const lane &l, std::size_t pos) const;
+
+    /// Whether there are packets to send from a lane
+    bool lane_has_work(const lane &l) const;
+
+    /// Whether there are packets to send from any lane
+    bool has_work() const;
 
-    /// Access an item from the queue
-    queue_item *get_queue(std::size_t idx);
+    /// Whether a lane more urgent than @a priority has a heap waiting to start
+    bool preempted(std::size_t priority) const;
 
     /**
-     * Advance @ref active to the next heap and clear @ref gen.
-     * It does not need @ref queue_mutex.
+     * Claim @a n consecutive positions in a queue for new items, without
+     * blocking. The first is returned in @a pos.
+     *
+     * @retval false if the queue does not have space for all of them
+     */
+    bool reserve_queue_slots(lane &l, std::size_t &pos, std::size_t n = 1);
+
+    /// Take the next cnt from the sequence for @a generation (sending thread only)
+    item_pointer_t next_auto_cnt(std::uint64_t generation);
+
+    /// Discard all but the latest generation from @ref cnt_sequences
+    void prune_cnt_sequences();
+
+    /**
+     * Make the @a n items constructed from @a pos onwards visible to the
+     * consumer, and transition from @c EMPTY to @c QUEUED if necessary.
+     *
+     * @retval true if the caller must schedule @ref stream_impl::do_next
      */
-    void next_active();
+    bool publish_queue_slots(lane &l, std::size_t pos, std::size_t n = 1);
+
+    /// Number of copies of each packet that are sent for @a substream_index
+    std::size_t substream_copies(std::size_t substream_index) const;
+
+    /// Complete every heap in @a group with error @a ec, without sending them
+    void reject_group(std::unique_ptr<heap_group> group, const boost::system::error_code &ec);
 
     /**
-     * Set the result of the first heap in the queue and remove it. This must be
-     * called with @ref queue_mutex held.
+     * Enqueue a group of heaps for @ref stream_impl::async_send_heaps. On
+     * return, @a wake indicates whether the caller must schedule
+     * @ref stream_impl::do_next.
+     *
+     * @retval true if the heaps were enqueued
      */
-    void post_handler(boost::system::error_code result);
+    bool enqueue_group(const std::vector<heap_reference> &heaps, group_completion_handler &&handler,
+                       std::size_t priority, bool &wake);
 
     /**
-     * Whether a full burst has been transmitted, requiring some sleep time.
-     * Does not require @ref queue_mutex.
+     * Move to the @c EMPTY state, when there is nothing left to send. This
+     * handles a producer racing to publish an item after the consumer found
+     * the queue empty.
+     *
+     * @retval true if an item arrived and the caller must schedule
+     * @ref stream_impl::do_next
      */
+    bool transition_empty();
+
+    /// Stop generating packets from @ref lane::active_heaps[@a idx] and remove it
+    void retire_active_heap(lane &l, std::size_t idx);
+
+    /// Report the result of the first heap in a queue and remove it.
+    void post_handler(lane &l);
+
+    /// Whether a full burst has been transmitted, requiring some sleep time.
     bool must_sleep() const;
 
     /**
-     * Apply per-packet transmission results to the queue. This must be called
-     * with @ref queue_mutex held.
+     * Apply per-packet transmission results to the queue, and complete the
+     * heaps at the front of the queue that have finished.
      */
     void process_results();
 
     /**
      * Update @ref send_time_burst and @ref send_time from @ref rate_bytes.
-     * Does not require @ref queue_mutex.
      *
      * @param now       Current time
      * @returns         Time at which next packet should be sent
@@ -290,18 +650,47 @@ private:
     /// Update @ref send_time after a period in state @c EMPTY.
     void update_send_time_empty();
 
+    /// Set @ref seconds_per_byte and @ref seconds_per_byte_burst from the current rate
+    void update_rates();
+
+    /// Busy-wait until @a target, returning the current time
+    static timer_type::time_point spin_until(timer_type::time_point target);
+
+    /// Update @ref stats for a burst scheduled at @a target that started at @a now
+    void record_burst(timer_type::time_point now, timer_type::time_point target);
+
+    /// Time at which the rate limit allows the next packet to be sent
+    timer_type::time_point next_send_time() const;
+
     /**
      * Populate @ref current_packets and @ref n_current_packets with packets to
-     * send. This is called without @ref queue_mutex held. It takes a copy of
-     * @ref queue_tail so that it does not need the lock to access the original.
+     * send, from heaps that have been published.
      */
-    void load_packets(std::size_t tail);
+    void load_packets();
 
 protected:
-    stream_impl_base(io_service_ref io_service, const stream_config &config, std::size_t max_current_packets);
+    stream_impl_base(io_service_ref io_service, const stream_config &config,
+                     std::size_t max_current_packets, std::size_t num_substreams = 1);
     virtual ~stream_impl_base() override;
 
+    /**
+     * Hand packets to the derived class up to @a lookahead before the rate
+     * limit allows them to be sent, with @ref transmit_packet::send_time
+     * set to the time at which each one is due. This is for transports
+     * that can delegate pacing to hardware or the kernel. It must be called
+     * before any heaps are enqueued.
+     */
+    void enable_send_times(timer_type::duration lookahead);
+
 public:
+    virtual std::size_t get_num_substreams() const override final { return num_substreams; }
+
+    virtual pacing_stats get_pacing_stats() const override final;
+
+    /**
+     * Modify the linear sequence used to generate heap cnts (see
+     * @ref stream::set_cnt_sequence). This function is thread-safe.
+     */
     virtual void set_cnt_sequence(item_pointer_t next, item_pointer_t step) override;
 
     /**
@@ -314,8 +703,9 @@ public:
 
 /**
  * Stream that sends packets at a maximum rate. It also serialises heaps so
- * that only one heap is being sent at a time. Heaps are placed in a queue, and
- * if the queue becomes too deep heaps are discarded.
+ * that only one heap (or up to the configured interleave limit) is being sent
+ * at a time. Heaps are placed in a queue, and if the queue becomes too deep
+ * heaps are discarded.
  *
  * The stream operates as a state machine, depending on which handlers are
  * pending:
@@ -330,10 +720,12 @@ public:
  * @ref packets_handler to be called (but not before returning). It may assume
  * that there is at least one packet to send.
  *
- * There are two mechanisms to protect shared data: the @ref do_next callback
- * is only ever scheduled once, so it does not need to lock data for which it
- * is the only user. Data also accessed by user-facing functions are protected
- * by a mutex.
+ * The @ref do_next callback is only ever scheduled once, so it does not
+ * need to lock data for which it is the only user. Heaps are passed to it
+ * through a lock-free queue, and a producer that finds the stream in the
+ * @c EMPTY state moves it to @c QUEUED with an atomic operation and
+ * schedules @ref do_next. Thus neither producers nor the sending thread take
+ * a lock in the common case.
  */
 template<typename Derived>
 class stream_impl : public stream_impl_base
@@ -346,39 +738,41 @@ private:
      */
     void do_next()
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        if (state == state_t::SENDING)
+        state_t cur_state = state.load(std::memory_order_relaxed);
+        if (cur_state == state_t::SENDING)
             process_results();
-        else if (state == state_t::QUEUED)
+        else if (cur_state == state_t::QUEUED)
             update_send_time_empty();
-        assert(active == queue_head);
+        else if (cur_state == state_t::SLEEPING)
+            record_burst(spin_until(sleep_target), sleep_target);
 
         if (must_sleep())
         {
             auto now = timer_type::clock_type::now();
-            auto target_time = update_send_times(now);
-            if (now < target_time)
+            auto target_time = update_send_times(now) - lookahead;
+            if (target_time - now > spin_time)
             {
-                state = state_t::SLEEPING;
-                timer.expires_at(target_time);
+                // Sleep until shortly before the burst is due, then spin
+                sleep_target = target_time;
+                state.store(state_t::SLEEPING, std::memory_order_relaxed);
+                timer.expires_at(target_time - spin_time);
                 timer.async_wait([this](const boost::system::error_code &) { do_next(); });
                 return;
             }
+            // Only count bursts that the rate limit actually holds back
+            if (target_time > now)
+                record_burst(spin_until(target_time), target_time);
         }
 
-        if (queue_head == queue_tail)
+        if (!has_work())
         {
-            state = state_t::EMPTY;
-            heap_empty.notify_all();
+            if (transition_empty())
+                get_io_service().post([this] { do_next(); });
             return;
         }
 
-        // Save a copy to use outside the protection of the lock.
-        std::size_t tail = queue_tail;
-        state = state_t::SENDING;
-        lock.unlock();
-
-        load_packets(tail);
+        state.store(state_t::SENDING, std::memory_order_relaxed);
+        load_packets();
         assert(n_current_packets > 0);
         static_cast<Derived *>(this)->async_send_packets();
     }
@@ -398,44 +792,75 @@ protected:
 
     using stream_impl_base::stream_impl_base;
 
-public:
-    virtual bool async_send_heap(const heap &h, completion_handler handler, s_item_pointer_t cnt = -1) override
+private:
+    /// Implementation of both overloads of @ref async_send_heap
+    bool enqueue_heap(const heap &h, std::shared_ptr<const heap> &&owner,
+                      completion_handler &&handler, s_item_pointer_t cnt,
+                      std::size_t substream_index, std::size_t priority)
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        std::size_t new_tail = next_queue_slot(queue_tail);
-        if (new_tail == queue_head)
+        item_pointer_t cnt_mask = (item_pointer_t(1) << h.get_flavour().get_heap_address_bits()) - 1;
+        if (cnt >= 0 && item_pointer_t(cnt) > cnt_mask)
         {
-            lock.unlock();
-            log_warning("async_send_heap: dropping heap because queue is full");
-            get_io_service().post(std::bind(handler, boost::asio::error::would_block, 0));
+            log_warning("async_send_heap: dropping heap because cnt is out of range");
+            get_io_service().post(std::bind(handler, boost::asio::error::invalid_argument, 0));
             return false;
         }
-        item_pointer_t cnt_mask = (item_pointer_t(1) << h.get_flavour().get_heap_address_bits()) - 1;
-        if (cnt < 0)
+        if (substream_index >= get_num_substreams() && substream_index != all_substreams)
         {
-            cnt = next_cnt & cnt_mask;
-            next_cnt += step_cnt;
+            log_warning("async_send_heap: dropping heap because substream index is out of range");
+            get_io_service().post(std::bind(handler, boost::asio::error::invalid_argument, 0));
+            return false;
         }
-        else if (item_pointer_t(cnt) > cnt_mask)
+        if (priority >= config.get_num_priorities())
         {
-            lock.unlock();
-            log_warning("async_send_heap: dropping heap because cnt is out of range");
+            log_warning("async_send_heap: dropping heap because priority is out of range");
             get_io_service().post(std::bind(handler, boost::asio::error::invalid_argument, 0));
             return false;
         }
 
+        lane &l = lanes[priority];
+        std::size_t pos;
+        if (!reserve_queue_slots(l, pos))
+        {
+            log_warning("async_send_heap: dropping heap because queue is full");
+            get_io_service().post(std::bind(handler, boost::asio::error::would_block, 0));
+            return false;
+        }
+
         // Construct in place
-        new (get_queue(queue_tail)) queue_item(h, cnt, std::move(handler));
-        queue_tail = new_tail;
+        queue_item *item = new (get_queue(l, pos)) queue_item(
+            h, cnt, substream_index, priority, std::move(handler));
+        if (cnt < 0)
+            item->cnt_generation = cnt_generation.load(std::memory_order_acquire);
+        item->owner = std::move(owner);
+        if (publish_queue_slots(l, pos))
+            get_io_service().dispatch([this] { do_next(); });
+        return true;
+    }
 
-        bool empty = (state == state_t::EMPTY);
-        if (empty)
-            state = state_t::QUEUED;
-        lock.unlock();
+public:
+    virtual bool async_send_heap(const heap &h, completion_handler handler, s_item_pointer_t cnt = -1,
+                                 std::size_t substream_index = 0, std::size_t priority = 0) override
+    {
+        return enqueue_heap(h, nullptr, std::move(handler), cnt, substream_index, priority);
+    }
+
+    virtual bool async_send_heap(std::shared_ptr<const heap> h, completion_handler handler,
+                                 s_item_pointer_t cnt = -1,
+                                 std::size_t substream_index = 0, std::size_t priority = 0) override
+    {
+        const heap &ref = *h;
+        return enqueue_heap(ref, std::move(h), std::move(handler), cnt, substream_index, priority);
+    }
 
-        if (empty)
+    virtual bool async_send_heaps(const std::vector<heap_reference> &heaps,
+                                  group_completion_handler handler, std::size_t priority = 0) override
+    {
+        bool wake;
+        bool accepted = enqueue_group(heaps, std::move(handler), priority, wake);
+        if (wake)
             get_io_service().dispatch([this] { do_next(); });
-        return true;
+        return accepted;
     }
 };
 
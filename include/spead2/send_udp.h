@@ -29,6 +29,9 @@
 # include <sys/socket.h>
 # include <sys/types.h>
 #endif
+#if SPEAD2_USE_TXTIME
+# include <time.h>
+#endif
 #include <boost/asio.hpp>
 #include <utility>
 #include <vector>
@@ -40,27 +43,82 @@ namespace spead2
 namespace send
 {
 
+/**
+ * Stream that sends packets over UDP. It may have several destinations
+ * (substreams), in which case each heap is sent to the one selected when it
+ * is queued, or to all of them. All destinations share a single socket and
+ * the rate limit of the stream.
+ */
 class udp_stream : public stream_impl<udp_stream>
 {
 private:
     friend class stream_impl<udp_stream>;
+
+    /// A datagram to transmit: one copy of a packet to one endpoint
+    struct message
+    {
+        std::size_t packet;     ///< Index into @ref current_packets
+        std::size_t endpoint;   ///< Index into @ref endpoints
+    };
+
     boost::asio::ip::udp::socket socket;
-    boost::asio::ip::udp::endpoint endpoint;
+    std::vector<boost::asio::ip::udp::endpoint> endpoints;
+    /// Datagrams for the current batch of packets
+    std::vector<message> messages;
 
-    /// Implements async_send_packets, starting from @a first
+    /// Implements async_send_packets, starting from message @a first
     void send_packets(std::size_t first);
 
+    /// Record a failure to send message @a idx against its packet
+    void set_error(std::size_t idx, const boost::system::error_code &ec);
+
     void async_send_packets();
 
     static constexpr int batch_size = 64;
 #if SPEAD2_USE_SENDMMSG
-    struct mmsghdr msgvec[batch_size];
+    /// Headers corresponding to @ref messages
+    std::vector<struct mmsghdr> msgvec;
     std::vector<struct iovec> msg_iov;
 #endif
+#if SPEAD2_USE_TXTIME
+    /// Ancillary data holding the launch time of one message
+    union txtime_control
+    {
+        char buffer[CMSG_SPACE(sizeof(std::uint64_t))];
+        struct cmsghdr align;
+    };
+
+    /// Whether to attach launch times to packets (see @ref enable_txtime)
+    bool txtime = false;
+    clockid_t txtime_clock;
+    /// Launch times corresponding to @ref messages, if @ref txtime is set
+    std::vector<txtime_control> msg_control;
+
+    /// Fill in the launch times for @ref messages
+    void set_txtimes();
+
+    /**
+     * Read the packet drops that the queuing discipline has reported on the
+     * socket's error queue, and log them. They cannot be tied back to
+     * heaps, because the heaps have usually completed by then.
+     */
+    void drain_txtime_errors();
+#endif
+
+    udp_stream(
+        io_service_ref io_service,
+        boost::asio::ip::udp::socket &&socket,
+        std::vector<boost::asio::ip::udp::endpoint> endpoints,
+        const stream_config &config,
+        std::size_t buffer_size);
 
 public:
     /// Socket send buffer size, if none is explicitly passed to the constructor
     static constexpr std::size_t default_buffer_size = 512 * 1024;
+#if SPEAD2_USE_TXTIME
+    /// Default for the @a lookahead argument to @ref enable_txtime
+    static constexpr double default_txtime_lookahead = 0.001;
+#endif
 
     /**
      * Constructor.
@@ -85,6 +143,29 @@ public:
         std::size_t buffer_size = default_buffer_size,
         const boost::asio::ip::address &interface_address = boost::asio::ip::address());
 
+    /**
+     * Constructor with multiple destinations. Heaps are sent to the
+     * destination given by the @a substream_index passed to
+     * @ref async_send_heap, which indexes @a endpoints, or to all of them.
+     *
+     * @param io_service   I/O service for sending data
+     * @param endpoints    Destination addresses and ports
+     * @param config       Stream configuration
+     * @param buffer_size  Socket buffer size (0 for OS default)
+     * @param interface_address   Source address
+     *                            @verbatim embed:rst:leading-asterisks
+     *                            (see tips on :ref:`routing`)
+     *                            @endverbatim
+     *
+     * @throws std::invalid_argument if @a endpoints is empty or mixes IPv4 and IPv6
+     */
+    udp_stream(
+        io_service_ref io_service,
+        const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
+        const stream_config &config = stream_config(),
+        std::size_t buffer_size = default_buffer_size,
+        const boost::asio::ip::address &interface_address = boost::asio::ip::address());
+
 #if BOOST_VERSION < 107000
     /**
      * Constructor using an existing socket. The socket must be open but
@@ -138,6 +219,17 @@ public:
         const boost::asio::ip::udp::endpoint &endpoint,
         const stream_config &config = stream_config());
 
+    /**
+     * Constructor using an existing socket and multiple destinations (see
+     * above). The socket must be open but not connected, and the
+     * io_service must match the socket's.
+     */
+    udp_stream(
+        io_service_ref io_service,
+        boost::asio::ip::udp::socket &&socket,
+        const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
+        const stream_config &config = stream_config());
+
     /**
      * Constructor with multicast hop count.
      *
@@ -178,6 +270,31 @@ public:
         int ttl,
         const boost::asio::ip::address &interface_address);
 
+    /**
+     * Constructor with multiple multicast destinations, hop count and
+     * outgoing interface address (IPv4 only). Heaps are sent to the
+     * destination given by the @a substream_index passed to
+     * @ref async_send_heap, which indexes @a endpoints, or to all of them.
+     *
+     * @param io_service   I/O service for sending data
+     * @param endpoints    Multicast groups and ports
+     * @param config       Stream configuration
+     * @param buffer_size  Socket buffer size (0 for OS default)
+     * @param ttl          Maximum number of hops
+     * @param interface_address   Address of the outgoing interface
+     *
+     * @throws std::invalid_argument if @a endpoints is empty
+     * @throws std::invalid_argument if any of @a endpoints is not an IPv4 multicast address
+     * @throws std::invalid_argument if @a interface_address is not an IPv4 address
+     */
+    udp_stream(
+        io_service_ref io_service,
+        const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
+        const stream_config &config,
+        std::size_t buffer_size,
+        int ttl,
+        const boost::asio::ip::address &interface_address);
+
     /**
      * Constructor with multicast hop count and outgoing interface address
      * (IPv6 only).
@@ -201,6 +318,41 @@ public:
         int ttl,
         unsigned int interface_index);
 
+#if SPEAD2_USE_TXTIME
+    /**
+     * Let the kernel pace the stream. Each packet is given a launch time
+     * (with @c SO_TXTIME), which is when the rate limit allows it to be sent,
+     * and packets are handed to the kernel up to @a lookahead seconds in
+     * advance instead of the sending thread sleeping until they are due.
+     * This reduces wake-ups and jitter, and spaces packets evenly even
+     * within a burst.
+     *
+     * The launch times are only honoured if the outgoing interface has a
+     * queuing discipline that supports them: @c fq (which requires
+     * @c CLOCK_MONOTONIC) or @c etf (which normally uses @c CLOCK_TAI).
+     * Otherwise packets are sent as soon as they are handed to the kernel,
+     * so pacing is only as good as @a lookahead allows. This has no effect
+     * on streams without a rate limit.
+     *
+     * A queuing discipline may drop packets whose launch time has already
+     * passed or is invalid (@c etf does so, @c fq does not). These drops are
+     * not reflected in the heap completion status, because they are only
+     * reported after the packets have been handed over. Instead, they are
+     * collected from the socket's error queue each time a batch is sent,
+     * and logged as warnings.
+     *
+     * This must be called before any heaps are enqueued.
+     *
+     * @param lookahead    Maximum time (in seconds) ahead of schedule to pass packets to the kernel
+     * @param clock_id     Clock against which launch times are specified
+     *
+     * @throws std::system_error if the kernel does not support @c SO_TXTIME
+     * @throws std::invalid_argument if @a lookahead is negative
+     */
+    void enable_txtime(double lookahead = default_txtime_lookahead,
+                       clockid_t clock_id = CLOCK_MONOTONIC);
+#endif
+
     virtual ~udp_stream();
 };
 
@@ -0,0 +1,123 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#ifndef SPEAD2_SEND_UDP_PACKET_MMAP_H
+#define SPEAD2_SEND_UDP_PACKET_MMAP_H
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <spead2/common_features.h>
+#if SPEAD2_USE_PACKET_MMAP
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <boost/asio.hpp>
+#include <spead2/send_packet.h>
+#include <spead2/send_stream.h>
+#include <spead2/common_raw_packet.h>
+
+namespace spead2
+{
+namespace send
+{
+
+/**
+ * Stream that writes complete Ethernet frames into a memory-mapped
+ * AF_PACKET transmit ring (PACKET_TX_RING), bypassing the kernel's IP and
+ * UDP stack. The Ethernet, IPv4 and UDP headers are built once per frame
+ * when the stream is created, and only the lengths and IP checksum are
+ * updated for each packet. The kernel is notified once per batch.
+ *
+ * Like @ref udp_ibv_stream, only IPv4 multicast with an explicit source
+ * address is supported. It requires the @c CAP_NET_RAW capability.
+ *
+ * Packets are reported as sent once they have been handed to the kernel.
+ * The kernel drops (without reporting) any frame that it rejects, so the
+ * constructor checks that the packets fit in the interface MTU.
+ */
+class udp_packet_mmap_stream : public stream_impl<udp_packet_mmap_stream>
+{
+private:
+    friend class stream_impl<udp_packet_mmap_stream>;
+
+    boost::asio::ip::udp::socket socket; // used only to assign a source UDP port
+    boost::asio::posix::stream_descriptor packet_socket;
+    /// Used to back off while the kernel is not picking up frames
+    boost::asio::basic_waitable_timer<std::chrono::steady_clock> retry_timer;
+    std::chrono::microseconds retry_delay;
+    std::uint8_t *ring = nullptr;
+    std::size_t ring_size = 0;
+    std::size_t frame_size = 0;
+    std::size_t n_frames = 0;
+    /// Index of the next frame to fill
+    std::size_t next_frame = 0;
+
+    static constexpr int batch_size = 64;
+
+    /// Returns the frame with a given index
+    std::uint8_t *get_frame(std::size_t idx) const { return ring + idx * frame_size; }
+    /// Returns the Ethernet frame stored in a ring frame
+    ethernet_frame get_ethernet_frame(std::size_t idx) const;
+
+    /// Implements async_send_packets, starting from @a first
+    void send_packets(std::size_t first);
+
+    /// Ask the kernel to transmit the frames filled in so far
+    boost::system::error_code kick();
+
+    void async_send_packets();
+
+public:
+    /// Default size of the transmit ring, if none is passed to the constructor
+    static constexpr std::size_t default_buffer_size = 512 * 1024;
+
+    /**
+     * Constructor.
+     *
+     * @param io_service   I/O service for sending data
+     * @param endpoint     Multicast group and port
+     * @param config       Stream configuration
+     * @param interface_address   Address of the outgoing interface
+     * @param buffer_size  Size of the transmit ring (rounded to a whole number of frames)
+     * @param ttl          Maximum number of hops
+     *
+     * @throws std::invalid_argument if @a endpoint is not an IPv4 multicast address
+     * @throws std::invalid_argument if @a interface_address is not an IPv4 address
+     * @throws std::invalid_argument if the packet size exceeds the interface MTU
+     * @throws std::system_error if the packet socket or ring cannot be created
+     */
+    udp_packet_mmap_stream(
+        io_service_ref io_service,
+        const boost::asio::ip::udp::endpoint &endpoint,
+        const stream_config &config,
+        const boost::asio::ip::address &interface_address,
+        std::size_t buffer_size = default_buffer_size,
+        int ttl = 1);
+
+    virtual ~udp_packet_mmap_stream();
+};
+
+} // namespace send
+} // namespace spead2
+
+#endif // SPEAD2_USE_PACKET_MMAP
+#endif // SPEAD2_SEND_UDP_PACKET_MMAP_H
@@ -0,0 +1,104 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#ifndef SPEAD2_SEND_UDP_URING_H
+#define SPEAD2_SEND_UDP_URING_H
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <spead2/common_features.h>
+#if SPEAD2_USE_URING
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <boost/asio.hpp>
+#include <vector>
+#include <spead2/common_uring.h>
+#include <spead2/send_packet.h>
+#include <spead2/send_stream.h>
+
+namespace spead2
+{
+namespace send
+{
+
+/**
+ * Stream that submits packets to the kernel with io_uring. Each batch of
+ * packets is handed over with a single system call, linked so that they
+ * are transmitted in order, and the completions are collected in bulk.
+ *
+ * If one packet fails, the remaining packets in the same batch are
+ * cancelled, and the heaps they belong to are reported with an error.
+ */
+class udp_uring_stream : public stream_impl<udp_uring_stream>
+{
+private:
+    friend class stream_impl<udp_uring_stream>;
+    boost::asio::ip::udp::socket socket;
+    boost::asio::ip::udp::endpoint endpoint;
+    io_uring_t ring;
+    /// Signalled by the kernel when completions are posted
+    boost::asio::posix::stream_descriptor event_fd;
+
+    static constexpr int batch_size = 64;
+    struct msghdr msgvec[batch_size];
+    std::vector<struct iovec> msg_iov;
+    /// Number of submitted packets whose completions have not yet been reaped
+    std::size_t n_pending = 0;
+
+    /// Collect completions and finish the batch once all have arrived
+    void reap();
+
+    void async_send_packets();
+
+public:
+    /// Socket send buffer size, if none is explicitly passed to the constructor
+    static constexpr std::size_t default_buffer_size = 512 * 1024;
+
+    /**
+     * Constructor.
+     *
+     * @param io_service   I/O service for sending data
+     * @param endpoint     Destination address and port
+     * @param config       Stream configuration
+     * @param buffer_size  Socket buffer size (0 for OS default)
+     * @param interface_address   Source address
+     *                            @verbatim embed:rst:leading-asterisks
+     *                            (see tips on :ref:`routing`)
+     *                            @endverbatim
+     *
+     * @throws std::system_error if the kernel does not support io_uring
+     */
+    udp_uring_stream(
+        io_service_ref io_service,
+        const boost::asio::ip::udp::endpoint &endpoint,
+        const stream_config &config = stream_config(),
+        std::size_t buffer_size = default_buffer_size,
+        const boost::asio::ip::address &interface_address = boost::asio::ip::address());
+
+    virtual ~udp_uring_stream();
+};
+
+} // namespace send
+} // namespace spead2
+
+#endif // SPEAD2_USE_URING
+#endif // SPEAD2_SEND_UDP_URING_H
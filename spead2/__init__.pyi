@@ -85,7 +85,19 @@ class MemoryAllocator(object):
     def __init__(self) -> None: ...
 
 class MmapAllocator(MemoryAllocator):
-    def __init__(self, flags: int = ...) -> None: ...
+    def __init__(self, flags: int = ..., prefer_huge: bool = ..., huge_page_size: int = ...,
+                 transparent_huge: bool = ..., numa_node: int = ..., lock: bool = ...,
+                 populate: bool = ...) -> None: ...
+
+class MemoryPoolStats(object):
+    allocations: int
+    hits: int
+    misses: int
+    out_of_range: int
+    dropped_frees: int
+    current_free: int
+    min_free: int
+    refill_histogram: List[int]
 
 class MemoryPool(MemoryAllocator):
     @overload
@@ -98,6 +110,35 @@ class MemoryPool(MemoryAllocator):
     def warn_on_empty(self) -> bool: ...
     @warn_on_empty.setter
     def warn_on_empty(self, value: bool) -> None: ...
+    def fill_async(self, target: int) -> None: ...
+    @property
+    def stats(self) -> MemoryPoolStats: ...
+
+class SizeClassMemoryPool(MemoryAllocator):
+    class SizeClass(object):
+        size: int
+        max_free: int
+        initial: int
+        low_water: int
+        def __init__(self, size: int, max_free: int, initial: int, low_water: int = 0) -> None: ...
+
+    @overload
+    def __init__(self, classes: List[SizeClassMemoryPool.SizeClass],
+                 allocator: Optional[MemoryAllocator] = None) -> None: ...
+    @overload
+    def __init__(self, thread_pool: ThreadPool, classes: List[SizeClassMemoryPool.SizeClass],
+                 allocator: Optional[MemoryAllocator] = None) -> None: ...
+    @staticmethod
+    def power_of_two_classes(min_size: int, max_size: int, max_free: int, initial: int,
+                             low_water: int = 0) -> List[SizeClassMemoryPool.SizeClass]: ...
+    @property
+    def num_classes(self) -> int: ...
+    def get_class(self, index: int) -> SizeClassMemoryPool.SizeClass: ...
+    def get_stats(self, index: int) -> MemoryPoolStats: ...
+    @property
+    def warn_on_empty(self) -> bool: ...
+    @warn_on_empty.setter
+    def warn_on_empty(self, value: bool) -> None: ...
 
 class InprocQueue(object):
     def __init__(self) -> None: ...
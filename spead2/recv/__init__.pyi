@@ -133,3 +133,4 @@ class _Stream(object):
 
 class Stream(_Stream):
     def get(self) -> Heap: ...
+    def get_many(self, max_heaps: int, timeout: Optional[float] = None) -> List[Heap]: ...
@@ -13,12 +13,14 @@
 # You should have received a copy of the GNU Lesser General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-from typing import Text, Union, Iterator, Optional, overload
+from typing import Text, Union, Iterator, List, Optional, Tuple, overload
 import socket
 
 import spead2
 from spead2 import _PybindStr
 
+ALL_SUBSTREAMS: int = ...
+
 class Heap(object):
     def __init__(self, flavour: spead2.Flavour) -> None: ...
     @property
@@ -36,15 +38,40 @@ class PacketGenerator(object):
     def __init__(self, heap: Heap, cnt: int, max_packet_size: int) -> None: ...
     def __iter__(self) -> Iterator[bytes]: ...
 
+class SharedRateLimiter(object):
+    DEFAULT_BURST_SIZE: int = ...
+
+    def __init__(self, rate: float, burst_size: int = ...) -> None: ...
+    @property
+    def rate(self) -> float: ...
+    @property
+    def burst_size(self) -> int: ...
+    @property
+    def num_streams(self) -> int: ...
+    @property
+    def num_active(self) -> int: ...
+    @property
+    def reserved_rate(self) -> float: ...
+
 class StreamConfig(object):
     DEFAULT_MAX_PACKET_SIZE: int = ...
     DEFAULT_MAX_HEAPS: int = ...
     DEFAULT_BURST_SIZE: int = ...
     DEFAULT_BURST_RATE_RATIO: float = ...
+    DEFAULT_MAX_INTERLEAVE: int = ...
+    DEFAULT_SPIN_TIME: float = ...
+    DEFAULT_RATE_WEIGHT: float = ...
+    DEFAULT_NUM_PRIORITIES: int = ...
 
     def __init__(self, max_packet_size: int = ..., rate: float = ...,
                  burst_size: int = ..., max_heaps: int = ...,
-                 burst_rate_ratio: float = ...) -> None: ...
+                 burst_rate_ratio: float = ...,
+                 max_interleave: int = ...,
+                 spin_time: float = ...,
+                 rate_limiter: Optional[SharedRateLimiter] = ...,
+                 rate_weight: float = ...,
+                 min_rate: float = ...,
+                 num_priorities: int = ...) -> None: ...
 
     @property
     def max_packet_size(self) -> int: ...
@@ -71,17 +98,67 @@ class StreamConfig(object):
     @burst_rate_ratio.setter
     def burst_rate_ratio(self, float) -> None: ...
 
+    @property
+    def max_interleave(self) -> int: ...
+    @max_interleave.setter
+    def max_interleave(self, value: int) -> None: ...
+
+    @property
+    def spin_time(self) -> float: ...
+    @spin_time.setter
+    def spin_time(self, value: float) -> None: ...
+
+    @property
+    def rate_limiter(self) -> Optional[SharedRateLimiter]: ...
+    @rate_limiter.setter
+    def rate_limiter(self, value: Optional[SharedRateLimiter]) -> None: ...
+
+    @property
+    def rate_weight(self) -> float: ...
+    @rate_weight.setter
+    def rate_weight(self, value: float) -> None: ...
+
+    @property
+    def min_rate(self) -> float: ...
+    @min_rate.setter
+    def min_rate(self, value: float) -> None: ...
+
+    @property
+    def num_priorities(self) -> int: ...
+    @num_priorities.setter
+    def num_priorities(self, value: int) -> None: ...
+
     @property
     def burst_rate(self) -> float: ...
 
+class PacingStats(object):
+    @property
+    def bursts(self) -> int: ...
+    @property
+    def lateness(self) -> List[int]: ...
+    @property
+    def gap(self) -> List[int]: ...
+    @property
+    def total_lateness(self) -> float: ...
+    @property
+    def max_lateness(self) -> float: ...
+
 class _Stream(object):
     def set_cnt_sequence(self, next: int, step: int) -> None: ...
+    @property
+    def num_substreams(self) -> int: ...
+    @property
+    def pacing_stats(self) -> PacingStats: ...
 
 class _SyncStream(_Stream):
-    def send_heap(self, heap: Heap, cnt: int = ...) -> None: ...
+    def send_heap(self, heap: Heap, cnt: int = ..., substream_index: int = ...,
+                  priority: int = ...) -> None: ...
+    def send_heaps(self, heaps: List[Heap], priority: int = ...) -> List[int]: ...
 
 class _UdpStream(object):
     DEFAULT_BUFFER_SIZE: int = ...
+    DEFAULT_TXTIME_LOOKAHEAD: float = ...
+    def enable_txtime(self, lookahead: float = ..., clock_id: int = ...) -> None: ...
 
 class UdpStream(_UdpStream, _SyncStream):
     @overload
@@ -113,6 +190,16 @@ class UdpStream(_UdpStream, _SyncStream):
     def __init__(self, thread_pool: spead2.ThreadPool,
                  socket: socket.socket, hostname: _PybindStr, port: int,
                  config: StreamConfig = ...) -> None: ...
+    @overload
+    def __init__(self, thread_pool: spead2.ThreadPool,
+                 endpoints: List[Tuple[_PybindStr, int]],
+                 config: StreamConfig = ...,
+                 buffer_size: int = ..., interface_address: _PybindStr = ...) -> None: ...
+    @overload
+    def __init__(self, thread_pool: spead2.ThreadPool,
+                 endpoints: List[Tuple[_PybindStr, int]],
+                 config: StreamConfig,
+                 buffer_size: int, ttl: int, interface_address: _PybindStr) -> None: ...
 
 class _UdpIbvStream(object):
     DEFAULT_BUFFER_SIZE: int = ...
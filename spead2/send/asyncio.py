@@ -34,9 +34,10 @@ def _wrap_class(name, base_class):
             if self._loop is None:
                 self._loop = asyncio.get_event_loop()
             self._active = 0
-            self._last_queued_future = None
+            # Most recently queued future for each priority
+            self._last_queued_futures = {}
 
-        def async_send_heap(self, heap, cnt=-1, loop=None):
+        def async_send_heap(self, heap, cnt=-1, loop=None, substream_index=0, priority=0):
             """Send a heap asynchronously. Note that this is *not* a coroutine:
             it returns a future. Adding the heap to the queue is done
             synchronously, to ensure proper ordering.
@@ -49,6 +50,12 @@ def _wrap_class(name, base_class):
                 Heap cnt to send (defaults to auto-incrementing)
             loop : :py:class:`asyncio.BaseEventLoop`, optional
                 Event loop to use, overriding the constructor.
+            substream_index : int, optional
+                Destination to send the heap to, for streams with several
+                destinations, or :py:data:`spead2.send.ALL_SUBSTREAMS`
+            priority : int, optional
+                Priority level, for streams configured with several (higher
+                is more urgent)
             """
 
             if loop is None:
@@ -63,22 +70,23 @@ def _wrap_class(name, base_class):
                 self._active -= 1
                 if self._active == 0:
                     self._loop.remove_reader(self.fd)
-                    self._last_queued_future = None  # Purely to free the memory
-            queued = super().async_send_heap(heap, callback, cnt)
+                    self._last_queued_futures.clear()  # Purely to free the memory
+            queued = super().async_send_heap(heap, callback, cnt, substream_index, priority)
             if self._active == 0:
                 self._loop.add_reader(self.fd, self.process_callbacks)
             self._active += 1
             if queued:
-                self._last_queued_future = future
+                self._last_queued_futures[priority] = future
             return future
 
         async def async_flush(self):
             """Asynchronously wait for all enqueued heaps to be sent. Note that
             this only waits for heaps passed to :meth:`async_send_heap` prior to
             this call, not ones added while waiting."""
-            future = self._last_queued_future
-            if future is not None:
-                await asyncio.wait([future])
+            # Heaps with different priorities may complete out of order
+            futures = list(self._last_queued_futures.values())
+            if futures:
+                await asyncio.wait(futures)
 
     Wrapped.__name__ = name
     return Wrapped
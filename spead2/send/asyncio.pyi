@@ -15,7 +15,7 @@
 
 import asyncio
 import socket
-from typing import Optional, overload
+from typing import List, Optional, Tuple, overload
 
 import spead2
 import spead2.send
@@ -27,7 +27,9 @@ class _AsyncStream(spead2.send._Stream):
     def fd(self) -> int: ...
     def flush(self) -> None: ...
     def async_send_heap(self, heap: spead2.send.Heap, cnt: int = ...,
-                        loop: Optional[asyncio.AbstractEventLoop] = None) -> asyncio.Future[int]: ...
+                        loop: Optional[asyncio.AbstractEventLoop] = None,
+                        substream_index: int = ...,
+                        priority: int = ...) -> asyncio.Future[int]: ...
     async def async_flush(self) -> None: ...
 
 class UdpStream(spead2.send._UdpStream, _AsyncStream):
@@ -66,6 +68,18 @@ class UdpStream(spead2.send._UdpStream, _AsyncStream):
                  socket: socket.socket, hostname: _PybindStr, port: int,
                  config: spead2.send.StreamConfig = ...,
                  *, loop: Optional[asyncio.AbstractEventLoop] = None) -> None: ...
+    @overload
+    def __init__(self, thread_pool: spead2.ThreadPool,
+                 endpoints: List[Tuple[_PybindStr, int]],
+                 config: spead2.send.StreamConfig = ...,
+                 buffer_size: int = ..., interface_address: _PybindStr = ...,
+                 *, loop: Optional[asyncio.AbstractEventLoop] = None) -> None: ...
+    @overload
+    def __init__(self, thread_pool: spead2.ThreadPool,
+                 endpoints: List[Tuple[_PybindStr, int]],
+                 config: spead2.send.StreamConfig,
+                 buffer_size: int, ttl: int, interface_address: _PybindStr,
+                 *, loop: Optional[asyncio.AbstractEventLoop] = None) -> None: ...
 
 
 class TcpStream(spead2.send._TcpStream, _AsyncStream):
@@ -25,7 +25,7 @@
 namespace spead2
 {
 
-template class unbounded_queue<inproc_queue::packet, semaphore_fd>;
+template class mpsc_unbounded_queue<inproc_queue::packet, semaphore_fd>;
 
 void inproc_queue::stop()
 {
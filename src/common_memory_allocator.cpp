@@ -18,7 +18,18 @@
  * @file
  */
 
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
 #include <spead2/common_memory_pool.h>
+#include <spead2/common_logging.h>
+#include <sys/mman.h>
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/syscall.h>
+#endif
 
 // Some operating systems only provide MAP_ANON
 #ifndef MAP_ANONYMOUS
@@ -63,26 +74,110 @@ void memory_allocator::free(std::uint8_t *ptr, void *user)
 
 /////////////////////////////////////////////////////////////////////////////
 
-#include <sys/mman.h>
+void mmap_allocator_config::set_huge_page_size(std::size_t huge_page_size)
+{
+    if (huge_page_size & (huge_page_size - 1))
+        throw std::invalid_argument("huge_page_size must be zero or a power of 2");
+    this->huge_page_size = huge_page_size;
+}
+
+static mmap_allocator_config make_mmap_allocator_config(int flags, bool prefer_huge)
+{
+    mmap_allocator_config config;
+    config.set_flags(flags);
+    config.set_prefer_huge(prefer_huge);
+    return config;
+}
+
+/**
+ * Set the preferred NUMA node for a range of memory. This uses the system
+ * call directly, since <numaif.h> is not always installed.
+ *
+ * @returns 0 on success, or an errno value
+ */
+static int bind_numa_node(void *ptr, std::size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    constexpr int mpol_preferred = 1;    // MPOL_PREFERRED from <numaif.h>
+    constexpr std::size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node / bits + 1);
+    mask[node / bits] = 1UL << (node % bits);
+    if (syscall(SYS_mbind, ptr, size, mpol_preferred, mask.data(), mask.size() * bits + 1, 0) != 0)
+        return errno;
+    return 0;
+#else
+    (void) ptr;
+    (void) size;
+    (void) node;
+    return ENOSYS;
+#endif
+}
+
+static void warn_once(std::atomic<bool> &warned, const char *format, int err)
+{
+    if (!warned.exchange(true))
+        log_errno(format, err);
+}
 
 mmap_allocator::mmap_allocator(int flags, bool prefer_huge)
-    : flags(flags), prefer_huge(prefer_huge)
+    : mmap_allocator(make_mmap_allocator_config(flags, prefer_huge))
+{
+}
+
+mmap_allocator::mmap_allocator(const mmap_allocator_config &config)
+    : flags(config.get_flags()), prefer_huge(config.get_prefer_huge()), config(config)
 {
 }
 
 mmap_allocator::pointer mmap_allocator::allocate(std::size_t size, void *hint)
 {
     (void) hint;
-    int use_flags = flags | MAP_ANONYMOUS | MAP_PRIVATE
+    /* The NUMA policy and advice only affect pages faulted in after they are
+     * set, so in that case the memory is only populated afterwards.
+     */
+    bool setup = config.get_numa_node() >= 0 || config.get_transparent_huge();
+    bool populated = false;
+    int use_flags = flags | MAP_ANONYMOUS | MAP_PRIVATE;
 #ifdef MAP_POPULATE
-        | MAP_POPULATE
+    if (config.get_populate() && !setup)
+    {
+        use_flags |= MAP_POPULATE;
+        populated = true;
+    }
 #endif
-    ;
 
     std::uint8_t *ptr = (std::uint8_t *) MAP_FAILED;
+    bool huge = false;
 #ifdef MAP_HUGETLB
     if (prefer_huge)
-        ptr = (std::uint8_t *) mmap(nullptr, size, PROT_READ | PROT_WRITE, use_flags | MAP_HUGETLB, -1, 0);
+    {
+        int huge_flags = use_flags | MAP_HUGETLB;
+        std::size_t huge_size = size;
+        std::size_t page = config.get_huge_page_size();
+        if (page != 0)
+        {
+#ifdef MAP_HUGE_SHIFT
+            int shift = 0;
+            while ((std::size_t(1) << shift) < page)
+                shift++;
+            huge_flags |= shift << MAP_HUGE_SHIFT;
+#endif
+            // Round up, since munmap requires a multiple of the page size
+            if (size <= SIZE_MAX - (page - 1))
+                huge_size = (size + page - 1) & ~(page - 1);
+            else
+                huge_size = 0;    // too big: skip straight to the fallback
+        }
+        if (huge_size != 0)
+            ptr = (std::uint8_t *) mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, huge_flags, -1, 0);
+        if (ptr != MAP_FAILED)
+        {
+            size = huge_size;
+            huge = true;
+        }
+        else
+            log_debug("huge pages are not available, falling back to normal pages");
+    }
 #endif
     if (ptr == MAP_FAILED)
     {
@@ -92,9 +187,34 @@ mmap_allocator::pointer mmap_allocator::allocate(std::size_t size, void *hint)
 
     if (ptr == MAP_FAILED)
         throw std::bad_alloc();
-#ifndef MAP_POPULATE
-    prefault(ptr, size);
+
+    if (config.get_transparent_huge() && !huge)
+    {
+#ifdef MADV_HUGEPAGE
+        if (madvise(ptr, size, MADV_HUGEPAGE) != 0)
+            warn_once(warned_transparent_huge,
+                      "transparent huge pages are not available: %2% (%1%)", errno);
+#else
+        warn_once(warned_transparent_huge,
+                  "transparent huge pages are not available: %2% (%1%)", ENOSYS);
 #endif
+    }
+    if (config.get_numa_node() >= 0)
+    {
+        int err = bind_numa_node(ptr, size, config.get_numa_node());
+        if (err != 0)
+            warn_once(warned_numa, "could not bind memory to NUMA node: %2% (%1%)", err);
+    }
+    if (config.get_lock())
+    {
+        // Locking also faults in the memory
+        if (mlock(ptr, size) == 0)
+            populated = true;
+        else
+            warn_once(warned_lock, "could not lock memory: %2% (%1%)", errno);
+    }
+    if (config.get_populate() && !populated)
+        prefault(ptr, size);
     return pointer(ptr, deleter(shared_from_this(), (void *) std::uintptr_t(size)));
 }
 
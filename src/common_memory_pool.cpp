@@ -18,16 +18,35 @@
  * @file
  */
 
+#include <algorithm>
+#include <chrono>
 #include <cassert>
+#include <iterator>
 #include <utility>
 #include <memory>
 #include <cstdint>
+#include <stdexcept>
 #include <spead2/common_memory_pool.h>
 #include <spead2/common_logging.h>
 
 namespace spead2
 {
 
+constexpr std::size_t memory_pool_stats::refill_histogram_buckets;
+
+constexpr std::size_t memory_pool::num_caches;
+constexpr std::size_t memory_pool::max_magazine_size;
+
+std::size_t memory_pool::choose_magazine_size(std::size_t max_free)
+{
+    /* Memory held in the caches is only available to the threads using
+     * them, so the caches are kept small relative to the pool, and are not
+     * used at all for small pools.
+     */
+    std::size_t size = std::min(max_free / 16, max_magazine_size);
+    return size >= 2 ? size : 0;
+}
+
 memory_pool::memory_pool()
     : memory_pool(boost::none, 0, 0, 0, 0, 0, nullptr)
 {
@@ -56,30 +75,129 @@ memory_pool::memory_pool(
     std::shared_ptr<memory_allocator> allocator)
     : io_service(std::move(io_service)), lower(lower), upper(upper), max_free(max_free),
     initial(initial), low_water(low_water),
-    base_allocator(allocator ? move(allocator) : std::make_shared<memory_allocator>())
+    magazine_size(choose_magazine_size(max_free)),
+    base_allocator(allocator ? move(allocator) : std::make_shared<memory_allocator>()),
+    min_free(initial),
+    caches(new cache[num_caches])
 {
     assert(lower <= upper);
     assert(initial <= max_free);
     assert(low_water <= initial);
     assert(low_water == 0 || io_service);
+    for (std::size_t i = 0; i < num_caches; i++)
+        caches[i].rounds.reserve(magazine_size);
     for (std::size_t i = 0; i < initial; i++)
-        pool.emplace(base_allocator->allocate(upper, nullptr));
+        depot.push_back(base_allocator->allocate(upper, nullptr));
+    n_free = initial;
+}
+
+memory_pool::cache &memory_pool::get_cache() const
+{
+    static std::atomic<std::size_t> next_index{0};
+    static thread_local std::size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+    return caches[index % num_caches];
+}
+
+void memory_pool::load_cache(cache &c)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    /* Only fill half the cache, so that the thread can also free memory
+     * without immediately having to unload it again.
+     */
+    std::size_t n = std::min(depot.size(), magazine_size / 2);
+    std::move(depot.end() - n, depot.end(), std::back_inserter(c.rounds));
+    depot.erase(depot.end() - n, depot.end());
+}
+
+void memory_pool::unload_cache(cache &c)
+{
+    // Keep the most recently freed (and hence hottest) half
+    std::size_t n = magazine_size / 2;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::move(c.rounds.begin(), c.rounds.begin() + n, std::back_inserter(depot));
+    }
+    c.rounds.erase(c.rounds.begin(), c.rounds.begin() + n);
+}
+
+memory_pool::pointer memory_pool::steal(const cache &self)
+{
+    for (std::size_t i = 0; i < num_caches; i++)
+    {
+        cache &c = caches[i];
+        if (&c == &self)
+            continue;
+        std::lock_guard<std::mutex> lock(c.mutex);
+        if (!c.rounds.empty())
+        {
+            pointer ptr = std::move(c.rounds.back());
+            c.rounds.pop_back();
+            return ptr;
+        }
+    }
+    return pointer();
+}
+
+void memory_pool::start_refill(std::size_t target)
+{
+    std::shared_ptr<memory_pool> self =
+        std::static_pointer_cast<memory_pool>(shared_from_this());
+    std::weak_ptr<memory_pool> weak{self};
+    // C++ (or at least GCC) won't let me capture the members by value directly
+    const std::size_t upper = this->upper;
+    std::shared_ptr<memory_allocator> allocator = base_allocator;
+    auto start = std::chrono::steady_clock::now();
+    (*io_service)->post([upper, target, allocator, weak, start] {
+        refill(upper, target, allocator, std::move(weak), start);
+    });
+}
+
+void memory_pool::check_low_water(std::size_t free)
+{
+    if (free < low_water && !refilling.exchange(true))
+        start_refill(initial);
+}
+
+void memory_pool::update_min_free(std::size_t free)
+{
+    std::size_t old = min_free.load(std::memory_order_relaxed);
+    while (free < old && !min_free.compare_exchange_weak(old, free, std::memory_order_relaxed))
+    {
+    }
+}
+
+void memory_pool::fill_async(std::size_t target)
+{
+    if (!io_service)
+        throw std::invalid_argument("fill_async requires an io_service");
+    target = std::min(target, max_free);
+    if (n_free.load(std::memory_order_relaxed) < target && !refilling.exchange(true))
+        start_refill(target);
 }
 
 void memory_pool::free(std::uint8_t *ptr, void *user)
 {
     pointer wrapped(ptr, deleter(base_allocator, user));
-    std::unique_lock<std::mutex> lock(mutex);
-    if (pool.size() < max_free)
+    if (n_free.fetch_add(1, std::memory_order_relaxed) >= max_free)
     {
-        log_debug("returning memory to the pool");
-        pool.push(move(wrapped));
+        n_free.fetch_sub(1, std::memory_order_relaxed);
+        dropped_frees.fetch_add(1, std::memory_order_relaxed);
+        log_debug("dropping memory because the pool is full");
+        return;   // deleter for wrapped will free the memory
+    }
+    log_debug("returning memory to the pool");
+    if (magazine_size > 0)
+    {
+        cache &c = get_cache();
+        std::lock_guard<std::mutex> lock(c.mutex);
+        if (c.rounds.size() == magazine_size)
+            unload_cache(c);
+        c.rounds.push_back(std::move(wrapped));
     }
     else
     {
-        log_debug("dropping memory because the pool is full");
-        lock.unlock();
-        // deleter for wrapped will free the memory
+        std::lock_guard<std::mutex> lock(mutex);
+        depot.push_back(std::move(wrapped));
     }
 }
 
@@ -90,8 +208,10 @@ memory_pool::pointer memory_pool::convert(pointer &&base)
     return wrapped;
 }
 
-void memory_pool::refill(std::size_t upper, std::shared_ptr<memory_allocator> allocator,
-                         std::weak_ptr<memory_pool> self_weak)
+void memory_pool::refill(std::size_t upper, std::size_t target,
+                         std::shared_ptr<memory_allocator> allocator,
+                         std::weak_ptr<memory_pool> self_weak,
+                         std::chrono::steady_clock::time_point start)
 {
     while (true)
     {
@@ -101,14 +221,24 @@ void memory_pool::refill(std::size_t upper, std::shared_ptr<memory_allocator> al
         {
             break;  // The memory pool vanished from under us
         }
-        std::lock_guard<std::mutex> lock(self->mutex);
-        if (self->pool.size() < self->max_free)
+        std::size_t free = self->n_free.fetch_add(1, std::memory_order_relaxed);
+        if (free < self->max_free)
         {
             log_debug("adding background memory to the pool");
-            self->pool.push(std::move(ptr));
+            std::lock_guard<std::mutex> lock(self->mutex);
+            self->depot.push_back(std::move(ptr));
+            free++;
         }
-        if (self->pool.size() >= self->initial)
+        else
+            self->n_free.fetch_sub(1, std::memory_order_relaxed);
+        if (free >= target)
         {
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            std::size_t bucket = 0;
+            while (bucket + 1 < memory_pool_stats::refill_histogram_buckets
+                   && elapsed.count() >= double(std::uint64_t(1) << bucket))
+                bucket++;
+            self->refill_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
             self->refilling = false;
             log_debug("exiting refill task");
             break;
@@ -122,46 +252,57 @@ memory_pool::pointer memory_pool::allocate(std::size_t size, void *hint)
     pointer ptr;
     if (size >= lower && size <= upper)
     {
-        /* Declaration order here is important: if there is an exception,
-         * we want to drop the lock before trying to put the pointer back in
-         * the pool.
-         */
-        std::unique_lock<std::mutex> lock(mutex);
-        if (!pool.empty())
+        cache &c = get_cache();
+        if (magazine_size > 0)
         {
-            ptr = std::move(pool.top());
-            pool.pop();
-            ptr = convert(std::move(ptr));
-            if (pool.size() < low_water && !refilling)
             {
-                refilling = true;
-                std::shared_ptr<memory_pool> self =
-                    std::static_pointer_cast<memory_pool>(shared_from_this());
-                std::weak_ptr<memory_pool> weak{self};
-                // C++ (or at least GCC) won't let me capture the members by value directly
-                const std::size_t upper = this->upper;
-                std::shared_ptr<memory_allocator> allocator = base_allocator;
-                (*io_service)->post([upper, allocator, weak] {
-                    refill(upper, allocator, std::move(weak));
-                });
+                std::lock_guard<std::mutex> lock(c.mutex);
+                if (c.rounds.empty())
+                    load_cache(c);
+                if (!c.rounds.empty())
+                {
+                    ptr = std::move(c.rounds.back());
+                    c.rounds.pop_back();
+                }
             }
-            lock.unlock();
+            /* The memory may be stranded in caches of threads that have
+             * stopped freeing memory (or exited).
+             */
+            if (!ptr)
+                ptr = steal(c);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!depot.empty())
+            {
+                ptr = std::move(depot.back());
+                depot.pop_back();
+            }
+        }
+
+        if (ptr)
+        {
+            c.hits.fetch_add(1, std::memory_order_relaxed);
+            std::size_t free = n_free.fetch_sub(1, std::memory_order_relaxed) - 1;
+            ptr = convert(std::move(ptr));
+            update_min_free(free);
+            check_low_water(free);
             log_debug("allocating %d bytes from pool", size);
         }
         else
         {
-            // Copy the flag while the lock is held, to safely issue the
-            // warning after it is released.
-            bool warn = warn_on_empty;
-            lock.unlock();
+            c.misses.fetch_add(1, std::memory_order_relaxed);
+            update_min_free(n_free.load(std::memory_order_relaxed));
             ptr = convert(base_allocator->allocate(upper, nullptr));
-            if (warn)
+            if (warn_on_empty.load(std::memory_order_relaxed))
                 log_warning("memory pool is empty when allocating %d bytes", size);
             log_debug("allocating %d bytes which will be added to the pool", size);
         }
     }
     else
     {
+        get_cache().out_of_range.fetch_add(1, std::memory_order_relaxed);
         log_debug("allocating %d bytes without using the pool", size);
         ptr = base_allocator->allocate(size, nullptr);
     }
@@ -170,14 +311,125 @@ memory_pool::pointer memory_pool::allocate(std::size_t size, void *hint)
 
 void memory_pool::set_warn_on_empty(bool warn)
 {
-    std::lock_guard<std::mutex> lock(mutex);
     warn_on_empty = warn;
 }
 
 bool memory_pool::get_warn_on_empty() const
 {
-    std::lock_guard<std::mutex> lock(mutex);
     return warn_on_empty;
 }
 
+memory_pool_stats memory_pool::get_stats() const
+{
+    memory_pool_stats stats;
+    for (std::size_t i = 0; i < num_caches; i++)
+    {
+        stats.hits += caches[i].hits.load(std::memory_order_relaxed);
+        stats.misses += caches[i].misses.load(std::memory_order_relaxed);
+        stats.out_of_range += caches[i].out_of_range.load(std::memory_order_relaxed);
+    }
+    stats.allocations = stats.hits + stats.misses + stats.out_of_range;
+    stats.dropped_frees = dropped_frees.load(std::memory_order_relaxed);
+    stats.current_free = n_free.load(std::memory_order_relaxed);
+    stats.min_free = min_free.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < memory_pool_stats::refill_histogram_buckets; i++)
+        stats.refill_histogram[i] = refill_histogram[i].load(std::memory_order_relaxed);
+    return stats;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+std::vector<size_class_memory_pool::size_class> size_class_memory_pool::power_of_two_classes(
+    std::size_t min_size, std::size_t max_size,
+    std::size_t max_free, std::size_t initial, std::size_t low_water)
+{
+    std::vector<size_class> out;
+    std::size_t size = 1;
+    while (size < min_size)
+        size *= 2;
+    while (true)
+    {
+        out.emplace_back(size, max_free, initial, low_water);
+        if (size >= max_size)
+            break;
+        size *= 2;
+    }
+    return out;
+}
+
+size_class_memory_pool::size_class_memory_pool(
+    std::vector<size_class> classes,
+    std::shared_ptr<memory_allocator> allocator)
+    : size_class_memory_pool(boost::none, std::move(classes), std::move(allocator))
+{
+}
+
+size_class_memory_pool::size_class_memory_pool(
+    io_service_ref io_service,
+    std::vector<size_class> classes,
+    std::shared_ptr<memory_allocator> allocator)
+    : size_class_memory_pool(boost::optional<io_service_ref>(std::move(io_service)),
+                             std::move(classes), std::move(allocator))
+{
+}
+
+size_class_memory_pool::size_class_memory_pool(
+    boost::optional<io_service_ref> io_service,
+    std::vector<size_class> classes,
+    std::shared_ptr<memory_allocator> allocator)
+    : classes(std::move(classes)),
+    base_allocator(allocator ? std::move(allocator) : std::make_shared<memory_allocator>())
+{
+    if (this->classes.empty())
+        throw std::invalid_argument("at least one size class is required");
+    std::size_t lower = 0;
+    for (const size_class &c : this->classes)
+    {
+        if (c.size < lower || c.size == 0)
+            throw std::invalid_argument("size classes must be positive and strictly increasing");
+        if (c.initial > c.max_free)
+            throw std::invalid_argument("initial must not exceed max_free");
+        if (c.low_water > c.initial)
+            throw std::invalid_argument("low_water must not exceed initial");
+        if (c.low_water > 0 && !io_service)
+            throw std::invalid_argument("low_water requires an io_service");
+        if (io_service)
+            pools.push_back(std::make_shared<memory_pool>(
+                *io_service, lower, c.size, c.max_free, c.initial, c.low_water, base_allocator));
+        else
+            pools.push_back(std::make_shared<memory_pool>(
+                lower, c.size, c.max_free, c.initial, base_allocator));
+        lower = c.size + 1;
+    }
+}
+
+size_class_memory_pool::pointer size_class_memory_pool::allocate(std::size_t size, void *hint)
+{
+    auto pos = std::lower_bound(
+        classes.begin(), classes.end(), size,
+        [](const size_class &c, std::size_t size) { return c.size < size; });
+    if (pos == classes.end())
+    {
+        log_debug("allocating %d bytes without using a size class", size);
+        return base_allocator->allocate(size, hint);
+    }
+    return pools[pos - classes.begin()]->allocate(size, hint);
+}
+
+memory_pool_stats size_class_memory_pool::get_stats(std::size_t idx) const
+{
+    return pools.at(idx)->get_stats();
+}
+
+bool size_class_memory_pool::get_warn_on_empty() const
+{
+    return pools[0]->get_warn_on_empty();
+}
+
+void size_class_memory_pool::set_warn_on_empty(bool warn)
+{
+    for (const auto &pool : pools)
+        pool->set_warn_on_empty(warn);
+}
+
 } // namespace spead2
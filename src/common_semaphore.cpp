@@ -26,16 +26,26 @@
 #endif
 #include <spead2/common_features.h>
 #include <cerrno>
+#include <climits>
+#include <ctime>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
 #include <system_error>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <atomic>
+#include <thread>
 #include <spead2/common_semaphore.h>
 #include <spead2/common_logging.h>
 #if SPEAD2_USE_EVENTFD
 # include <sys/eventfd.h>
 #endif
+#if SPEAD2_USE_FUTEX
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
 
 namespace spead2
 {
@@ -64,6 +74,16 @@ int semaphore_spin::get()
     return 0;
 }
 
+int semaphore_spin::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    while (try_get() == -1)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return -1;
+    }
+    return 0;
+}
+
 int semaphore_spin::try_get()
 {
     unsigned int cur = value.load(std::memory_order_acquire);
@@ -128,8 +148,61 @@ int semaphore_posix::get()
         return 0;
 }
 
+int semaphore_posix::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    // sem_timedwait takes an absolute time on the realtime clock
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    auto abs_time = std::chrono::system_clock::now().time_since_epoch()
+        + std::chrono::duration_cast<std::chrono::system_clock::duration>(remaining);
+    std::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(abs_time).count();
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    int status = sem_timedwait(&sem, &ts);
+    if (status == -1)
+    {
+        if (errno == EINTR || errno == ETIMEDOUT)
+            return -1;
+        else
+            throw_errno("sem_timedwait failed");
+    }
+    else
+        return 0;
+}
+
 #endif // SPEAD2_USE_POSIX_SEMAPHORES
 
+/**
+ * Wait until @a fd is readable or @a deadline passes.
+ *
+ * @retval -1 if the deadline passed or the call was interrupted
+ * @retval 0 if the file descriptor is readable
+ */
+static int wait_readable(int fd, std::chrono::steady_clock::time_point deadline)
+{
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    int timeout = 0;
+    if (remaining > remaining.zero())
+    {
+        // Round up, so that a timeout means that the deadline really passed
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            remaining + std::chrono::milliseconds(1) - decltype(remaining)(1));
+        timeout = ms.count() > INT_MAX ? INT_MAX : int(ms.count());
+    }
+    struct pollfd pfd = {};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    int status = poll(&pfd, 1, timeout);
+    if (status == -1)
+    {
+        if (errno == EINTR)
+            return -1;
+        else
+            throw_errno("poll failed");
+    }
+    return status == 0 ? -1 : 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 semaphore_pipe::semaphore_pipe(semaphore_pipe &&other)
@@ -244,6 +317,18 @@ int semaphore_pipe::get()
     }
 }
 
+int semaphore_pipe::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    while (true)
+    {
+        if (wait_readable(pipe_fds[0], deadline) == -1)
+            return -1;
+        if (try_get() == 0)
+            return 0;
+        // Otherwise another thread took it first, so wait again
+    }
+}
+
 int semaphore_pipe::try_get()
 {
     char byte = 0;
@@ -363,6 +448,18 @@ int semaphore_eventfd::get()
     }
 }
 
+int semaphore_eventfd::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    while (true)
+    {
+        if (wait_readable(fd, deadline) == -1)
+            return -1;
+        if (try_get() == 0)
+            return 0;
+        // Otherwise another thread took it first, so wait again
+    }
+}
+
 int semaphore_eventfd::get_fd() const
 {
     return fd;
@@ -370,6 +467,274 @@ int semaphore_eventfd::get_fd() const
 
 #endif // SPEAD2_USE_EVENTFD
 
+/////////////////////////////////////////////////////////////////////////////
+
+#if SPEAD2_USE_FUTEX
+
+semaphore_futex::semaphore_futex(unsigned int initial)
+    : value(initial)
+{
+}
+
+void semaphore_futex::put()
+{
+    /* Both the increment and the load are sequentially consistent, pairing
+     * with wait: either we see the waiter, or the kernel sees the new value
+     * and refuses to put it to sleep.
+     */
+    value.fetch_add(1, std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_seq_cst) > 0)
+    {
+        if (syscall(SYS_futex, reinterpret_cast<int *>(&value), FUTEX_WAKE_PRIVATE, 1,
+                    nullptr, nullptr, 0) == -1)
+            throw_errno("futex wake failed");
+    }
+}
+
+int semaphore_futex::try_get()
+{
+    int cur = value.load(std::memory_order_relaxed);
+    while (cur > 0)
+    {
+        if (value.compare_exchange_weak(cur, cur - 1,
+                                        std::memory_order_acquire, std::memory_order_relaxed))
+            return 0;
+    }
+    return -1;
+}
+
+int semaphore_futex::wait(const struct timespec *timeout)
+{
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    int status = syscall(SYS_futex, reinterpret_cast<int *>(&value), FUTEX_WAIT_PRIVATE, 0,
+                         timeout, nullptr, 0);
+    int saved_errno = errno;
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    if (status == -1)
+    {
+        if (saved_errno == EAGAIN)
+            return 0;     // value was no longer zero
+        else if (saved_errno == EINTR || saved_errno == ETIMEDOUT)
+            return -1;
+        else
+            throw_errno("futex wait failed", saved_errno);
+    }
+    return 0;
+}
+
+int semaphore_futex::get()
+{
+    while (try_get() == -1)
+    {
+        if (wait(nullptr) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int semaphore_futex::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    while (try_get() == -1)
+    {
+        // FUTEX_WAIT takes a timeout relative to the monotonic clock
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= remaining.zero())
+            return -1;
+        std::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+        struct timespec timeout;
+        timeout.tv_sec = ns / 1000000000;
+        timeout.tv_nsec = ns % 1000000000;
+        if (wait(&timeout) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+#endif // SPEAD2_USE_FUTEX
+
+/////////////////////////////////////////////////////////////////////////////
+
+/// Hint to the CPU that this is a spin-wait loop
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+constexpr unsigned int semaphore_adaptive::default_max_spin;
+
+semaphore_adaptive::semaphore_adaptive(unsigned int initial, unsigned int max_spin)
+    : value(initial),
+    // Spinning can only waste time if the thread that will put is not running
+    max_spin(std::thread::hardware_concurrency() == 1 ? 0 : max_spin)
+{
+}
+
+bool semaphore_adaptive::take()
+{
+    unsigned int cur = value.load(std::memory_order_relaxed);
+    while (cur > 0)
+    {
+        if (value.compare_exchange_weak(cur, cur - 1,
+                                        std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            if (cur == 1 && fd_exposed.load(std::memory_order_relaxed))
+                clear();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool semaphore_adaptive::spin()
+{
+    /* Spin for about twice as long as recent successful spins needed, with a
+     * small minimum so that the estimate can grow again after it has decayed.
+     */
+    unsigned int estimate = spin_estimate.load(std::memory_order_relaxed);
+    unsigned int limit = std::min(max_spin, 2 * estimate + 16);
+    for (unsigned int i = 1; i <= limit; i++)
+    {
+        cpu_relax();
+        if (take())
+        {
+            spin_estimate.store(int(estimate) + (int(i) - int(estimate)) / 8,
+                                std::memory_order_relaxed);
+            return true;
+        }
+    }
+    // Spinning didn't help, so do less of it next time
+    spin_estimate.store(estimate - estimate / 8, std::memory_order_relaxed);
+    return false;
+}
+
+void semaphore_adaptive::clear() const
+{
+    while (doorbell.try_get() == 0)
+    {
+    }
+    // Pairs with the fence in put: either we see the new value or it signals
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (value.load(std::memory_order_relaxed) > 0)
+        doorbell.put();
+}
+
+#if SPEAD2_USE_FUTEX
+
+void semaphore_adaptive::wake()
+{
+    if (syscall(SYS_futex, reinterpret_cast<int *>(&value), FUTEX_WAKE_PRIVATE, 1,
+                nullptr, nullptr, 0) == -1)
+        throw_errno("futex wake failed");
+}
+
+int semaphore_adaptive::sleep(const std::chrono::steady_clock::time_point *deadline)
+{
+    struct timespec timeout;
+    if (deadline)
+    {
+        // FUTEX_WAIT takes a timeout relative to the monotonic clock
+        auto remaining = *deadline - std::chrono::steady_clock::now();
+        if (remaining <= remaining.zero())
+            return -1;
+        std::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+        timeout.tv_sec = ns / 1000000000;
+        timeout.tv_nsec = ns % 1000000000;
+    }
+    int status = syscall(SYS_futex, reinterpret_cast<int *>(&value), FUTEX_WAIT_PRIVATE, 0,
+                         deadline ? &timeout : nullptr, nullptr, 0);
+    if (status == -1)
+    {
+        if (errno == EAGAIN)
+            return 0;     // value was no longer zero
+        else if (errno == EINTR || errno == ETIMEDOUT)
+            return -1;
+        else
+            throw_errno("futex wait failed");
+    }
+    return 0;
+}
+
+#else // !SPEAD2_USE_FUTEX
+
+void semaphore_adaptive::wake()
+{
+    doorbell.put();
+}
+
+int semaphore_adaptive::sleep(const std::chrono::steady_clock::time_point *deadline)
+{
+    int status = deadline ? doorbell.get_until(*deadline) : doorbell.get();
+    // We consumed a signal that might have been needed to keep the fd readable
+    if (status == 0 && fd_exposed.load(std::memory_order_relaxed))
+        clear();
+    return status;
+}
+
+#endif // !SPEAD2_USE_FUTEX
+
+void semaphore_adaptive::put()
+{
+    unsigned int old = value.fetch_add(1, std::memory_order_seq_cst);
+    // Pairs with get_internal and clear: either we see the sleeper or it sees the value
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) > 0)
+        wake();
+    if (old == 0 && fd_exposed.load(std::memory_order_relaxed))
+        doorbell.put();
+}
+
+int semaphore_adaptive::try_get()
+{
+    if (take())
+        return 0;
+    if (fd_exposed.load(std::memory_order_relaxed))
+        clear();
+    return -1;
+}
+
+int semaphore_adaptive::get_internal(const std::chrono::steady_clock::time_point *deadline)
+{
+    if (take() || spin())
+        return 0;
+    while (true)
+    {
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (take())
+        {
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+            return 0;
+        }
+        int status = sleep(deadline);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if (status == -1)
+            return -1;
+        if (take())
+            return 0;
+    }
+}
+
+int semaphore_adaptive::get()
+{
+    return get_internal(nullptr);
+}
+
+int semaphore_adaptive::get_until(std::chrono::steady_clock::time_point deadline)
+{
+    return get_internal(&deadline);
+}
+
+int semaphore_adaptive::get_fd() const
+{
+    if (!fd_exposed.exchange(true))
+        clear();
+    return doorbell.get_fd();
+}
+
 boost::asio::posix::stream_descriptor wrap_fd(boost::asio::io_service &io_service, int fd)
 {
     int fd2 = dup(fd);
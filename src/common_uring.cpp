@@ -0,0 +1,172 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <spead2/common_features.h>
+#if SPEAD2_USE_URING
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <spead2/common_uring.h>
+#include <spead2/common_logging.h>
+
+namespace spead2
+{
+
+static int sys_io_uring_setup(unsigned int entries, io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+                                 unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *map_ring(int fd, std::size_t size, off_t offset)
+{
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, offset);
+    if (ptr == MAP_FAILED)
+        throw_errno("mmap failed");
+    return ptr;
+}
+
+io_uring_t::io_uring_t(unsigned int entries)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0)
+        throw_errno("io_uring_setup failed");
+    features = params.features;
+
+    try
+    {
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring_ptr = map_ring(fd, sq_ring_size, IORING_OFF_SQ_RING);
+        if (features & IORING_FEAT_SINGLE_MMAP)
+            cq_ring_ptr = sq_ring_ptr;
+        else
+            cq_ring_ptr = map_ring(fd, cq_ring_size, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(map_ring(fd, sqes_size, IORING_OFF_SQES));
+    }
+    catch (std::exception &)
+    {
+        unmap();
+        close(fd);
+        throw;
+    }
+
+    char *sq = static_cast<char *>(sq_ring_ptr);
+    sq_head = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    sq_entries = *reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_entries);
+    sq_array = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+    char *cq = static_cast<char *>(cq_ring_ptr);
+    cq_head = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    sqe_tail = *sq_tail;
+}
+
+void io_uring_t::unmap()
+{
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (cq_ring_ptr && cq_ring_ptr != sq_ring_ptr)
+        munmap(cq_ring_ptr, cq_ring_size);
+    if (sq_ring_ptr)
+        munmap(sq_ring_ptr, sq_ring_size);
+    sqes = nullptr;
+    sq_ring_ptr = cq_ring_ptr = nullptr;
+}
+
+io_uring_t::~io_uring_t()
+{
+    unmap();
+    if (fd >= 0 && close(fd) < 0)
+        log_warning("failed to close io_uring: %1%", std::strerror(errno));
+}
+
+io_uring_sqe *io_uring_t::get_sqe()
+{
+    unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail - head >= sq_entries)
+        return nullptr;
+    io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+    sq_array[sqe_tail & sq_mask] = sqe_tail & sq_mask;
+    sqe_tail++;
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned int io_uring_t::submit()
+{
+    unsigned int to_submit = sqe_tail - *sq_tail;
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned int submitted = 0;
+    while (submitted < to_submit)
+    {
+        int ret = sys_io_uring_enter(fd, to_submit - submitted, 0, 0);
+        if (ret < 0 && errno != EINTR)
+            throw_errno("io_uring_enter failed");
+        else if (ret == 0)
+            throw_errno("io_uring_enter made no progress", EBUSY);
+        else if (ret > 0)
+            submitted += ret;
+    }
+    return submitted;
+}
+
+void io_uring_t::register_files(const int *fds, unsigned int n_fds)
+{
+    if (sys_io_uring_register(fd, IORING_REGISTER_FILES, fds, n_fds) < 0)
+        throw_errno("io_uring_register(IORING_REGISTER_FILES) failed");
+}
+
+void io_uring_t::register_eventfd(int event_fd)
+{
+    if (sys_io_uring_register(fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+        throw_errno("io_uring_register(IORING_REGISTER_EVENTFD) failed");
+}
+
+} // namespace spead2
+
+#endif // SPEAD2_USE_URING
@@ -296,7 +296,32 @@ void register_module(py::module m)
 
     py::class_<mmap_allocator, memory_allocator, std::shared_ptr<mmap_allocator>>(
         m, "MmapAllocator")
-        .def(py::init<int>(), "flags"_a=0);
+        .def(py::init([](int flags, bool prefer_huge, std::size_t huge_page_size,
+                         bool transparent_huge, int numa_node, bool lock, bool populate)
+            {
+                mmap_allocator_config config;
+                config.set_flags(flags);
+                config.set_prefer_huge(prefer_huge);
+                config.set_huge_page_size(huge_page_size);
+                config.set_transparent_huge(transparent_huge);
+                config.set_numa_node(numa_node);
+                config.set_lock(lock);
+                config.set_populate(populate);
+                return std::make_shared<mmap_allocator>(config);
+            }),
+            "flags"_a=0, "prefer_huge"_a=false, "huge_page_size"_a=0,
+            "transparent_huge"_a=false, "numa_node"_a=-1, "lock"_a=false, "populate"_a=true);
+
+    py::class_<memory_pool_stats>(m, "MemoryPoolStats")
+        .def(py::init<>())
+        .def_readwrite("allocations", &memory_pool_stats::allocations)
+        .def_readwrite("hits", &memory_pool_stats::hits)
+        .def_readwrite("misses", &memory_pool_stats::misses)
+        .def_readwrite("out_of_range", &memory_pool_stats::out_of_range)
+        .def_readwrite("dropped_frees", &memory_pool_stats::dropped_frees)
+        .def_readwrite("current_free", &memory_pool_stats::current_free)
+        .def_readwrite("min_free", &memory_pool_stats::min_free)
+        .def_readwrite("refill_histogram", &memory_pool_stats::refill_histogram);
 
     py::class_<memory_pool, memory_allocator, std::shared_ptr<memory_pool>>(
         m, "MemoryPool")
@@ -305,7 +330,32 @@ void register_module(py::module m)
         .def(py::init<std::shared_ptr<thread_pool>, std::size_t, std::size_t, std::size_t, std::size_t, std::size_t, std::shared_ptr<memory_allocator>>(),
              "thread_pool"_a, "lower"_a, "upper"_a, "max_free"_a, "initial"_a, "low_water"_a, "allocator"_a)
         .def_property("warn_on_empty",
-                      &memory_pool::get_warn_on_empty, &memory_pool::set_warn_on_empty);
+                      &memory_pool::get_warn_on_empty, &memory_pool::set_warn_on_empty)
+        .def("fill_async", SPEAD2_PTMF(memory_pool, fill_async), "target"_a)
+        .def_property_readonly("stats", SPEAD2_PTMF(memory_pool, get_stats));
+
+    py::class_<size_class_memory_pool, memory_allocator, std::shared_ptr<size_class_memory_pool>>
+        size_class_memory_pool_cls(m, "SizeClassMemoryPool");
+    py::class_<size_class_memory_pool::size_class>(size_class_memory_pool_cls, "SizeClass")
+        .def(py::init<std::size_t, std::size_t, std::size_t, std::size_t>(),
+             "size"_a, "max_free"_a, "initial"_a, "low_water"_a=0)
+        .def_readwrite("size", &size_class_memory_pool::size_class::size)
+        .def_readwrite("max_free", &size_class_memory_pool::size_class::max_free)
+        .def_readwrite("initial", &size_class_memory_pool::size_class::initial)
+        .def_readwrite("low_water", &size_class_memory_pool::size_class::low_water);
+    size_class_memory_pool_cls
+        .def(py::init<std::vector<size_class_memory_pool::size_class>, std::shared_ptr<memory_allocator>>(),
+             "classes"_a, py::arg_v("allocator", nullptr, "None"))
+        .def(py::init<std::shared_ptr<thread_pool>, std::vector<size_class_memory_pool::size_class>, std::shared_ptr<memory_allocator>>(),
+             "thread_pool"_a, "classes"_a, py::arg_v("allocator", nullptr, "None"))
+        .def_static("power_of_two_classes", &size_class_memory_pool::power_of_two_classes,
+                    "min_size"_a, "max_size"_a, "max_free"_a, "initial"_a, "low_water"_a=0)
+        .def_property_readonly("num_classes", SPEAD2_PTMF(size_class_memory_pool, get_num_classes))
+        .def("get_class", SPEAD2_PTMF(size_class_memory_pool, get_class), "index"_a)
+        .def("get_stats", SPEAD2_PTMF(size_class_memory_pool, get_stats), "index"_a)
+        .def_property("warn_on_empty",
+                      &size_class_memory_pool::get_warn_on_empty,
+                      &size_class_memory_pool::set_warn_on_empty);
 
     py::class_<thread_pool_wrapper, std::shared_ptr<thread_pool_wrapper>>(m, "ThreadPool")
         .def(py::init<int>(), "threads"_a = 1)
@@ -23,6 +23,8 @@
 #include <pybind11/operators.h>
 #include <stdexcept>
 #include <cstdint>
+#include <vector>
+#include <chrono>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <boost/optional.hpp>
@@ -101,7 +103,7 @@ public:
  * on completion of code scheduled through the thread pool must drop the GIL
  * first.
  */
-class ring_stream_wrapper : public ring_stream<ringbuffer<live_heap, semaphore_gil<semaphore_fd>, semaphore> >
+class ring_stream_wrapper : public ring_stream<ringbuffer<live_heap, semaphore_gil<semaphore_adaptive>, semaphore_adaptive> >
 {
 private:
     bool incomplete_keep_payload_ranges;
@@ -136,7 +138,7 @@ public:
         std::size_t ring_heaps = default_ring_heaps,
         bool contiguous_only = true,
         bool incomplete_keep_payload_ranges = false)
-        : ring_stream<ringbuffer<live_heap, semaphore_gil<semaphore_fd>, semaphore>>(
+        : ring_stream<ringbuffer<live_heap, semaphore_gil<semaphore_adaptive>, semaphore_adaptive>>(
             std::move(io_service), bug_compat, max_heaps, ring_heaps, contiguous_only),
         incomplete_keep_payload_ranges(incomplete_keep_payload_ranges)
     {}
@@ -163,6 +165,27 @@ public:
         return to_object(try_pop_live());
     }
 
+    py::list get_many(std::size_t max_heaps, py::object timeout)
+    {
+        std::vector<live_heap> heaps;
+        if (!timeout.is_none())
+        {
+            double seconds = timeout.cast<double>();
+            if (!(seconds >= 0.0))
+                throw std::invalid_argument("timeout must be non-negative");
+            heaps = pop_many_live(
+                max_heaps,
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(seconds)));
+        }
+        else
+            heaps = pop_many_live(max_heaps);
+        py::list out;
+        for (live_heap &h : heaps)
+            out.append(to_object(std::move(h)));
+        return out;
+    }
+
     int get_fd() const
     {
         return get_ringbuffer().get_data_sem().get_fd();
@@ -397,6 +420,8 @@ py::module register_module(py::module &parent)
         .def("__next__", SPEAD2_PTMF(ring_stream_wrapper, next))
         .def("get", SPEAD2_PTMF(ring_stream_wrapper, get))
         .def("get_nowait", SPEAD2_PTMF(ring_stream_wrapper, get_nowait))
+        .def("get_many", SPEAD2_PTMF(ring_stream_wrapper, get_many),
+             "max_heaps"_a, "timeout"_a = py::none())
         .def("set_memory_allocator", SPEAD2_PTMF(ring_stream_wrapper, set_memory_allocator),
              "allocator"_a)
         .def("set_memory_pool", SPEAD2_PTMF(ring_stream_wrapper, set_memory_pool),
@@ -489,7 +514,7 @@ py::module register_module(py::module &parent)
         .def_readonly_static("DEFAULT_UDP_BUFFER_SIZE", &udp_reader::default_buffer_size)
         .def_readonly_static("DEFAULT_TCP_MAX_SIZE", &tcp_reader::default_max_size)
         .def_readonly_static("DEFAULT_TCP_BUFFER_SIZE", &tcp_reader::default_buffer_size);
-    using Ringbuffer = ringbuffer<live_heap, semaphore_gil<semaphore_fd>, semaphore>;
+    using Ringbuffer = ringbuffer<live_heap, semaphore_gil<semaphore_adaptive>, semaphore_adaptive>;
     py::class_<Ringbuffer>(stream_class, "Ringbuffer")
         .def("size", SPEAD2_PTMF(Ringbuffer, size))
         .def("capacity", SPEAD2_PTMF(Ringbuffer, capacity));
@@ -80,7 +80,10 @@ flavour heap_wrapper::get_flavour() const
 
 py::bytes packet_generator_next(packet_generator &gen)
 {
-    packet pkt = gen.next_packet();
+    std::size_t words = (packet_generator::max_header_size(gen.get_max_packet_size()) + 7) / 8;
+    std::unique_ptr<std::uint64_t[]> scratch(new std::uint64_t[words]);
+    packet pkt;
+    gen.next_packet(pkt, reinterpret_cast<std::uint8_t *>(scratch.get()));
     if (pkt.buffers.empty())
         throw py::stop_iteration();
     return py::bytes(std::string(boost::asio::buffers_begin(pkt.buffers),
@@ -123,7 +126,8 @@ public:
     using Base::Base;
 
     /// Sends heap synchronously
-    item_pointer_t send_heap(const heap_wrapper &h, s_item_pointer_t cnt = -1)
+    item_pointer_t send_heap(const heap_wrapper &h, s_item_pointer_t cnt = -1,
+                             std::size_t substream_index = 0, std::size_t priority = 0)
     {
         /* The semaphore state needs to be in shared_ptr because if we are
          * interrupted and throw an exception, it still needs to exist until
@@ -135,13 +139,46 @@ public:
             state->ec = ec;
             state->bytes_transferred = bytes_transferred;
             state->sem.put();
-        }, cnt);
+        }, cnt, substream_index, priority);
         semaphore_get(state->sem);
         if (state->ec)
             throw boost_io_error(state->ec);
         else
             return state->bytes_transferred;
     }
+
+    /// Sends a group of heaps synchronously
+    std::vector<item_pointer_t> send_heaps(const std::vector<const heap_wrapper *> &heaps,
+                                           std::size_t priority = 0)
+    {
+        struct group_state
+        {
+            semaphore_gil<semaphore> sem;
+            std::vector<heap_result> results;
+        };
+
+        // See send_heap for why this is in a shared_ptr
+        auto state = std::make_shared<group_state>();
+        std::vector<heap_reference> refs;
+        refs.reserve(heaps.size());
+        for (const heap_wrapper *h : heaps)
+            refs.emplace_back(*h);
+        Base::async_send_heaps(refs, [state] (const std::vector<heap_result> &results)
+        {
+            state->results = results;
+            state->sem.put();
+        }, priority);
+        semaphore_get(state->sem);
+        std::vector<item_pointer_t> out;
+        out.reserve(state->results.size());
+        for (const heap_result &result : state->results)
+        {
+            if (result.ec)
+                throw boost_io_error(result.ec);
+            out.push_back(result.bytes_transferred);
+        }
+        return out;
+    }
 };
 
 struct callback_item
@@ -179,7 +216,8 @@ public:
 
     int get_fd() const { return sem.get_fd(); }
 
-    bool async_send_heap_obj(py::object h, py::object callback, s_item_pointer_t cnt = -1)
+    bool async_send_heap_obj(py::object h, py::object callback, s_item_pointer_t cnt = -1,
+                             std::size_t substream_index = 0, std::size_t priority = 0)
     {
         /* Normally the callback should not refer to this, since it could have
          * been reaped by the time the callback occurs. We rely on Python to
@@ -205,7 +243,7 @@ public:
             }
             if (was_empty)
                 sem.put();
-        }, cnt);
+        }, cnt, substream_index, priority);
     }
 
     void process_callbacks()
@@ -274,6 +312,18 @@ static typename Protocol::endpoint make_endpoint(
     return typename Protocol::endpoint(make_address(io_service, hostname), port);
 }
 
+template<typename Protocol>
+static std::vector<typename Protocol::endpoint> make_endpoints(
+    boost::asio::io_service &io_service,
+    const std::vector<std::pair<std::string, std::uint16_t>> &endpoints)
+{
+    std::vector<typename Protocol::endpoint> out;
+    out.reserve(endpoints.size());
+    for (const auto &endpoint : endpoints)
+        out.push_back(make_endpoint<Protocol>(io_service, endpoint.first, endpoint.second));
+    return out;
+}
+
 template<typename Base>
 class udp_stream_wrapper : public Base
 {
@@ -309,6 +359,37 @@ public:
         deprecation_warning("UdpStream constructor with both buffer_size and socket is deprecated");
     }
 
+    udp_stream_wrapper(
+        io_service_ref io_service,
+        const std::vector<std::pair<std::string, std::uint16_t>> &endpoints,
+        const stream_config &config,
+        std::size_t buffer_size,
+        const std::string &interface_address)
+        : Base(
+            std::move(io_service),
+            make_endpoints<boost::asio::ip::udp>(*io_service, endpoints),
+            config, buffer_size,
+            make_address(*io_service, interface_address))
+    {
+    }
+
+    udp_stream_wrapper(
+        io_service_ref io_service,
+        const std::vector<std::pair<std::string, std::uint16_t>> &endpoints,
+        const stream_config &config,
+        std::size_t buffer_size,
+        int ttl,
+        const std::string &interface_address)
+        : Base(
+            std::move(io_service),
+            make_endpoints<boost::asio::ip::udp>(*io_service, endpoints),
+            config, buffer_size, ttl,
+            interface_address.empty() ?
+                boost::asio::ip::address() :
+                make_address(*io_service, interface_address))
+    {
+    }
+
     udp_stream_wrapper(
         io_service_ref io_service,
         const std::string &multicast_group,
@@ -415,7 +496,8 @@ static py::class_<T> udp_stream_register(py::module &m, const char *name)
 {
     using namespace pybind11::literals;
 
-    return py::class_<T>(m, name)
+    py::class_<T> stream_class(m, name);
+    stream_class
         .def(py::init<std::shared_ptr<thread_pool_wrapper>, std::string, std::uint16_t, const stream_config &, std::size_t, const socket_wrapper<boost::asio::ip::udp::socket> &>(),
              "thread_pool"_a, "hostname"_a, "port"_a,
              "config"_a = stream_config(),
@@ -446,7 +528,26 @@ static py::class_<T> udp_stream_register(py::module &m, const char *name)
         .def(py::init<std::shared_ptr<thread_pool_wrapper>, const socket_wrapper<boost::asio::ip::udp::socket> &, std::string, std::uint16_t, const stream_config &>(),
              "thread_pool"_a, "socket"_a, "hostname"_a, "port"_a,
              "config"_a = stream_config())
+        .def(py::init<std::shared_ptr<thread_pool_wrapper>, const std::vector<std::pair<std::string, std::uint16_t>> &, const stream_config &, std::size_t, std::string>(),
+             "thread_pool"_a, "endpoints"_a,
+             "config"_a = stream_config(),
+             "buffer_size"_a = T::default_buffer_size,
+             "interface_address"_a = std::string())
+        .def(py::init<std::shared_ptr<thread_pool_wrapper>, const std::vector<std::pair<std::string, std::uint16_t>> &, const stream_config &, std::size_t, int, std::string>(),
+             "thread_pool"_a, "endpoints"_a,
+             "config"_a = stream_config(),
+             "buffer_size"_a = T::default_buffer_size,
+             "ttl"_a,
+             "interface_address"_a)
         .def_readonly_static("DEFAULT_BUFFER_SIZE", &T::default_buffer_size);
+#if SPEAD2_USE_TXTIME
+    stream_class
+        .def("enable_txtime", SPEAD2_PTMF(T, enable_txtime),
+             "lookahead"_a = T::default_txtime_lookahead,
+             "clock_id"_a = int(CLOCK_MONOTONIC))
+        .def_readonly_static("DEFAULT_TXTIME_LOOKAHEAD", &T::default_txtime_lookahead);
+#endif
+    return stream_class;
 }
 
 #if SPEAD2_USE_IBV
@@ -632,6 +733,8 @@ static void stream_register(py::class_<T> &stream_class)
     using namespace pybind11::literals;
     stream_class.def("set_cnt_sequence", SPEAD2_PTMF(T, set_cnt_sequence),
                      "next"_a, "step"_a);
+    stream_class.def_property_readonly("num_substreams", SPEAD2_PTMF(T, get_num_substreams));
+    stream_class.def_property_readonly("pacing_stats", SPEAD2_PTMF(T, get_pacing_stats));
 }
 
 template<typename T>
@@ -640,7 +743,10 @@ static void sync_stream_register(py::class_<T> &stream_class)
     using namespace pybind11::literals;
     stream_register(stream_class);
     stream_class.def("send_heap", SPEAD2_PTMF(T, send_heap),
-                     "heap"_a, "cnt"_a = s_item_pointer_t(-1));
+                     "heap"_a, "cnt"_a = s_item_pointer_t(-1),
+                     "substream_index"_a = std::size_t(0), "priority"_a = std::size_t(0));
+    stream_class.def("send_heaps", SPEAD2_PTMF(T, send_heaps),
+                     "heaps"_a, "priority"_a = std::size_t(0));
 }
 
 template<typename T>
@@ -651,7 +757,8 @@ static void async_stream_register(py::class_<T> &stream_class)
     stream_class
         .def_property_readonly("fd", SPEAD2_PTMF(T, get_fd))
         .def("async_send_heap", SPEAD2_PTMF(T, async_send_heap_obj),
-             "heap"_a, "callback"_a, "cnt"_a = s_item_pointer_t(-1))
+             "heap"_a, "callback"_a, "cnt"_a = s_item_pointer_t(-1),
+             "substream_index"_a = std::size_t(0), "priority"_a = std::size_t(0))
         .def("flush", SPEAD2_PTMF(T, flush))
         .def("process_callbacks", SPEAD2_PTMF(T, process_callbacks));
 }
@@ -683,13 +790,30 @@ py::module register_module(py::module &parent)
         .def("__iter__", [](py::object self) { return self; })
         .def("__next__", &packet_generator_next);
 
+    py::class_<shared_rate_limiter, std::shared_ptr<shared_rate_limiter>>(m, "SharedRateLimiter")
+        .def(py::init<double, std::size_t>(),
+             "rate"_a, "burst_size"_a = shared_rate_limiter::default_burst_size)
+        .def_property_readonly("rate", SPEAD2_PTMF(shared_rate_limiter, get_rate))
+        .def_property_readonly("burst_size", SPEAD2_PTMF(shared_rate_limiter, get_burst_size))
+        .def_property_readonly("num_streams", SPEAD2_PTMF(shared_rate_limiter, get_num_streams))
+        .def_property_readonly("num_active", SPEAD2_PTMF(shared_rate_limiter, get_num_active))
+        .def_property_readonly("reserved_rate", SPEAD2_PTMF(shared_rate_limiter, get_reserved_rate))
+        .def_readonly_static("DEFAULT_BURST_SIZE", &shared_rate_limiter::default_burst_size);
+
     py::class_<stream_config>(m, "StreamConfig")
-        .def(py::init<std::size_t, double, std::size_t, std::size_t, double>(),
+        .def(py::init<std::size_t, double, std::size_t, std::size_t, double, std::size_t, double,
+                      std::shared_ptr<shared_rate_limiter>, double, double, std::size_t>(),
              "max_packet_size"_a = stream_config::default_max_packet_size,
              "rate"_a = 0.0,
              "burst_size"_a = stream_config::default_burst_size,
              "max_heaps"_a = stream_config::default_max_heaps,
-             "burst_rate_ratio"_a = stream_config::default_burst_rate_ratio)
+             "burst_rate_ratio"_a = stream_config::default_burst_rate_ratio,
+             "max_interleave"_a = stream_config::default_max_interleave,
+             "spin_time"_a = stream_config::default_spin_time,
+             "rate_limiter"_a = std::shared_ptr<shared_rate_limiter>(),
+             "rate_weight"_a = stream_config::default_rate_weight,
+             "min_rate"_a = 0.0,
+             "num_priorities"_a = stream_config::default_num_priorities)
         .def_property("max_packet_size",
                       SPEAD2_PTMF(stream_config, get_max_packet_size),
                       SPEAD2_PTMF(stream_config, set_max_packet_size))
@@ -705,12 +829,43 @@ py::module register_module(py::module &parent)
         .def_property("burst_rate_ratio",
                       SPEAD2_PTMF(stream_config, get_burst_rate_ratio),
                       SPEAD2_PTMF(stream_config, set_burst_rate_ratio))
+        .def_property("max_interleave",
+                      SPEAD2_PTMF(stream_config, get_max_interleave),
+                      SPEAD2_PTMF(stream_config, set_max_interleave))
+        .def_property("spin_time",
+                      SPEAD2_PTMF(stream_config, get_spin_time),
+                      SPEAD2_PTMF(stream_config, set_spin_time))
+        .def_property("rate_limiter",
+                      SPEAD2_PTMF(stream_config, get_rate_limiter),
+                      SPEAD2_PTMF(stream_config, set_rate_limiter))
+        .def_property("rate_weight",
+                      SPEAD2_PTMF(stream_config, get_rate_weight),
+                      SPEAD2_PTMF(stream_config, set_rate_weight))
+        .def_property("min_rate",
+                      SPEAD2_PTMF(stream_config, get_min_rate),
+                      SPEAD2_PTMF(stream_config, set_min_rate))
+        .def_property("num_priorities",
+                      SPEAD2_PTMF(stream_config, get_num_priorities),
+                      SPEAD2_PTMF(stream_config, set_num_priorities))
         .def_property_readonly("burst_rate",
                                SPEAD2_PTMF(stream_config, get_burst_rate))
         .def_readonly_static("DEFAULT_MAX_PACKET_SIZE", &stream_config::default_max_packet_size)
         .def_readonly_static("DEFAULT_MAX_HEAPS", &stream_config::default_max_heaps)
         .def_readonly_static("DEFAULT_BURST_SIZE", &stream_config::default_burst_size)
-        .def_readonly_static("DEFAULT_BURST_RATE_RATIO", &stream_config::default_burst_rate_ratio);
+        .def_readonly_static("DEFAULT_BURST_RATE_RATIO", &stream_config::default_burst_rate_ratio)
+        .def_readonly_static("DEFAULT_MAX_INTERLEAVE", &stream_config::default_max_interleave)
+        .def_readonly_static("DEFAULT_SPIN_TIME", &stream_config::default_spin_time)
+        .def_readonly_static("DEFAULT_RATE_WEIGHT", &stream_config::default_rate_weight)
+        .def_readonly_static("DEFAULT_NUM_PRIORITIES", &stream_config::default_num_priorities);
+
+    py::class_<pacing_stats>(m, "PacingStats")
+        .def_readonly("bursts", &pacing_stats::bursts)
+        .def_readonly("lateness", &pacing_stats::lateness)
+        .def_readonly("gap", &pacing_stats::gap)
+        .def_readonly("total_lateness", &pacing_stats::total_lateness)
+        .def_readonly("max_lateness", &pacing_stats::max_lateness);
+
+    m.attr("ALL_SUBSTREAMS") = py::int_(stream::all_substreams);
 
     {
         auto stream_class = udp_stream_register<udp_stream_wrapper<stream_wrapper<udp_stream>>>(m, "UdpStream");
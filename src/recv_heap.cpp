@@ -49,9 +49,112 @@ static inline item_pointer_t load_bytes_be(const std::uint8_t *ptr, int len)
     return betoh<item_pointer_t>(out);
 }
 
+constexpr std::size_t heap_metadata_pool::default_max_free;
+constexpr std::size_t heap_metadata_pool::max_node_size;
+
+heap_metadata_pool::heap_metadata_pool(std::size_t max_free)
+    : max_free(max_free)
+{
+    // Reserve space so that returning storage never allocates
+    free_items.reserve(max_free);
+    free_bytes.reserve(max_free);
+    free_pointers.reserve(max_free);
+    free_nodes.reserve(max_free);
+}
+
+heap_metadata_pool::~heap_metadata_pool()
+{
+    for (void *node : free_nodes)
+        ::operator delete(node);
+}
+
+template<typename T>
+T heap_metadata_pool::take(std::vector<T> &free)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free.empty())
+        return T();
+    T out = std::move(free.back());
+    free.pop_back();
+    return out;
+}
+
+template<typename T>
+void heap_metadata_pool::give(std::vector<T> &free, T &&value)
+{
+    if (value.capacity() == 0)
+        return;
+    value.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free.size() < max_free)
+        free.push_back(std::move(value));
+}
+
+std::vector<item> heap_metadata_pool::take_items()
+{
+    return take(free_items);
+}
+
+std::vector<std::uint8_t> heap_metadata_pool::take_bytes()
+{
+    return take(free_bytes);
+}
+
+std::vector<item_pointer_t> heap_metadata_pool::take_pointers()
+{
+    return take(free_pointers);
+}
+
+void heap_metadata_pool::give_items(std::vector<item> &&items)
+{
+    give(free_items, std::move(items));
+}
+
+void heap_metadata_pool::give_bytes(std::vector<std::uint8_t> &&bytes)
+{
+    give(free_bytes, std::move(bytes));
+}
+
+void heap_metadata_pool::give_pointers(std::vector<item_pointer_t> &&pointers)
+{
+    give(free_pointers, std::move(pointers));
+}
+
+void *heap_metadata_pool::allocate_node(std::size_t size)
+{
+    if (size > max_node_size)
+        return ::operator new(size);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_nodes.empty())
+        {
+            void *node = free_nodes.back();
+            free_nodes.pop_back();
+            return node;
+        }
+    }
+    return ::operator new(max_node_size);
+}
+
+void heap_metadata_pool::deallocate_node(void *ptr, std::size_t size)
+{
+    if (size <= max_node_size)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_nodes.size() < max_free)
+        {
+            free_nodes.push_back(ptr);
+            return;
+        }
+    }
+    ::operator delete(ptr);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
 void heap_base::transfer_immediates(heap_base &&other) noexcept
 {
-    if (!immediate_payload)
+    if (immediate_payload.empty())
     {
         std::memcpy(immediate_payload_inline, other.immediate_payload_inline,
                     sizeof(immediate_payload_inline));
@@ -61,9 +164,21 @@ void heap_base::transfer_immediates(heap_base &&other) noexcept
     }
 }
 
+void heap_base::recycle() noexcept
+{
+    if (metadata)
+    {
+        metadata->give_items(std::move(items));
+        metadata->give_bytes(std::move(immediate_payload));
+    }
+    items.clear();
+    immediate_payload.clear();
+}
+
 heap_base::heap_base(heap_base &&other) noexcept
     : cnt(std::move(other.cnt)),
     flavour_(std::move(other.flavour_)),
+    metadata(std::move(other.metadata)),
     items(std::move(other.items)),
     immediate_payload(std::move(other.immediate_payload)),
     payload(std::move(other.payload))
@@ -73,8 +188,10 @@ heap_base::heap_base(heap_base &&other) noexcept
 
 heap_base &heap_base::operator=(heap_base &&other) noexcept
 {
+    recycle();
     cnt = std::move(other.cnt);
     flavour_ = std::move(other.flavour_);
+    metadata = std::move(other.metadata);
     items = std::move(other.items);
     immediate_payload = std::move(other.immediate_payload);
     payload = std::move(other.payload);
@@ -82,6 +199,11 @@ heap_base &heap_base::operator=(heap_base &&other) noexcept
     return *this;
 }
 
+heap_base::~heap_base()
+{
+    recycle();
+}
+
 void heap_base::load(live_heap &&h, bool keep_addressed, bool keep_payload)
 {
     assert(h.is_contiguous() || !keep_addressed);
@@ -118,11 +240,16 @@ void heap_base::load(live_heap &&h, bool keep_addressed, bool keep_payload)
     // Allocate memory if necessary
     const std::size_t immediate_size = decoder.address_bits() / 8;
     const std::size_t id_size = sizeof(item_pointer_t) - immediate_size;
+    metadata = h.metadata;
+    if (metadata)
+        items = metadata->take_items();
     uint8_t *next_immediate;
     if (immediate_size * n_immediates > sizeof(immediate_payload_inline))
     {
-        next_immediate = new uint8_t[immediate_size * n_immediates];
-        immediate_payload.reset(next_immediate);
+        if (metadata)
+            immediate_payload = metadata->take_bytes();
+        immediate_payload.resize(immediate_size * n_immediates);
+        next_immediate = immediate_payload.data();
     }
     else
         next_immediate = immediate_payload_inline;
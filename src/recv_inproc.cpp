@@ -31,6 +31,8 @@ namespace spead2
 namespace recv
 {
 
+constexpr std::size_t inproc_reader::max_batch;
+
 inproc_reader::inproc_reader(
     stream &owner,
     std::shared_ptr<inproc_queue> queue)
@@ -72,9 +74,12 @@ void inproc_reader::packet_handler(
         {
             try
             {
-                inproc_queue::packet packet = queue->buffer.try_pop();
-                process_one_packet(state, packet);
-                /* TODO: could grab a batch of packets to amortise costs */
+                // Process a batch per wakeup to amortise the cost of polling
+                for (std::size_t i = 0; i < max_batch && !state.is_stopped(); i++)
+                {
+                    inproc_queue::packet packet = queue->buffer.try_pop();
+                    process_one_packet(state, packet);
+                }
             }
             catch (ringbuffer_stopped &)
             {
@@ -82,7 +87,7 @@ void inproc_reader::packet_handler(
             }
             catch (ringbuffer_empty &)
             {
-                // spurious wakeup - no action needed
+                // queue drained (or spurious wakeup) - no action needed
             }
         }
     }
@@ -35,14 +35,24 @@ namespace recv
 {
 
 live_heap::live_heap(const packet_header &initial_packet,
-                     bug_compat_mask bug_compat)
+                     bug_compat_mask bug_compat,
+                     std::shared_ptr<heap_metadata_pool> metadata)
     : cnt(initial_packet.heap_cnt),
     decoder(initial_packet.heap_address_bits),
-    bug_compat(bug_compat)
+    bug_compat(bug_compat),
+    metadata(metadata),
+    seen_pointers(metadata_allocator<item_pointer_t>(metadata)),
+    payload_ranges(payload_range_map::allocator_type(std::move(metadata)))
 {
     assert(cnt >= 0);
 }
 
+live_heap::~live_heap()
+{
+    if (metadata)
+        metadata->give_pointers(std::move(external_pointers));
+}
+
 void live_heap::payload_reserve(std::size_t size, bool exact, const packet_header &packet,
                                 memory_allocator &allocator)
 {
@@ -123,6 +133,8 @@ void live_heap::add_pointers(std::size_t n, const std::uint8_t *pointers)
             {
                 if (n_inline_pointers == max_inline_pointers)
                 {
+                    if (metadata)
+                        external_pointers = metadata->take_pointers();
                     external_pointers.reserve(n_inline_pointers + (n - i));
                     external_pointers.insert(external_pointers.end(),
                                              inline_pointers.begin(),
@@ -270,6 +282,8 @@ void live_heap::reset()
     payload.reset();
     payload_reserved = 0;
     n_inline_pointers = 0;
+    if (metadata)
+        metadata->give_pointers(std::move(external_pointers));
     external_pointers.clear();
     external_pointers.shrink_to_fit();
     seen_pointers.clear();
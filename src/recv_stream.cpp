@@ -96,7 +96,9 @@ stream_base::stream_base(bug_compat_mask bug_compat, std::size_t max_heaps)
     head(0),
     max_heaps(max_heaps), bug_compat(bug_compat),
     memcpy(SPEAD2_ADAPT_MEMCPY(std::memcpy, )),
-    allocator(std::make_shared<memory_allocator>())
+    allocator(std::make_shared<memory_allocator>()),
+    metadata(std::make_shared<heap_metadata_pool>(
+        std::max(heap_metadata_pool::default_max_free, 2 * max_heaps)))
 {
     if (max_heaps == 0)
         throw std::invalid_argument("max_heaps cannot be 0");
@@ -282,7 +284,7 @@ bool stream_base::add_packet(add_packet_state &state, const packet_header &packe
         }
         entry->next = buckets[bucket_id];
         buckets[bucket_id] = entry;
-        new (&entry->heap) live_heap(packet, bug_compat);
+        new (&entry->heap) live_heap(packet, bug_compat, metadata);
     }
 
     live_heap *h = &entry->heap;
@@ -150,6 +150,14 @@ heap::heap(const flavour &flavour_)
 {
 }
 
+bool heap::is_end() const
+{
+    for (const item &it : items)
+        if (it.id == STREAM_CTRL_ID && it.is_inline && it.data.immediate == CTRL_STREAM_STOP)
+            return true;
+    return false;
+}
+
 void heap::add_descriptor(const descriptor &descriptor)
 {
     auto blob = encode_descriptor(descriptor, flavour_);
@@ -23,6 +23,8 @@
 #include <cstring>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
+#include <cassert>
 #include <spead2/send_heap.h>
 #include <spead2/send_utils.h>
 #include <spead2/send_packet.h>
@@ -36,6 +38,7 @@ namespace send
 {
 
 constexpr std::size_t packet_generator::prefix_size;
+constexpr std::size_t heap_plan::padding_item;
 
 static bool use_immediate(const item &it, std::size_t max_immediate_size)
 {
@@ -43,10 +46,60 @@ static bool use_immediate(const item &it, std::size_t max_immediate_size)
         || (it.allow_immediate && it.data.buffer.length <= max_immediate_size);
 }
 
+/// Copy the value of a non-inline item to contiguous memory
+static void copy_value(const item &it, std::uint8_t *out)
+{
+    for (std::size_t i = 0; i < it.num_fragments(); i++)
+    {
+        item_fragment frag = it.get_fragment(i);
+        std::memcpy(out, frag.ptr, frag.length);
+        out += frag.length;
+    }
+}
+
+/// Encode an item pointer for an item that uses immediate encoding (big endian)
+static item_pointer_t encode_immediate_item(
+    const pointer_encoder &encoder, const item &it, std::size_t max_immediate_size)
+{
+    (void) max_immediate_size;  // only used in assertion
+    item_pointer_t ip;
+    if (it.is_inline)
+    {
+        ip = htobe<item_pointer_t>(encoder.encode_immediate(it.id, it.data.immediate));
+    }
+    else
+    {
+        assert(it.data.buffer.length <= max_immediate_size);
+        ip = htobe<item_pointer_t>(encoder.encode_immediate(it.id, 0));
+        copy_value(it, reinterpret_cast<std::uint8_t *>(&ip) + sizeof(item_pointer_t) - it.data.buffer.length);
+    }
+    return ip;
+}
+
 packet_generator::packet_generator(
     const heap &h, item_pointer_t cnt, std::size_t max_packet_size)
-    : h(h), cnt(cnt), max_packet_size(max_packet_size)
+    : packet_generator(h, cnt, max_packet_size, h.get_plan().get())
 {
+}
+
+packet_generator::packet_generator(
+    const heap &h, item_pointer_t cnt, std::size_t max_packet_size,
+    const heap_plan *plan)
+    : h(h), cnt(cnt), max_packet_size(max_packet_size),
+    encoder(h.get_flavour().get_heap_address_bits()),
+    max_immediate_size(h.get_flavour().get_heap_address_bits() / 8)
+{
+    header_base =
+        (std::uint64_t(0x5304) << 48)
+        | (std::uint64_t(8 - max_immediate_size) << 40)
+        | (std::uint64_t(max_immediate_size) << 32);
+    cnt_pointer = htobe<item_pointer_t>(encoder.encode_immediate(HEAP_CNT_ID, cnt));
+    if (plan && plan->matches(h, max_packet_size))
+    {
+        this->plan = plan;
+        return;
+    }
+
     // Round down max packet size so that we can align payload
     max_packet_size &= ~7;
     /* We need
@@ -59,7 +112,6 @@ packet_generator::packet_generator(
         throw std::invalid_argument("packet size is too small");
 
     payload_size = 0;
-    const std::size_t max_immediate_size = h.get_flavour().get_heap_address_bits() / 8;
     for (const item &it : h.items)
     {
         if (!use_immediate(it, max_immediate_size))
@@ -90,16 +142,78 @@ packet_generator::packet_generator(
         payload_size = min_payload_size;
         need_null_item = true;
     }
+    heap_length_pointer = htobe<item_pointer_t>(encoder.encode_immediate(HEAP_LENGTH_ID, payload_size));
+}
+
+std::size_t packet_generator::max_header_size(std::size_t max_packet_size)
+{
+    /* Each packet has at most max_item_pointers_per_packet item pointers
+     * plus one for padding, which the constructor ensures fits in the
+     * (rounded-down) packet size.
+     */
+    return max_packet_size & ~7;
 }
 
 bool packet_generator::has_next_packet() const
 {
+    if (plan)
+        return next_plan_packet < plan->packets.size();
     return payload_offset < payload_size;
 }
 
-packet packet_generator::next_packet()
+void packet_generator::add_payload(packet &out, std::size_t length, item_pointer_t *padding)
+{
+    while (length > 0)
+    {
+        if (next_item == h.items.size())
+        {
+            // Dummy padding payload. Fill with zeros to simplify testing
+            assert(need_null_item);
+            assert(length <= 8);
+            *padding = 0;
+            out.buffers.emplace_back(padding, length);
+            length = 0;
+        }
+        else if (use_immediate(h.items[next_item], max_immediate_size))
+        {
+            next_item++;
+        }
+        else if (next_fragment == h.items[next_item].num_fragments())
+        {
+            next_item++;
+            next_fragment = 0;
+        }
+        else
+        {
+            item_fragment frag = h.items[next_item].get_fragment(next_fragment);
+            std::size_t send_bytes = std::min(frag.length - next_item_offset, length);
+            // Empty items and fragments do not contribute a buffer
+            if (send_bytes > 0)
+                out.buffers.emplace_back(frag.ptr + next_item_offset, send_bytes);
+            next_item_offset += send_bytes;
+            if (next_item_offset == frag.length)
+            {
+                next_fragment++;
+                next_item_offset = 0;
+            }
+            length -= send_bytes;
+        }
+    }
+}
+
+std::size_t packet_generator::next_packet(packet &out, std::uint8_t *scratch)
 {
-    packet out;
+    out.buffers.clear();
+    if (plan)
+    {
+        if (next_plan_packet < plan->packets.size())
+        {
+            plan->next_packet(next_plan_packet++, h, cnt_pointer, out, scratch);
+            // The header may be followed by an item pointer's worth of padding
+            return boost::asio::buffer_size(out.buffers[0]) + sizeof(item_pointer_t);
+        }
+        return 0;
+    }
 
     if (h.get_repeat_pointers())
     {
@@ -109,8 +223,6 @@ packet packet_generator::next_packet()
 
     if (payload_offset < payload_size)
     {
-        pointer_encoder encoder(h.get_flavour().get_heap_address_bits());
-        const std::size_t max_immediate_size = h.get_flavour().get_heap_address_bits() / 8;
         const std::size_t n_item_pointers = std::min(
             max_item_pointers_per_packet,
             h.items.size() + need_null_item - next_item_pointer);
@@ -118,20 +230,14 @@ packet packet_generator::next_packet()
             std::size_t(payload_size - payload_offset),
             max_packet_size - n_item_pointers * sizeof(item_pointer_t) - prefix_size);
 
-        // Determine how much internal data is needed.
-        // Always add enough to allow for padding the payload
-        std::size_t alloc_bytes = prefix_size + (n_item_pointers + 1) * sizeof(item_pointer_t);
-        out.data.reset(new std::uint8_t[alloc_bytes]);
-        std::uint64_t *header = reinterpret_cast<std::uint64_t *>(out.data.get());
-        *header = htobe<std::uint64_t>(
-            (std::uint64_t(0x5304) << 48)
-            | (std::uint64_t(8 - max_immediate_size) << 40)
-            | (std::uint64_t(max_immediate_size) << 32)
-            | (n_item_pointers + 4));
+        // The scratch space has room for one extra item pointer, which is
+        // used for padding the payload if necessary.
+        std::uint64_t *header = reinterpret_cast<std::uint64_t *>(scratch);
+        *header = htobe<std::uint64_t>(header_base | (n_item_pointers + 4));
         // TODO: if item_pointer_t is more than 64 bits, this will misalign
-        item_pointer_t *pointer = reinterpret_cast<item_pointer_t *>(out.data.get() + 8);
-        *pointer++ = htobe<item_pointer_t>(encoder.encode_immediate(HEAP_CNT_ID, cnt));
-        *pointer++ = htobe<item_pointer_t>(encoder.encode_immediate(HEAP_LENGTH_ID, payload_size));
+        item_pointer_t *pointer = reinterpret_cast<item_pointer_t *>(scratch + 8);
+        *pointer++ = cnt_pointer;
+        *pointer++ = heap_length_pointer;
         *pointer++ = htobe<item_pointer_t>(encoder.encode_immediate(PAYLOAD_OFFSET_ID, payload_offset));
         *pointer++ = htobe<item_pointer_t>(encoder.encode_immediate(PAYLOAD_LENGTH_ID, packet_payload_length));
         for (std::size_t i = 0; i < n_item_pointers; i++)
@@ -145,15 +251,9 @@ packet packet_generator::next_packet()
             else
             {
                 const item &it = h.items[next_item_pointer];
-                if (it.is_inline)
-                {
-                    ip = htobe<item_pointer_t>(encoder.encode_immediate(it.id, it.data.immediate));
-                }
-                else if (it.allow_immediate && it.data.buffer.length <= max_immediate_size)
+                if (use_immediate(it, max_immediate_size))
                 {
-                    ip = htobe<item_pointer_t>(encoder.encode_immediate(it.id, 0));
-                    std::memcpy(reinterpret_cast<char *>(&ip) + sizeof(item_pointer_t) - it.data.buffer.length,
-                                it.data.buffer.ptr, it.data.buffer.length);
+                    ip = encode_immediate_item(encoder, it, max_immediate_size);
                 }
                 else
                 {
@@ -164,43 +264,234 @@ packet packet_generator::next_packet()
             *pointer++ = ip;
             next_item_pointer++;
         }
-        out.buffers.emplace_back(out.data.get(), prefix_size + 8 * n_item_pointers);
+        std::size_t header_size = prefix_size + 8 * n_item_pointers;
+        out.buffers.emplace_back(scratch, header_size);
 
         // Generate payload
         payload_offset += packet_payload_length;
-        while (packet_payload_length > 0)
+        add_payload(out, packet_payload_length, pointer);
+        return header_size + sizeof(item_pointer_t);
+    }
+    return 0;
+}
+
+std::size_t packet_generator::next_packets(
+    packet *const *out, std::size_t max, std::uint8_t *&headers)
+{
+    std::size_t n = 0;
+    // Packets that still carry item pointers are generated one at a time
+    while (n < max
+           && (plan || h.get_repeat_pointers()
+               || next_item_pointer < h.items.size() + need_null_item))
+    {
+        std::size_t used = next_packet(*out[n], headers);
+        if (used == 0)
+            return n;
+        headers += used;
+        n++;
+    }
+
+    const std::uint64_t header_word = htobe<std::uint64_t>(header_base | 4);
+    const std::size_t max_payload = max_packet_size - prefix_size;
+    for (; n < max && payload_offset < payload_size; n++)
+    {
+        std::size_t length = std::min(std::size_t(payload_size - payload_offset), max_payload);
+        packet &pkt = *out[n];
+        item_pointer_t *pointer = reinterpret_cast<item_pointer_t *>(headers + 8);
+        *reinterpret_cast<std::uint64_t *>(headers) = header_word;
+        pointer[0] = cnt_pointer;
+        pointer[1] = heap_length_pointer;
+        pointer[2] = htobe<item_pointer_t>(encoder.encode_immediate(PAYLOAD_OFFSET_ID, payload_offset));
+        pointer[3] = htobe<item_pointer_t>(encoder.encode_immediate(PAYLOAD_LENGTH_ID, length));
+        pkt.buffers.clear();
+        pkt.buffers.emplace_back(headers, prefix_size);
+        payload_offset += length;
+        add_payload(pkt, length, pointer + 4);
+        headers += prefix_size + sizeof(item_pointer_t);
+    }
+    return n;
+}
+
+heap_plan::heap_plan(const heap &h, std::size_t max_packet_size, bool snapshot)
+    : flavour_(h.get_flavour()),
+    encoder(h.get_flavour().get_heap_address_bits()),
+    repeat_pointers(h.get_repeat_pointers()),
+    max_packet_size(max_packet_size)
+{
+    const std::size_t max_immediate_size = flavour_.get_heap_address_bits() / 8;
+    /* Offset of each addressed item in the snapshot. Items are stored in the
+     * same order as in the heap payload.
+     */
+    std::vector<std::size_t> snapshot_offset;
+    std::size_t snapshot_size = 0;
+    /* Non-empty fragments of the addressed items, in the order in which
+     * the generator sends them.
+     */
+    struct piece
+    {
+        std::size_t item, fragment, item_offset, length;
+    };
+    std::vector<piece> pieces;
+    for (std::size_t i = 0; i < h.items.size(); i++)
+    {
+        const item &it = h.items[i];
+        bool immediate = use_immediate(it, max_immediate_size);
+        std::size_t length = it.is_inline ? 0 : it.data.buffer.length;
+        std::size_t n_fragments = immediate ? 0 : it.num_fragments();
+        layout.push_back(item_layout{
+            it.id, it.is_inline, immediate, length, fragment_lengths.size(), n_fragments});
+        std::size_t item_offset = 0;
+        for (std::size_t j = 0; j < n_fragments; j++)
+        {
+            std::size_t frag_length = it.get_fragment(j).length;
+            fragment_lengths.push_back(frag_length);
+            if (frag_length > 0)
+                pieces.push_back(piece{i, j, item_offset, frag_length});
+            item_offset += frag_length;
+        }
+        snapshot_offset.push_back(snapshot_size);
+        if (!immediate)
+            snapshot_size += length;
+    }
+    if (snapshot)
+    {
+        snapshot_data.reset(new std::uint8_t[snapshot_size]);
+        for (std::size_t i = 0; i < h.items.size(); i++)
+            if (!layout[i].immediate)
+                copy_value(h.items[i], snapshot_data.get() + snapshot_offset[i]);
+    }
+
+    /* Run the normal packet generator over the template heap, and record
+     * where each item ended up. The generator emits item pointers and
+     * payload in item order, so the items can be matched up by walking
+     * through them in parallel.
+     */
+    packet_generator gen(h, 0, max_packet_size, nullptr);
+    std::unique_ptr<std::uint64_t[]> scratch_storage(
+        new std::uint64_t[packet_generator::max_header_size(max_packet_size) / sizeof(std::uint64_t)]);
+    std::uint8_t *scratch = reinterpret_cast<std::uint8_t *>(scratch_storage.get());
+    packet pkt;
+    std::size_t next_pointer = 0;   // item corresponding to the next item pointer
+    std::size_t next_piece = 0;     // piece corresponding to the next payload
+    std::size_t next_offset = 0;    // offset within next_piece
+    while (gen.has_next_packet())
+    {
+        gen.next_packet(pkt, scratch);
+        assert(!pkt.buffers.empty());
+        packet_plan p;
+        p.header_offset = headers.size();
+        p.header_size = boost::asio::buffer_size(pkt.buffers[0]);
+        p.first_patch = patches.size();
+        p.first_segment = segments.size();
+        headers.insert(headers.end(), scratch, scratch + p.header_size);
+
+        if (repeat_pointers)
+            next_pointer = 0;
+        std::size_t n_pointers = (p.header_size - packet_generator::prefix_size) / sizeof(item_pointer_t);
+        for (std::size_t i = 0; i < n_pointers; i++, next_pointer++)
         {
-            if (next_item == h.items.size())
+            // Pointers past the end of the items are the NULL item for padding
+            if (next_pointer < layout.size() && layout[next_pointer].immediate && !snapshot)
             {
-                // Dummy padding payload. Fill with zeros to simplify testing
-                assert(need_null_item);
-                assert(packet_payload_length <= 8);
-                *pointer = 0;
-                out.buffers.emplace_back(pointer, packet_payload_length);
-                packet_payload_length = 0;
+                patches.push_back(patch{
+                    packet_generator::prefix_size + i * sizeof(item_pointer_t), next_pointer});
             }
-            else if (use_immediate(h.items[next_item], max_immediate_size))
+        }
+
+        for (std::size_t i = 1; i < pkt.buffers.size(); i++)
+        {
+            const std::uint8_t *ptr = boost::asio::buffer_cast<const std::uint8_t *>(pkt.buffers[i]);
+            std::size_t length = boost::asio::buffer_size(pkt.buffers[i]);
+            if (ptr == scratch + p.header_size)
             {
-                next_item++;
-                next_item_offset = 0;
+                segments.push_back(segment{nullptr, padding_item, 0, 0, length});
+                continue;
             }
-            else
+            assert(next_piece < pieces.size());
+            const piece &pc = pieces[next_piece];
+            assert(next_offset + length <= pc.length);
+            const std::uint8_t *snapshot_ptr = nullptr;
+            if (snapshot)
+                snapshot_ptr = snapshot_data.get() + snapshot_offset[pc.item]
+                    + pc.item_offset + next_offset;
+            segments.push_back(segment{snapshot_ptr, pc.item, pc.fragment, next_offset, length});
+            next_offset += length;
+            if (next_offset == pc.length)
             {
-                const item &it = h.items[next_item];
-                std::size_t send_bytes = std::min(
-                    it.data.buffer.length - next_item_offset, packet_payload_length);
-                out.buffers.emplace_back(it.data.buffer.ptr + next_item_offset, send_bytes);
-                next_item_offset += send_bytes;
-                if (next_item_offset == it.data.buffer.length)
-                {
-                    next_item++;
-                    next_item_offset = 0;
-                }
-                packet_payload_length -= send_bytes;
+                next_piece++;
+                next_offset = 0;
             }
         }
+
+        p.n_patches = patches.size() - p.first_patch;
+        p.n_segments = segments.size() - p.first_segment;
+        packets.push_back(p);
+    }
+}
+
+bool heap_plan::matches(const heap &h, std::size_t max_packet_size) const
+{
+    if (max_packet_size != this->max_packet_size
+        || h.get_flavour() != flavour_
+        || h.get_repeat_pointers() != repeat_pointers
+        || h.items.size() != layout.size())
+        return false;
+    const std::size_t max_immediate_size = flavour_.get_heap_address_bits() / 8;
+    for (std::size_t i = 0; i < layout.size(); i++)
+    {
+        const item &it = h.items[i];
+        const item_layout &l = layout[i];
+        if (it.id != l.id || it.is_inline != l.is_inline)
+            return false;
+        if (!it.is_inline
+            && (it.data.buffer.length != l.length
+                || use_immediate(it, max_immediate_size) != l.immediate))
+            return false;
+        if (!l.immediate)
+        {
+            if (it.num_fragments() != l.n_fragments)
+                return false;
+            for (std::size_t j = 0; j < l.n_fragments; j++)
+                if (it.get_fragment(j).length != fragment_lengths[l.first_fragment + j])
+                    return false;
+        }
+    }
+    return true;
+}
+
+void heap_plan::next_packet(
+    std::size_t index, const heap &h, item_pointer_t cnt_pointer,
+    packet &out, std::uint8_t *scratch) const
+{
+    const std::size_t max_immediate_size = flavour_.get_heap_address_bits() / 8;
+    const packet_plan &p = packets[index];
+    std::memcpy(scratch, headers.data() + p.header_offset, p.header_size);
+    item_pointer_t *pointers = reinterpret_cast<item_pointer_t *>(scratch + 8);
+    pointers[0] = cnt_pointer;
+    for (std::size_t i = 0; i < p.n_patches; i++)
+    {
+        const patch &pt = patches[p.first_patch + i];
+        *reinterpret_cast<item_pointer_t *>(scratch + pt.offset) =
+            encode_immediate_item(encoder, h.items[pt.item], max_immediate_size);
+    }
+    out.buffers.emplace_back(scratch, p.header_size);
+
+    for (std::size_t i = 0; i < p.n_segments; i++)
+    {
+        const segment &seg = segments[p.first_segment + i];
+        if (seg.ptr)
+            out.buffers.emplace_back(seg.ptr, seg.length);
+        else if (seg.item == padding_item)
+        {
+            // Zero padding, as for packet_generator
+            std::uint8_t *padding = scratch + p.header_size;
+            std::memset(padding, 0, sizeof(item_pointer_t));
+            out.buffers.emplace_back(padding, seg.length);
+        }
+        else
+            out.buffers.emplace_back(
+                h.items[seg.item].get_fragment(seg.fragment).ptr + seg.offset, seg.length);
     }
-    return out;
 }
 
 } // namespace send
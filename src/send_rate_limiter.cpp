@@ -0,0 +1,144 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include <spead2/send_rate_limiter.h>
+
+namespace spead2
+{
+namespace send
+{
+
+constexpr std::size_t shared_rate_limiter::default_burst_size;
+
+static double check_rate(double rate)
+{
+    if (!(rate > 0.0) || !std::isfinite(rate))
+        throw std::invalid_argument("rate must be positive and finite");
+    return rate;
+}
+
+shared_rate_limiter::shared_rate_limiter(double rate, std::size_t burst_size)
+    : rate(check_rate(rate)),
+    burst_size(burst_size),
+    burst_time(std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(burst_size / rate)))
+{
+}
+
+std::size_t shared_rate_limiter::get_num_streams() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return num_streams;
+}
+
+std::size_t shared_rate_limiter::get_num_active() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return num_active;
+}
+
+double shared_rate_limiter::get_reserved_rate() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return reserved_rate;
+}
+
+void shared_rate_limiter::attach(member &m, double weight, double min_rate)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (reserved_rate + min_rate > rate)
+        throw std::invalid_argument("minimum rates exceed the shared rate");
+    m.weight = weight;
+    m.min_rate = min_rate;
+    m.active = false;
+    reserved_rate += min_rate;
+    num_streams++;
+}
+
+void shared_rate_limiter::detach(member &m)
+{
+    set_active(m, false);
+    std::lock_guard<std::mutex> lock(mutex);
+    reserved_rate -= m.min_rate;
+    num_streams--;
+    if (num_streams == 0)
+        reserved_rate = 0.0;     // avoid accumulating rounding errors
+}
+
+void shared_rate_limiter::set_active(member &m, bool active)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (m.active == active)
+        return;
+    m.active = active;
+    if (active)
+    {
+        num_active++;
+        active_weight += m.weight;
+        active_min_rate += m.min_rate;
+    }
+    else
+    {
+        num_active--;
+        active_weight -= m.weight;
+        active_min_rate -= m.min_rate;
+        if (num_active == 0)
+        {
+            active_weight = 0.0;
+            active_min_rate = 0.0;
+        }
+    }
+}
+
+double shared_rate_limiter::get_share(const member &m) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    /* An inactive stream is about to become active (or has not yet been
+     * counted), so compute the share it would have if it were.
+     */
+    double weight = active_weight;
+    double min_rate = active_min_rate;
+    if (!m.active)
+    {
+        weight += m.weight;
+        min_rate += m.min_rate;
+    }
+    double spare = std::max(rate - min_rate, 0.0);
+    return m.min_rate + spare * m.weight / weight;
+}
+
+shared_rate_limiter::clock_type::time_point shared_rate_limiter::reserve(
+    std::uint64_t bytes, clock_type::time_point now)
+{
+    std::chrono::duration<double> wait(bytes / rate);
+    std::lock_guard<std::mutex> lock(mutex);
+    // Unused capacity accumulates for at most one burst
+    link_time = std::max(link_time, now - burst_time)
+        + std::chrono::duration_cast<clock_type::duration>(wait);
+    return link_time - burst_time;
+}
+
+} // namespace send
+} // namespace spead2
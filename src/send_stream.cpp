@@ -19,6 +19,9 @@
  */
 
 #include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
 #include <spead2/send_stream.h>
 
@@ -31,6 +34,12 @@ constexpr std::size_t stream_config::default_max_packet_size;
 constexpr std::size_t stream_config::default_max_heaps;
 constexpr std::size_t stream_config::default_burst_size;
 constexpr double stream_config::default_burst_rate_ratio;
+constexpr std::size_t stream_config::default_max_interleave;
+constexpr double stream_config::default_spin_time;
+constexpr double stream_config::default_rate_weight;
+constexpr std::size_t stream_config::default_num_priorities;
+constexpr std::size_t pacing_stats::histogram_buckets;
+constexpr std::size_t stream::all_substreams;
 
 void stream_config::set_max_packet_size(std::size_t max_packet_size)
 {
@@ -64,6 +73,46 @@ void stream_config::set_burst_rate_ratio(double burst_rate_ratio)
     this->burst_rate_ratio = burst_rate_ratio;
 }
 
+void stream_config::set_max_interleave(std::size_t max_interleave)
+{
+    if (max_interleave == 0)
+        throw std::invalid_argument("max_interleave must be positive");
+    this->max_interleave = max_interleave;
+}
+
+void stream_config::set_spin_time(double spin_time)
+{
+    if (spin_time < 0.0 || !std::isfinite(spin_time))
+        throw std::invalid_argument("spin_time must be non-negative and finite");
+    this->spin_time = spin_time;
+}
+
+void stream_config::set_rate_limiter(std::shared_ptr<shared_rate_limiter> rate_limiter)
+{
+    this->rate_limiter = std::move(rate_limiter);
+}
+
+void stream_config::set_rate_weight(double rate_weight)
+{
+    if (!(rate_weight > 0.0) || !std::isfinite(rate_weight))
+        throw std::invalid_argument("rate_weight must be positive and finite");
+    this->rate_weight = rate_weight;
+}
+
+void stream_config::set_min_rate(double min_rate)
+{
+    if (min_rate < 0.0 || !std::isfinite(min_rate))
+        throw std::invalid_argument("min_rate must be non-negative and finite");
+    this->min_rate = min_rate;
+}
+
+void stream_config::set_num_priorities(std::size_t num_priorities)
+{
+    if (num_priorities == 0)
+        throw std::invalid_argument("num_priorities must be positive");
+    this->num_priorities = num_priorities;
+}
+
 double stream_config::get_burst_rate() const
 {
     return rate * burst_rate_ratio;
@@ -74,13 +123,25 @@ stream_config::stream_config(
     double rate,
     std::size_t burst_size,
     std::size_t max_heaps,
-    double burst_rate_ratio)
+    double burst_rate_ratio,
+    std::size_t max_interleave,
+    double spin_time,
+    std::shared_ptr<shared_rate_limiter> rate_limiter,
+    double rate_weight,
+    double min_rate,
+    std::size_t num_priorities)
 {
     set_max_packet_size(max_packet_size);
     set_rate(rate);
     set_burst_size(burst_size);
     set_max_heaps(max_heaps);
     set_burst_rate_ratio(burst_rate_ratio);
+    set_max_interleave(max_interleave);
+    set_spin_time(spin_time);
+    set_rate_limiter(std::move(rate_limiter));
+    set_rate_weight(rate_weight);
+    set_min_rate(min_rate);
+    set_num_priorities(num_priorities);
 }
 
 
@@ -94,38 +155,256 @@ stream::~stream()
 }
 
 
-std::size_t stream_impl_base::next_queue_slot(std::size_t cur) const
+stream_impl_base::queue_item *stream_impl_base::get_queue(lane &l, std::size_t pos)
 {
-    if (++cur == config.get_max_heaps() + 1)
-        cur = 0;
-    return cur;
+    return reinterpret_cast<queue_item *>(&l.queue[pos % config.get_max_heaps()].storage);
 }
 
-stream_impl_base::queue_item *stream_impl_base::get_queue(std::size_t idx)
+bool stream_impl_base::queue_ready(const lane &l, std::size_t pos) const
 {
-    return reinterpret_cast<queue_item *>(queue.get() + idx);
+    const queue_slot &slot = l.queue[pos % config.get_max_heaps()];
+    return slot.sequence.load(std::memory_order_acquire) == pos + 1;
 }
 
-void stream_impl_base::next_active()
+bool stream_impl_base::lane_has_work(const lane &l) const
 {
-    active = next_queue_slot(active);
-    gen = boost::none;
+    return !l.active_heaps.empty() || queue_ready(l, l.active);
 }
 
-void stream_impl_base::post_handler(boost::system::error_code result)
+bool stream_impl_base::has_work() const
 {
-    queue_item &front = *get_queue(queue_head);
-    get_io_service().post(
-        std::bind(std::move(front.handler), result, front.bytes_sent));
-    if (active == queue_head)
+    for (std::size_t i = 0; i < config.get_num_priorities(); i++)
+        if (lane_has_work(lanes[i]))
+            return true;
+    return false;
+}
+
+bool stream_impl_base::preempted(std::size_t priority) const
+{
+    // More urgent lanes have no active heaps, or we would be sending them
+    for (std::size_t i = priority + 1; i < config.get_num_priorities(); i++)
+        if (queue_ready(lanes[i], lanes[i].active))
+            return true;
+    return false;
+}
+
+bool stream_impl_base::reserve_queue_slots(lane &l, std::size_t &pos, std::size_t n)
+{
+    assert(n > 0);
+    if (n > config.get_max_heaps())
+        return false;
+    pos = l.queue_tail.load(std::memory_order_relaxed);
+    while (true)
     {
-        // Can only happen if there is an error with the head of the queue
-        // before we've transmitted all its packets.
-        assert(result);
-        next_active();
+        /* Slots are released by the consumer in order, so if the last slot
+         * is free then so are the ones before it.
+         */
+        std::size_t last = pos + n - 1;
+        queue_slot &slot = l.queue[last % config.get_max_heaps()];
+        std::size_t seq = slot.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq - last);
+        if (diff == 0)
+        {
+            // Slots are free. Try to claim them.
+            if (l.queue_tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                return true;
+            // On failure, pos has been updated to the current tail
+        }
+        else if (diff < 0)
+        {
+            // Slot still holds the item from the previous lap: queue is full
+            return false;
+        }
+        else
+        {
+            // Another producer claimed this position first
+            pos = l.queue_tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool stream_impl_base::publish_queue_slots(lane &l, std::size_t pos, std::size_t n)
+{
+    /* The sequence store and the state load must not be reordered, and
+     * likewise the state store and sequence load in transition_empty. The
+     * sequentially consistent operations here, together with the fence in
+     * transition_empty, ensure that either we see the EMPTY state, or the
+     * consumer sees the new item.
+     */
+    for (std::size_t i = pos; i < pos + n; i++)
+        l.queue[i % config.get_max_heaps()].sequence.store(i + 1, std::memory_order_seq_cst);
+    state_t expected = state_t::EMPTY;
+    return state.load(std::memory_order_seq_cst) == state_t::EMPTY
+        && state.compare_exchange_strong(expected, state_t::QUEUED);
+}
+
+void stream_impl_base::prune_cnt_sequences()
+{
+    std::lock_guard<std::mutex> lock(cnt_mutex);
+    auto latest = std::prev(cnt_sequences.end());
+    cnt_sequences.erase(cnt_sequences.begin(), latest);
+    if (active_cnt_generation != latest->first)
+        active_cnt_sequence = nullptr;
+}
+
+item_pointer_t stream_impl_base::next_auto_cnt(std::uint64_t generation)
+{
+    if (!active_cnt_sequence || active_cnt_generation != generation)
+    {
+        std::lock_guard<std::mutex> lock(cnt_mutex);
+        /* If the generation has been discarded, the heap was enqueued
+         * concurrently with set_cnt_sequence, and can equally well take its
+         * cnt from the newer sequence.
+         */
+        auto it = cnt_sequences.lower_bound(generation);
+        assert(it != cnt_sequences.end());
+        active_cnt_generation = it->first;
+        active_cnt_sequence = &it->second;
+    }
+    item_pointer_t cnt = active_cnt_sequence->next;
+    active_cnt_sequence->next += active_cnt_sequence->step;
+    return cnt;
+}
+
+bool stream_impl_base::transition_empty()
+{
+    // Nothing is queued, so only the latest cnt sequence can still be needed
+    prune_cnt_sequences();
+    // Must happen before the transition, after which do_next may run elsewhere
+    if (config.get_rate_limiter())
+        config.get_rate_limiter()->set_active(limiter_member, false);
+    /* Everything happens under the lock, because once a flushing thread
+     * sees the EMPTY state it may destroy the stream.
+     */
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    state.store(state_t::EMPTY, std::memory_order_seq_cst);
+    /* has_work only loads the sequence numbers with acquire ordering, which
+     * could otherwise be satisfied before the store above becomes visible.
+     */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    /* A producer may have published an item after we checked, and possibly
+     * before it saw the EMPTY state. Whoever wins the transition back to
+     * QUEUED is responsible for scheduling the consumer.
+     */
+    state_t expected = state_t::EMPTY;
+    if (has_work() && state.compare_exchange_strong(expected, state_t::QUEUED))
+        return true;
+    heap_empty.notify_all();
+    return false;
+}
+
+std::size_t stream_impl_base::substream_copies(std::size_t substream_index) const
+{
+    return substream_index == all_substreams ? num_substreams : 1;
+}
+
+void stream_impl_base::reject_group(
+    std::unique_ptr<heap_group> group, const boost::system::error_code &ec)
+{
+    for (heap_result &result : group->results)
+        result.ec = ec;
+    std::shared_ptr<heap_group> shared(std::move(group));
+    get_io_service().post([shared] { shared->handler(shared->results); });
+}
+
+bool stream_impl_base::enqueue_group(
+    const std::vector<heap_reference> &heaps, group_completion_handler &&handler,
+    std::size_t priority, bool &wake)
+{
+    wake = false;
+    std::unique_ptr<heap_group> group(new heap_group);
+    group->results.resize(heaps.size());
+    group->handler = std::move(handler);
+    if (heaps.empty())
+    {
+        reject_group(std::move(group), boost::system::error_code());
+        return true;
+    }
+
+    if (priority >= config.get_num_priorities())
+    {
+        log_warning("async_send_heaps: dropping heaps because priority is out of range");
+        reject_group(std::move(group), boost::asio::error::invalid_argument);
+        return false;
+    }
+
+    for (const heap_reference &ref : heaps)
+    {
+        item_pointer_t cnt_mask = (item_pointer_t(1) << ref.h.get_flavour().get_heap_address_bits()) - 1;
+        if (ref.cnt >= 0 && item_pointer_t(ref.cnt) > cnt_mask)
+        {
+            log_warning("async_send_heaps: dropping heaps because cnt is out of range");
+            reject_group(std::move(group), boost::asio::error::invalid_argument);
+            return false;
+        }
+        if (ref.substream_index >= num_substreams && ref.substream_index != all_substreams)
+        {
+            log_warning("async_send_heaps: dropping heaps because substream index is out of range");
+            reject_group(std::move(group), boost::asio::error::invalid_argument);
+            return false;
+        }
+    }
+
+    lane &l = lanes[priority];
+    std::size_t pos;
+    if (!reserve_queue_slots(l, pos, heaps.size()))
+    {
+        log_warning("async_send_heaps: dropping heaps because queue is full");
+        reject_group(std::move(group), boost::asio::error::would_block);
+        return false;
+    }
+
+    heap_group *g = group.release();   // now owned by the queue items
+    std::uint64_t generation = cnt_generation.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < heaps.size(); i++)
+    {
+        const heap_reference &ref = heaps[i];
+        queue_item *item = new (get_queue(l, pos + i)) queue_item(
+            ref.h, ref.cnt, ref.substream_index, priority, g, i);
+        item->cnt_generation = generation;
+        item->owner = ref.owner;
+    }
+    wake = publish_queue_slots(l, pos, heaps.size());
+    return true;
+}
+
+void stream_impl_base::retire_active_heap(lane &l, std::size_t idx)
+{
+    l.active_heaps[idx]->gen = boost::none;
+    l.active_heaps.erase(l.active_heaps.begin() + idx);
+    // Keep the round-robin position pointing at the heap that followed
+    if (l.next_active_heap > idx)
+        l.next_active_heap--;
+}
+
+void stream_impl_base::post_handler(lane &l)
+{
+    queue_item &front = *get_queue(l, l.queue_head);
+    // Let go of the heap before the handler can run
+    front.owner.reset();
+    const boost::system::error_code &result = front.result;
+    if (front.group)
+    {
+        heap_result &r = front.group->results[front.group_index];
+        r.ec = result;
+        r.bytes_transferred = front.bytes_sent;
+        // Heaps complete in order, so the last one completes the group
+        if (front.group_index + 1 == front.group->results.size())
+        {
+            std::shared_ptr<heap_group> group(front.group);
+            get_io_service().post([group] { group->handler(group->results); });
+        }
+    }
+    else
+    {
+        get_io_service().post(
+            std::bind(std::move(front.handler), result, front.bytes_sent));
     }
     front.~queue_item();
-    queue_head = next_queue_slot(queue_head);
+    // Release the slot to producers for the next lap
+    l.queue[l.queue_head % config.get_max_heaps()].sequence.store(
+        l.queue_head + config.get_max_heaps(), std::memory_order_release);
+    l.queue_head++;
 }
 
 bool stream_impl_base::must_sleep() const
@@ -135,24 +414,53 @@ bool stream_impl_base::must_sleep() const
 
 void stream_impl_base::process_results()
 {
+    std::size_t n_finished = 0;
     for (std::size_t i = 0; i < n_current_packets; i++)
     {
         const transmit_packet &item = current_packets[i];
-        if (item.item != get_queue(queue_head))
+        queue_item *heap = item.item;
+        if (heap->finished)
         {
             // A previous packet in this heap already aborted it
             continue;
         }
         if (item.result)
-            post_handler(item.result);
+        {
+            heap->result = item.result;
+            heap->finished = true;
+            finished_lanes[n_finished++] = heap->priority;
+            if (heap->gen)
+            {
+                // Stop sending the rest of the heap
+                lane &l = lanes[heap->priority];
+                auto pos = std::find(l.active_heaps.begin(), l.active_heaps.end(), heap);
+                assert(pos != l.active_heaps.end());
+                retire_active_heap(l, pos - l.active_heaps.begin());
+            }
+        }
         else
         {
-            item.item->bytes_sent += item.size;
+            heap->bytes_sent += item.size * substream_copies(item.substream_index);
             if (item.last)
-                post_handler(item.result);
+            {
+                heap->finished = true;
+                finished_lanes[n_finished++] = heap->priority;
+            }
         }
     }
     n_current_packets = 0;
+
+    /* Heaps may finish out of order when interleaved, but complete in order
+     * within a lane. Across lanes, complete them in the order they finished,
+     * so that an urgent heap that preempted a bulk one in the same batch is
+     * not reported after it.
+     */
+    for (std::size_t i = 0; i < n_finished; i++)
+    {
+        lane &l = lanes[finished_lanes[i]];
+        while (l.queue_head != l.active && get_queue(l, l.queue_head)->finished)
+            post_handler(l);
+    }
 }
 
 stream_impl_base::timer_type::time_point stream_impl_base::update_send_times(
@@ -162,6 +470,7 @@ stream_impl_base::timer_type::time_point stream_impl_base::update_send_times(
     std::chrono::duration<double> wait(rate_bytes * seconds_per_byte);
     send_time_burst += std::chrono::duration_cast<timer_type::clock_type::duration>(wait_burst);
     send_time += std::chrono::duration_cast<timer_type::clock_type::duration>(wait);
+    std::uint64_t bytes = rate_bytes;
     rate_bytes = 0;
 
     /* send_time_burst needs to reflect the time the burst
@@ -169,12 +478,23 @@ stream_impl_base::timer_type::time_point stream_impl_base::update_send_times(
      * send_time or now is later.
      */
     timer_type::time_point target_time = std::max(send_time_burst, send_time);
+    if (const auto &limiter = config.get_rate_limiter())
+    {
+        target_time = std::max(target_time, limiter->reserve(bytes, now));
+        // Other streams may have started or stopped since the last burst
+        update_rates();
+    }
     send_time_burst = std::max(now, target_time);
     return target_time;
 }
 
 void stream_impl_base::update_send_time_empty()
 {
+    if (config.get_rate_limiter())
+    {
+        config.get_rate_limiter()->set_active(limiter_member, true);
+        update_rates();
+    }
     timer_type::time_point now = timer_type::clock_type::now();
     // Compute what send_time would need to be to make the next packet due to be
     // transmitted now.
@@ -182,64 +502,253 @@ void stream_impl_base::update_send_time_empty()
     auto wait2 = std::chrono::duration_cast<timer_type::clock_type::duration>(wait);
     timer_type::time_point backdate = now - wait2;
     send_time = std::max(send_time, backdate);
+    // The gap since the last burst only reflects how long we were idle
+    last_burst = timer_type::time_point();
+}
+
+void stream_impl_base::update_rates()
+{
+    double rate = config.get_rate();
+    if (config.get_rate_limiter())
+    {
+        double share = config.get_rate_limiter()->get_share(limiter_member);
+        rate = (rate > 0.0) ? std::min(rate, share) : share;
+    }
+    seconds_per_byte = rate > 0.0 ? 1.0 / rate : 0.0;
+    seconds_per_byte_burst = rate > 0.0 ? 1.0 / (rate * config.get_burst_rate_ratio()) : 0.0;
+}
+
+stream_impl_base::timer_type::time_point stream_impl_base::spin_until(
+    timer_type::time_point target)
+{
+    timer_type::time_point now;
+    while ((now = timer_type::clock_type::now()) < target)
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+    return now;
+}
+
+/// Bucket in a @ref pacing_stats::histogram for a duration
+static std::size_t histogram_bucket(std::chrono::nanoseconds value)
+{
+    std::int64_t us = value.count() / 1000;
+    std::size_t bucket = 0;
+    while (us > 0 && bucket + 1 < pacing_stats::histogram_buckets)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void stream_impl_base::record_burst(timer_type::time_point now, timer_type::time_point target)
+{
+    auto lateness = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::max(now - target, timer_type::duration::zero()));
+    double lateness_s = std::chrono::duration<double>(lateness).count();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.bursts++;
+    stats.lateness[histogram_bucket(lateness)]++;
+    stats.total_lateness += lateness_s;
+    stats.max_lateness = std::max(stats.max_lateness, lateness_s);
+    if (last_burst != timer_type::time_point())
+        stats.gap[histogram_bucket(now - last_burst)]++;
+    last_burst = now;
 }
 
-void stream_impl_base::load_packets(std::size_t tail)
+stream_impl_base::timer_type::time_point stream_impl_base::next_send_time() const
 {
+    /* This mirrors update_send_times: the average rate is measured from
+     * send_time, and the burst rate from the start of the current burst.
+     */
+    std::chrono::duration<double> wait_burst(rate_bytes * seconds_per_byte_burst);
+    std::chrono::duration<double> wait(rate_bytes * seconds_per_byte);
+    return std::max(send_time_burst + std::chrono::duration_cast<timer_type::duration>(wait_burst),
+                    send_time + std::chrono::duration_cast<timer_type::duration>(wait));
+}
+
+void stream_impl_base::enable_send_times(timer_type::duration lookahead)
+{
+    send_times_enabled = true;
+    this->lookahead = lookahead;
+}
+
+pacing_stats stream_impl_base::get_pacing_stats() const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return stats;
+}
+
+void stream_impl_base::load_packets()
+{
+    const std::size_t max_packet_size = config.get_max_packet_size();
+    const std::size_t max_interleave = config.get_max_interleave();
     n_current_packets = 0;
-    while (n_current_packets < max_current_packets && !must_sleep() && active != tail)
+    std::uint8_t *headers = reinterpret_cast<std::uint8_t *>(header_arena.get());
+    while (n_current_packets < max_current_packets && !must_sleep())
     {
-        queue_item *cur = get_queue(active);
-        if (!gen)
-            gen = boost::in_place(cur->h, cur->cnt, config.get_max_packet_size());
-        assert(gen->has_next_packet());
-        transmit_packet &data = current_packets[n_current_packets];
-        data.pkt = gen->next_packet();
-        data.size = boost::asio::buffer_size(data.pkt.buffers);
-        data.last = !gen->has_next_packet();
-        data.item = cur;
-        data.result = boost::system::error_code();
-        rate_bytes += data.size;
-        n_current_packets++;
-        if (data.last)
-            next_active();
+        // Serve the most urgent lane that has anything to send
+        std::size_t priority = config.get_num_priorities();
+        do
+        {
+            if (priority == 0)
+                return;
+            priority--;
+        } while (!lane_has_work(lanes[priority]));
+        lane &l = lanes[priority];
+
+        // Start generating packets from new heaps, up to the interleave limit
+        while (l.active_heaps.size() < max_interleave && queue_ready(l, l.active))
+        {
+            queue_item *cur = get_queue(l, l.active);
+            /* Receivers discard incomplete heaps when the stream ends, so
+             * an end-of-stream heap must not be interleaved with others.
+             */
+            if (!l.active_heaps.empty()
+                && (cur->h.is_end() || l.active_heaps.back()->h.is_end()))
+                break;
+            l.active++;
+            if (cur->cnt < 0)
+            {
+                item_pointer_t cnt_mask = (item_pointer_t(1) << cur->h.get_flavour().get_heap_address_bits()) - 1;
+                cur->cnt = next_auto_cnt(cur->cnt_generation) & cnt_mask;
+            }
+            cur->gen = boost::in_place(cur->h, cur->cnt, max_packet_size);
+            l.active_heaps.push_back(cur);
+        }
+        std::vector<queue_item *> &active_heaps = l.active_heaps;
+        std::size_t &next_active_heap = l.next_active_heap;
+
+        /* Every packet is at most max_packet_size bytes, so this many packets
+         * can be generated before must_sleep() could become true. Generating
+         * them as a batch avoids re-checking after every packet.
+         */
+        std::size_t budget = config.get_burst_size() - rate_bytes;
+        std::size_t batch = std::min(max_current_packets - n_current_packets,
+                                     (budget + max_packet_size - 1) / max_packet_size);
+        for (std::size_t i = 0; i < batch; )
+        {
+            // Take packets from the active heaps in turn
+            if (next_active_heap >= active_heaps.size())
+                next_active_heap = 0;
+            queue_item *cur = active_heaps[next_active_heap];
+            assert(cur->gen->has_next_packet());
+            // Packets sent to every substream count once per copy
+            std::size_t copies = substream_copies(cur->substream_index);
+            /* With only one heap and one lane, nothing can come between its
+             * packets, so generate the rest of the batch in one go. The
+             * batch size assumed one copy per packet.
+             */
+            std::size_t want = 1;
+            if (active_heaps.size() == 1 && config.get_num_priorities() == 1 && copies == 1)
+                want = batch - i;
+            std::size_t n = cur->gen->next_packets(
+                &current_packet_ptrs[n_current_packets], want, headers);
+            assert(n > 0);
+            bool last = !cur->gen->has_next_packet();
+            for (std::size_t j = 0; j < n; j++)
+            {
+                transmit_packet &data = current_packets[n_current_packets + j];
+                data.size = boost::asio::buffer_size(data.pkt.buffers);
+                data.last = false;
+                data.substream_index = cur->substream_index;
+                data.item = cur;
+                data.result = boost::system::error_code();
+                if (send_times_enabled)
+                    data.send_time = next_send_time();
+                rate_bytes += data.size * copies;
+            }
+            n_current_packets += n;
+            i += n;
+            if (last)
+            {
+                current_packets[n_current_packets - 1].last = true;
+                retire_active_heap(l, next_active_heap);
+                // Go back to start another heap, if there is one
+                break;
+            }
+            next_active_heap++;
+            if (copies > 1 && must_sleep())
+                break;
+            // Switch lanes as soon as a more urgent heap arrives
+            if (preempted(priority))
+                break;
+        }
     }
 }
 
 stream_impl_base::stream_impl_base(
     io_service_ref io_service,
     const stream_config &config,
-    std::size_t max_current_packets) :
+    std::size_t max_current_packets,
+    std::size_t num_substreams) :
         stream(std::move(io_service)),
         current_packets(new transmit_packet[max_current_packets]),
         max_current_packets(max_current_packets),
         config(config),
+        num_substreams(num_substreams),
+        // Round up to a multiple of 8 so that every slot is 8-byte aligned
+        header_slot_size((packet_generator::max_header_size(config.get_max_packet_size()) + 7) & ~7),
         seconds_per_byte_burst(config.get_burst_rate() > 0.0 ? 1.0 / config.get_burst_rate() : 0.0),
         seconds_per_byte(config.get_rate() > 0.0 ? 1.0 / config.get_rate() : 0.0),
-        queue(new queue_item_storage[config.get_max_heaps() + 1]),
+        spin_time(std::chrono::duration_cast<timer_type::duration>(
+            std::chrono::duration<double>(config.get_spin_time()))),
+        lanes(new lane[config.get_num_priorities()]),
         timer(get_io_service())
 {
+    if (config.get_rate_limiter())
+        config.get_rate_limiter()->attach(limiter_member, config.get_rate_weight(), config.get_min_rate());
+    header_arena.reset(new std::uint64_t[max_current_packets * header_slot_size / sizeof(std::uint64_t)]);
+    current_packet_ptrs.reset(new packet *[max_current_packets]);
+    finished_lanes.reset(new std::size_t[max_current_packets]);
+    for (std::size_t i = 0; i < max_current_packets; i++)
+        current_packet_ptrs[i] = &current_packets[i].pkt;
+    cnt_sequences[0] = cnt_sequence{1, 1};
+    for (std::size_t p = 0; p < config.get_num_priorities(); p++)
+    {
+        lane &l = lanes[p];
+        l.queue.reset(new queue_slot[config.get_max_heaps()]);
+        for (std::size_t i = 0; i < config.get_max_heaps(); i++)
+            l.queue[i].sequence.store(i, std::memory_order_relaxed);
+        l.active_heaps.reserve(config.get_max_interleave());
+    }
 }
 
 stream_impl_base::~stream_impl_base()
 {
-    for (std::size_t i = queue_head; i != queue_tail; i = next_queue_slot(i))
-        get_queue(i)->~queue_item();
+    if (config.get_rate_limiter())
+        config.get_rate_limiter()->detach(limiter_member);
+    for (std::size_t p = 0; p < config.get_num_priorities(); p++)
+    {
+        lane &l = lanes[p];
+        for (std::size_t i = l.queue_head; queue_ready(l, i); i++)
+        {
+            queue_item *item = get_queue(l, i);
+            // The group is freed along with its last heap
+            if (item->group && item->group_index + 1 == item->group->results.size())
+                delete item->group;
+            item->~queue_item();
+        }
+    }
 }
 
 void stream_impl_base::set_cnt_sequence(item_pointer_t next, item_pointer_t step)
 {
     if (step == 0)
         throw std::invalid_argument("step cannot be 0");
-    std::unique_lock<std::mutex> lock(queue_mutex);
-    next_cnt = next;
-    step_cnt = step;
+    std::lock_guard<std::mutex> lock(cnt_mutex);
+    std::uint64_t generation = cnt_generation.load(std::memory_order_relaxed) + 1;
+    cnt_sequences[generation] = cnt_sequence{next, step};
+    cnt_generation.store(generation, std::memory_order_release);
 }
 
 void stream_impl_base::flush()
 {
-    std::unique_lock<std::mutex> lock(queue_mutex);
-    while (state != state_t::EMPTY)
+    std::unique_lock<std::mutex> lock(flush_mutex);
+    while (state.load() != state_t::EMPTY)
     {
         heap_empty.wait(lock);
     }
@@ -14,13 +14,30 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <cmath>
+#include <chrono>
 #include <utility>
+#include <vector>
+#include <stdexcept>
 #include <boost/asio.hpp>
 #include <spead2/send_udp.h>
 #include <spead2/common_defines.h>
+#include <spead2/common_logging.h>
 #include <spead2/common_socket.h>
+#if SPEAD2_USE_TXTIME
+# include <time.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <linux/net_tstamp.h>
+# include <linux/errqueue.h>
+#endif
 
 namespace spead2
 {
@@ -28,26 +45,34 @@ namespace send
 {
 
 constexpr std::size_t udp_stream::default_buffer_size;
+#if SPEAD2_USE_TXTIME
+constexpr double udp_stream::default_txtime_lookahead;
+#endif
+
+void udp_stream::set_error(std::size_t idx, const boost::system::error_code &ec)
+{
+    // Keep the first error if the packet was sent to several endpoints
+    boost::system::error_code &result = current_packets[messages[idx].packet].result;
+    if (!result)
+        result = ec;
+}
 
 void udp_stream::send_packets(std::size_t first)
 {
+    const std::size_t n_messages = messages.size();
 #if SPEAD2_USE_SENDMMSG
     // Try synchronous send
-    if (first < n_current_packets)
+    if (first < n_messages)
     {
-        int sent = sendmmsg(socket.native_handle(), msgvec + first, n_current_packets - first, MSG_DONTWAIT);
+        int sent = sendmmsg(socket.native_handle(), msgvec.data() + first, n_messages - first, MSG_DONTWAIT);
         if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
         {
-            current_packets[first].result = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            set_error(first, boost::system::error_code(errno, boost::asio::error::get_system_category()));
             first++;
         }
         else if (sent > 0)
-        {
-            for (int i = 0; i < sent; i++)
-                current_packets[first + i].result = boost::system::error_code();
             first += sent;
-        }
-        if (first < n_current_packets)
+        if (first < n_messages)
         {
             socket.async_send(boost::asio::null_buffers(), [this, first](const boost::system::error_code &ec, std::size_t)
             {
@@ -57,25 +82,28 @@ void udp_stream::send_packets(std::size_t first)
         }
     }
 #else
-    for (std::size_t idx = first; idx < n_current_packets; idx++)
+    for (std::size_t idx = first; idx < n_messages; idx++)
     {
+        const auto &buffers = current_packets[messages[idx].packet].pkt.buffers;
+        const auto &endpoint = endpoints[messages[idx].endpoint];
         // First try to send synchronously, to reduce overheads from callbacks etc
         boost::system::error_code ec;
-        socket.send_to(current_packets[idx].pkt.buffers, endpoint, 0, ec);
+        socket.send_to(buffers, endpoint, 0, ec);
         if (ec == boost::asio::error::would_block)
         {
             // Socket buffer is full, fall back to asynchronous
             auto handler = [this, idx](const boost::system::error_code &ec, std::size_t bytes_transferred)
             {
-                current_packets[idx].result = ec;
+                if (ec)
+                    set_error(idx, ec);
                 send_packets(idx + 1);
             };
-            socket.async_send_to(current_packets[idx].pkt.buffers, endpoint, handler);
+            socket.async_send_to(buffers, endpoint, handler);
             return;
         }
-        else
+        else if (ec)
         {
-            current_packets[idx].result = ec;
+            set_error(idx, ec);
         }
     }
 #endif
@@ -85,6 +113,18 @@ void udp_stream::send_packets(std::size_t first)
 
 void udp_stream::async_send_packets()
 {
+    messages.clear();
+    for (std::size_t i = 0; i < n_current_packets; i++)
+    {
+        std::size_t substream = current_packets[i].substream_index;
+        if (substream == all_substreams)
+        {
+            for (std::size_t j = 0; j < endpoints.size(); j++)
+                messages.push_back(message{i, j});
+        }
+        else
+            messages.push_back(message{i, substream});
+    }
 #if SPEAD2_USE_SENDMMSG
     msg_iov.clear();
     for (std::size_t i = 0; i < n_current_packets; i++)
@@ -94,18 +134,121 @@ void udp_stream::async_send_packets()
                                     boost::asio::buffer_size(buffer)});
         }
     // Assigning msgvec must be done in a second pass, because appending to
-    // msg_iov invalidates references.
+    // msg_iov invalidates references. Copies of a packet share its iovecs.
     std::size_t offset = 0;
+    std::size_t next = 0;
     for (std::size_t i = 0; i < n_current_packets; i++)
     {
-        msgvec[i].msg_hdr.msg_iov = &msg_iov[offset];
-        msgvec[i].msg_hdr.msg_iovlen = current_packets[i].pkt.buffers.size();
-        offset += msgvec[i].msg_hdr.msg_iovlen;
+        std::size_t iovlen = current_packets[i].pkt.buffers.size();
+        for (; next < messages.size() && messages[next].packet == i; next++)
+        {
+            auto &hdr = msgvec[next].msg_hdr;
+            const auto &endpoint = endpoints[messages[next].endpoint];
+            hdr.msg_name = (void *) endpoint.data();
+            hdr.msg_namelen = endpoint.size();
+            hdr.msg_iov = &msg_iov[offset];
+            hdr.msg_iovlen = iovlen;
+        }
+        offset += iovlen;
+    }
+#endif
+#if SPEAD2_USE_TXTIME
+    if (txtime)
+    {
+        drain_txtime_errors();
+        set_txtimes();
     }
 #endif
     send_packets(0);
 }
 
+#if SPEAD2_USE_TXTIME
+void udp_stream::set_txtimes()
+{
+    /* Launch times are computed against the stream's timer clock, which
+     * need not be the one the kernel uses, so translate them via the
+     * current time on each.
+     */
+    struct timespec ts;
+    clock_gettime(txtime_clock, &ts);
+    auto timer_now = timer_type::clock_type::now();
+    std::uint64_t kernel_now = std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    for (std::size_t i = 0; i < messages.size(); i++)
+    {
+        auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            current_packets[messages[i].packet].send_time - timer_now).count();
+        // Packets that are already late are sent immediately
+        std::uint64_t launch = kernel_now + std::max(delay, decltype(delay)(0));
+
+        auto &hdr = msgvec[i].msg_hdr;
+        hdr.msg_control = msg_control[i].buffer;
+        hdr.msg_controllen = sizeof(msg_control[i].buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(launch));
+        std::memcpy(CMSG_DATA(cmsg), &launch, sizeof(launch));
+    }
+}
+
+void udp_stream::drain_txtime_errors()
+{
+    std::size_t missed = 0, invalid = 0;
+    while (true)
+    {
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        if (recvmsg(socket.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;   // normally EAGAIN, because the queue is empty
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_TXTIME)
+                continue;
+            if (err.ee_code == SO_EE_CODE_TXTIME_MISSED)
+                missed++;
+            else
+                invalid++;
+        }
+    }
+    if (missed > 0)
+        log_warning("%d packets were dropped by the kernel because their launch time had passed",
+                    missed);
+    if (invalid > 0)
+        log_warning("%d packets were dropped by the kernel because their launch time was invalid",
+                    invalid);
+}
+
+void udp_stream::enable_txtime(double lookahead, clockid_t clock_id)
+{
+    if (lookahead < 0.0 || !std::isfinite(lookahead))
+        throw std::invalid_argument("lookahead must be non-negative and finite");
+    struct sock_txtime cfg;
+    std::memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = clock_id;
+    // Have packets that the qdisc drops reported on the error queue
+    cfg.flags = SOF_TXTIME_REPORT_ERRORS;
+    if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0)
+        throw_errno("setsockopt(SO_TXTIME) failed");
+    txtime = true;
+    txtime_clock = clock_id;
+    msg_control.resize(msgvec.size());
+    enable_send_times(std::chrono::duration_cast<timer_type::duration>(
+        std::chrono::duration<double>(lookahead)));
+}
+#endif // SPEAD2_USE_TXTIME
+
 static boost::asio::ip::udp::socket make_socket(
     boost::asio::io_service &io_service,
     const boost::asio::ip::udp &protocol,
@@ -117,6 +260,18 @@ static boost::asio::ip::udp::socket make_socket(
     return socket;
 }
 
+/// Determine the common protocol of a list of destinations
+static boost::asio::ip::udp get_protocol(const std::vector<boost::asio::ip::udp::endpoint> &endpoints)
+{
+    if (endpoints.empty())
+        throw std::invalid_argument("endpoints is empty");
+    boost::asio::ip::udp protocol = endpoints[0].protocol();
+    for (const auto &endpoint : endpoints)
+        if (endpoint.protocol() != protocol)
+            throw std::invalid_argument("all endpoints must use the same protocol");
+    return protocol;
+}
+
 udp_stream::udp_stream(
     io_service_ref io_service,
     const boost::asio::ip::udp::endpoint &endpoint,
@@ -124,8 +279,20 @@ udp_stream::udp_stream(
     std::size_t buffer_size,
     const boost::asio::ip::address &interface_address)
     : udp_stream(std::move(io_service),
-                 make_socket(*io_service, endpoint.protocol(), interface_address),
-                 endpoint, config, buffer_size)
+                 std::vector<boost::asio::ip::udp::endpoint>{endpoint},
+                 config, buffer_size, interface_address)
+{
+}
+
+udp_stream::udp_stream(
+    io_service_ref io_service,
+    const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
+    const stream_config &config,
+    std::size_t buffer_size,
+    const boost::asio::ip::address &interface_address)
+    : udp_stream(std::move(io_service),
+                 make_socket(*io_service, get_protocol(endpoints), interface_address),
+                 endpoints, config, buffer_size)
 {
 }
 
@@ -143,15 +310,18 @@ static boost::asio::ip::udp::socket make_multicast_socket(
 
 static boost::asio::ip::udp::socket make_multicast_v4_socket(
     boost::asio::io_service &io_service,
-    const boost::asio::ip::udp::endpoint &endpoint,
+    const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
     int ttl,
     const boost::asio::ip::address &interface_address)
 {
-    if (!endpoint.address().is_v4() || !endpoint.address().is_multicast())
-        throw std::invalid_argument("endpoint is not an IPv4 multicast address");
+    if (endpoints.empty())
+        throw std::invalid_argument("endpoints is empty");
+    for (const auto &endpoint : endpoints)
+        if (!endpoint.address().is_v4() || !endpoint.address().is_multicast())
+            throw std::invalid_argument("endpoint is not an IPv4 multicast address");
     if (!interface_address.is_unspecified() && !interface_address.is_v4())
         throw std::invalid_argument("interface address is not an IPv4 address");
-    boost::asio::ip::udp::socket socket(io_service, endpoint.protocol());
+    boost::asio::ip::udp::socket socket(io_service, boost::asio::ip::udp::v4());
     socket.set_option(boost::asio::ip::multicast::hops(ttl));
     if (!interface_address.is_unspecified())
         socket.set_option(boost::asio::ip::multicast::outbound_interface(interface_address.to_v4()));
@@ -191,8 +361,21 @@ udp_stream::udp_stream(
     int ttl,
     const boost::asio::ip::address &interface_address)
     : udp_stream(std::move(io_service),
-                 make_multicast_v4_socket(*io_service, endpoint, ttl, interface_address),
-                 endpoint, config, buffer_size)
+                 std::vector<boost::asio::ip::udp::endpoint>{endpoint},
+                 config, buffer_size, ttl, interface_address)
+{
+}
+
+udp_stream::udp_stream(
+    io_service_ref io_service,
+    const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
+    const stream_config &config,
+    std::size_t buffer_size,
+    int ttl,
+    const boost::asio::ip::address &interface_address)
+    : udp_stream(std::move(io_service),
+                 make_multicast_v4_socket(*io_service, endpoints, ttl, interface_address),
+                 endpoints, config, buffer_size)
 {
 }
 
@@ -234,21 +417,30 @@ udp_stream::udp_stream(
     const boost::asio::ip::udp::endpoint &endpoint,
     const stream_config &config,
     std::size_t buffer_size)
-    : stream_impl<udp_stream>(std::move(io_service), config, batch_size),
-    socket(std::move(socket)), endpoint(endpoint)
+    : udp_stream(std::move(io_service), std::move(socket),
+                 std::vector<boost::asio::ip::udp::endpoint>{endpoint},
+                 config, buffer_size)
+{
+}
+
+udp_stream::udp_stream(
+    io_service_ref io_service,
+    boost::asio::ip::udp::socket &&socket,
+    std::vector<boost::asio::ip::udp::endpoint> endpoints,
+    const stream_config &config,
+    std::size_t buffer_size)
+    : stream_impl<udp_stream>(std::move(io_service), config, batch_size, endpoints.size()),
+    socket(std::move(socket)), endpoints(std::move(endpoints))
 {
+    get_protocol(this->endpoints);    // validates the endpoints
     if (!socket_uses_io_service(this->socket, get_io_service()))
         throw std::invalid_argument("I/O service does not match the socket's I/O service");
     set_socket_send_buffer_size(this->socket, buffer_size);
     this->socket.non_blocking(true);
+    // Each packet may be sent to every endpoint
+    messages.reserve(batch_size * this->endpoints.size());
 #if SPEAD2_USE_SENDMMSG
-    std::memset(&msgvec, 0, sizeof(msgvec));
-    for (std::size_t i = 0; i < batch_size; i++)
-    {
-        auto &hdr = msgvec[i].msg_hdr;
-        hdr.msg_name = (void *) this->endpoint.data();
-        hdr.msg_namelen = this->endpoint.size();
-    }
+    msgvec.resize(batch_size * this->endpoints.size());   // value-initialised to zero
 #endif // SPEAD2_USE_SENDMMSG
 }
 
@@ -261,6 +453,15 @@ udp_stream::udp_stream(
 {
 }
 
+udp_stream::udp_stream(
+    io_service_ref io_service,
+    boost::asio::ip::udp::socket &&socket,
+    const std::vector<boost::asio::ip::udp::endpoint> &endpoints,
+    const stream_config &config)
+    : udp_stream(io_service, std::move(socket), endpoints, config, 0)
+{
+}
+
 udp_stream::~udp_stream()
 {
     flush();
@@ -0,0 +1,324 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <spead2/common_features.h>
+#if SPEAD2_USE_PACKET_MMAP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <utility>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <boost/asio.hpp>
+#include <spead2/common_logging.h>
+#include <spead2/common_raw_packet.h>
+#include <spead2/send_udp_packet_mmap.h>
+
+namespace spead2
+{
+namespace send
+{
+
+constexpr std::size_t udp_packet_mmap_stream::default_buffer_size;
+static constexpr std::size_t header_length =
+    ethernet_frame::min_size + ipv4_packet::min_size + udp_packet::min_size;
+/// Offset from the start of a ring frame to the Ethernet header
+static constexpr std::size_t frame_data_offset = TPACKET_ALIGN(sizeof(tpacket2_hdr));
+/// Bounds on the time to wait for the kernel to pick up frames from a full ring
+static const std::chrono::microseconds min_retry_delay(10);
+static const std::chrono::microseconds max_retry_delay(1000);
+
+static std::uint32_t get_status(const std::uint8_t *frame)
+{
+    const tpacket2_hdr *hdr = reinterpret_cast<const tpacket2_hdr *>(frame);
+    return __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+}
+
+/// Whether the kernel still owns a frame
+static bool frame_busy(std::uint32_t status)
+{
+    return status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING);
+}
+
+ethernet_frame udp_packet_mmap_stream::get_ethernet_frame(std::size_t idx) const
+{
+    return ethernet_frame(get_frame(idx) + frame_data_offset, frame_size - frame_data_offset);
+}
+
+boost::system::error_code udp_packet_mmap_stream::kick()
+{
+    if (::send(packet_socket.native_handle(), nullptr, 0, MSG_DONTWAIT) < 0
+        && errno != EAGAIN && errno != EWOULDBLOCK)
+        return boost::system::error_code(errno, boost::asio::error::get_system_category());
+    return boost::system::error_code();
+}
+
+void udp_packet_mmap_stream::send_packets(std::size_t first)
+{
+    for (std::size_t i = first; i < n_current_packets; i++)
+    {
+        std::uint8_t *frame = get_frame(next_frame);
+        std::uint32_t status = get_status(frame);
+        if (frame_busy(status))
+        {
+            // The ring is full. Make sure the kernel is working on what we
+            // have already given it, then wait for a frame to be released.
+            boost::system::error_code ec = kick();
+            for (std::size_t j = first; j < i; j++)
+                current_packets[j].result = ec;
+            if (status & TP_STATUS_SEND_REQUEST)
+            {
+                /* The kernel has not picked up the frame yet (probably
+                 * because the socket send buffer is full), so it will not
+                 * report the ring as writable. Back off before kicking it
+                 * again, rather than spinning.
+                 */
+                retry_timer.expires_from_now(retry_delay);
+                retry_delay = std::min(retry_delay * 2, max_retry_delay);
+                retry_timer.async_wait(
+                    [this, i](const boost::system::error_code &ec)
+                    {
+                        if (ec)
+                        {
+                            for (std::size_t j = i; j < n_current_packets; j++)
+                                current_packets[j].result = ec;
+                            packets_handler();
+                        }
+                        else
+                            send_packets(i);
+                    });
+            }
+            else
+            {
+                packet_socket.async_write_some(
+                    boost::asio::null_buffers(),
+                    [this, i](const boost::system::error_code &ec, std::size_t)
+                    {
+                        if (ec)
+                        {
+                            for (std::size_t j = i; j < n_current_packets; j++)
+                                current_packets[j].result = ec;
+                            packets_handler();
+                        }
+                        else
+                            send_packets(i);
+                    });
+            }
+            return;
+        }
+        retry_delay = min_retry_delay;
+
+        const transmit_packet &current_packet = current_packets[i];
+        std::size_t payload_size = current_packet.size;
+        ethernet_frame eth = get_ethernet_frame(next_frame);
+        ipv4_packet ipv4 = eth.payload_ipv4();
+        ipv4.total_length(payload_size + udp_packet::min_size + ipv4.header_length());
+        ipv4.update_checksum();
+        udp_packet udp = ipv4.payload_udp();
+        udp.length(payload_size + udp_packet::min_size);
+        packet_buffer payload = udp.payload();
+        boost::asio::buffer_copy(boost::asio::mutable_buffer(payload), current_packet.pkt.buffers);
+
+        tpacket2_hdr *hdr = reinterpret_cast<tpacket2_hdr *>(frame);
+        hdr->tp_len = payload_size + (payload.data() - eth.data());
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        next_frame++;
+        if (next_frame == n_frames)
+            next_frame = 0;
+    }
+
+    boost::system::error_code ec = kick();
+    for (std::size_t i = first; i < n_current_packets; i++)
+        current_packets[i].result = ec;
+    get_io_service().post([this] { packets_handler(); });
+}
+
+void udp_packet_mmap_stream::async_send_packets()
+{
+    send_packets(0);
+}
+
+static int make_packet_socket()
+{
+    int fd = ::socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throw_errno("could not create AF_PACKET socket");
+    return fd;
+}
+
+static std::size_t calc_frame_size(const stream_config &config)
+{
+    std::size_t needed = frame_data_offset + header_length + config.get_max_packet_size();
+    std::size_t frame_size = TPACKET_ALIGNMENT;
+    while (frame_size < needed)
+        frame_size *= 2;
+    return frame_size;
+}
+
+udp_packet_mmap_stream::udp_packet_mmap_stream(
+    io_service_ref io_service,
+    const boost::asio::ip::udp::endpoint &endpoint,
+    const stream_config &config,
+    const boost::asio::ip::address &interface_address,
+    std::size_t buffer_size,
+    int ttl)
+    : stream_impl<udp_packet_mmap_stream>(std::move(io_service), config, batch_size),
+    socket(get_io_service(), endpoint.protocol()),
+    packet_socket(get_io_service()),
+    retry_timer(get_io_service()),
+    retry_delay(min_retry_delay)
+{
+    if (!endpoint.address().is_v4() || !endpoint.address().is_multicast())
+        throw std::invalid_argument("endpoint is not an IPv4 multicast address");
+    if (!interface_address.is_v4())
+        throw std::invalid_argument("interface address is not an IPv4 address");
+    socket.bind(boost::asio::ip::udp::endpoint(interface_address, 0));
+    mac_address destination_mac = multicast_mac(endpoint.address());
+    mac_address source_mac = interface_mac(interface_address);
+    packet_socket.assign(make_packet_socket());
+    int fd = packet_socket.native_handle();
+
+    int version = TPACKET_V2;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        throw_errno("setsockopt(PACKET_VERSION) failed");
+    int bypass = 1;
+    if (setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass)) < 0)
+        log_warning("could not bypass queuing discipline: %1%", std::strerror(errno));
+    /* Without this, a frame that the kernel rejects stops the ring: the
+     * kernel marks it TP_STATUS_WRONG_FORMAT and never moves past it.
+     * Instead, have such frames dropped.
+     */
+    int loss = 1;
+    if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0)
+        throw_errno("setsockopt(PACKET_LOSS) failed");
+
+    // Set up the ring as a whole number of page-sized (or larger) blocks
+    frame_size = calc_frame_size(config);
+    std::size_t block_size = std::max(frame_size, std::size_t(sysconf(_SC_PAGESIZE)));
+    std::size_t n_blocks = std::max(std::size_t(1), buffer_size / block_size);
+    n_frames = n_blocks * (block_size / frame_size);
+    ring_size = n_blocks * block_size;
+    tpacket_req req;
+    std::memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = n_blocks;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = n_frames;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+        throw_errno("setsockopt(PACKET_TX_RING) failed");
+    /* Allow the whole ring to be in flight, so that the kernel never leaves
+     * frames unclaimed because the socket send buffer is full.
+     */
+    int sndbuf = ring_size * 2;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+        log_warning("could not set send buffer size: %1%", std::strerror(errno));
+
+    unsigned int ifindex = interface_index(interface_address);
+    /* The kernel drops frames that exceed the MTU, and such drops are not
+     * reported (see above), so refuse to create the stream instead.
+     */
+    ifreq ifr;
+    std::memset(&ifr, 0, sizeof(ifr));
+    if (!if_indextoname(ifindex, ifr.ifr_name))
+        throw_errno("if_indextoname failed");
+    if (ioctl(fd, SIOCGIFMTU, &ifr) < 0)
+        throw_errno("ioctl(SIOCGIFMTU) failed");
+    if (config.get_max_packet_size() + ipv4_packet::min_size + udp_packet::min_size
+        > std::size_t(ifr.ifr_mtu))
+        throw std::invalid_argument("max_packet_size is too large for the interface MTU");
+
+    sockaddr_ll addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = 0;     // Do not receive anything on this socket
+    addr.sll_ifindex = ifindex;
+    if (bind(fd, (const sockaddr *) &addr, sizeof(addr)) < 0)
+        throw_errno("bind failed");
+
+    void *ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        throw_errno("mmap of transmit ring failed");
+    ring = static_cast<std::uint8_t *>(ptr);
+
+    for (std::size_t i = 0; i < n_frames; i++)
+    {
+        ethernet_frame frame = get_ethernet_frame(i);
+        frame.destination_mac(destination_mac);
+        frame.source_mac(source_mac);
+        frame.ethertype(ipv4_packet::ethertype);
+        ipv4_packet ipv4 = frame.payload_ipv4();
+        ipv4.version_ihl(0x45);  // IPv4, 20 byte header
+        // total_length will change later to the actual packet size
+        ipv4.total_length(config.get_max_packet_size() + ipv4_packet::min_size + udp_packet::min_size);
+        ipv4.flags_frag_off(ipv4_packet::flag_do_not_fragment);
+        ipv4.ttl(ttl);
+        ipv4.protocol(udp_packet::protocol);
+        ipv4.source_address(interface_address.to_v4());
+        ipv4.destination_address(endpoint.address().to_v4());
+        udp_packet udp = ipv4.payload_udp();
+        udp.source_port(socket.local_endpoint().port());
+        udp.destination_port(endpoint.port());
+        udp.length(config.get_max_packet_size() + udp_packet::min_size);
+        udp.checksum(0);
+    }
+}
+
+udp_packet_mmap_stream::~udp_packet_mmap_stream()
+{
+    flush();
+    /* Wait until the kernel has released all the frames before unmapping
+     * the ring. This is bounded in case the interface has gone away.
+     */
+    pollfd pfd;
+    pfd.fd = packet_socket.native_handle();
+    pfd.events = POLLOUT;
+    for (std::size_t i = 0, tries = 0; i < n_frames && tries < 1000; )
+    {
+        if (frame_busy(get_status(get_frame(i))))
+        {
+            kick();
+            poll(&pfd, 1, 1);
+            tries++;
+        }
+        else
+            i++;
+    }
+    if (ring)
+        munmap(ring, ring_size);
+}
+
+} // namespace send
+} // namespace spead2
+
+#endif // SPEAD2_USE_PACKET_MMAP
@@ -0,0 +1,183 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <spead2/common_features.h>
+#if SPEAD2_USE_URING
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <system_error>
+#include <utility>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <boost/asio.hpp>
+#include <spead2/send_udp_uring.h>
+#include <spead2/common_logging.h>
+#include <spead2/common_socket.h>
+
+namespace spead2
+{
+namespace send
+{
+
+constexpr std::size_t udp_uring_stream::default_buffer_size;
+
+void udp_uring_stream::reap()
+{
+    ring.reap([this](const io_uring_cqe &cqe)
+    {
+        transmit_packet &data = current_packets[cqe.user_data];
+        if (cqe.res < 0)
+            data.result = boost::system::error_code(-cqe.res, boost::asio::error::get_system_category());
+        else
+            data.result = boost::system::error_code();
+        n_pending--;
+    });
+    if (n_pending == 0)
+    {
+        get_io_service().post([this] { packets_handler(); });
+        return;
+    }
+
+    event_fd.async_read_some(
+        boost::asio::null_buffers(),
+        [this](const boost::system::error_code &ec, std::size_t)
+        {
+            if (ec)
+            {
+                // Only happens if the descriptor is closed, which should not
+                // happen while packets are in flight.
+                log_warning("Error waiting for io_uring completions: %1%", ec.message());
+            }
+            std::uint64_t value;
+            // Clear the counter before reaping, so that completions posted
+            // after this point will wake us up again.
+            if (read(event_fd.native_handle(), &value, sizeof(value)) < 0
+                && errno != EAGAIN && errno != EWOULDBLOCK)
+                log_warning("Failed to read io_uring eventfd: %1%", std::strerror(errno));
+            reap();
+        });
+}
+
+void udp_uring_stream::async_send_packets()
+{
+    msg_iov.clear();
+    for (std::size_t i = 0; i < n_current_packets; i++)
+        for (const auto &buffer : current_packets[i].pkt.buffers)
+        {
+            msg_iov.push_back(iovec{const_cast<void *>(boost::asio::buffer_cast<const void *>(buffer)),
+                                    boost::asio::buffer_size(buffer)});
+        }
+    // Pointers into msg_iov are only stable once it has been fully populated
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < n_current_packets; i++)
+    {
+        msgvec[i].msg_iov = &msg_iov[offset];
+        msgvec[i].msg_iovlen = current_packets[i].pkt.buffers.size();
+        offset += msgvec[i].msg_iovlen;
+
+        io_uring_sqe *sqe = ring.get_sqe();
+        // The ring is sized to hold a full batch and we only submit a new
+        // batch once all completions for the previous one are reaped.
+        assert(sqe != nullptr);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = 0;     // index into registered files
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = reinterpret_cast<std::uintptr_t>(&msgvec[i]);
+        sqe->len = 1;
+        sqe->user_data = i;
+        /* Chain the packets so that they are transmitted in order. Without
+         * this, a packet that has to wait for buffer space could be
+         * overtaken by later ones, including the end-of-stream heap. A hard
+         * link is used so that a failed packet does not cancel the rest of
+         * the batch, which may belong to unrelated heaps.
+         */
+        if (i + 1 < n_current_packets)
+            sqe->flags |= IOSQE_IO_HARDLINK;
+    }
+
+    try
+    {
+        ring.submit();
+        n_pending = n_current_packets;
+    }
+    catch (std::system_error &e)
+    {
+        boost::system::error_code ec(e.code().value(), boost::asio::error::get_system_category());
+        for (std::size_t i = 0; i < n_current_packets; i++)
+            current_packets[i].result = ec;
+        get_io_service().post([this] { packets_handler(); });
+        return;
+    }
+    reap();
+}
+
+static int make_event_fd()
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        throw_errno("eventfd failed");
+    return fd;
+}
+
+udp_uring_stream::udp_uring_stream(
+    io_service_ref io_service,
+    const boost::asio::ip::udp::endpoint &endpoint,
+    const stream_config &config,
+    std::size_t buffer_size,
+    const boost::asio::ip::address &interface_address)
+    : stream_impl<udp_uring_stream>(std::move(io_service), config, batch_size),
+    socket(get_io_service(), endpoint.protocol()),
+    endpoint(endpoint),
+    ring(batch_size),
+    event_fd(get_io_service(), make_event_fd())
+{
+    if (!interface_address.is_unspecified())
+        socket.bind(boost::asio::ip::udp::endpoint(interface_address, 0));
+    set_socket_send_buffer_size(socket, buffer_size);
+    /* The socket is deliberately left in blocking mode: io_uring then waits
+     * for buffer space itself instead of failing with EAGAIN.
+     */
+    int fd = socket.native_handle();
+    ring.register_files(&fd, 1);
+    ring.register_eventfd(event_fd.native_handle());
+
+    std::memset(&msgvec, 0, sizeof(msgvec));
+    for (std::size_t i = 0; i < batch_size; i++)
+    {
+        msgvec[i].msg_name = (void *) this->endpoint.data();
+        msgvec[i].msg_namelen = this->endpoint.size();
+    }
+}
+
+udp_uring_stream::~udp_uring_stream()
+{
+    flush();
+}
+
+} // namespace send
+} // namespace spead2
+
+#endif // SPEAD2_USE_URING
@@ -29,12 +29,19 @@
 #include <spead2/common_thread_pool.h>
 #include <spead2/common_semaphore.h>
 #include <spead2/send_stream.h>
+#include <spead2/send_packet.h>
 #include <spead2/send_udp.h>
 #include <spead2/send_tcp.h>
 #include <spead2/common_features.h>
 #if SPEAD2_USE_IBV
 # include <spead2/send_udp_ibv.h>
 #endif
+#if SPEAD2_USE_URING
+# include <spead2/send_udp_uring.h>
+#endif
+#if SPEAD2_USE_PACKET_MMAP
+# include <spead2/send_udp_packet_mmap.h>
+#endif
 
 namespace po = boost::program_options;
 namespace asio = boost::asio;
@@ -55,12 +62,24 @@ struct options
     std::size_t burst = spead2::send::stream_config::default_burst_size;
     double burst_rate_ratio = spead2::send::stream_config::default_burst_rate_ratio;
     std::size_t max_heaps = spead2::send::stream_config::default_max_heaps;
+    std::size_t interleave = spead2::send::stream_config::default_max_interleave;
     double rate = 0.0;
+    double spin_time = 0.0;
     int ttl = 1;
 #if SPEAD2_USE_IBV
     bool ibv = false;
     int ibv_comp_vector = 0;
     int ibv_max_poll = spead2::send::udp_ibv_stream::default_max_poll;
+#endif
+#if SPEAD2_USE_URING
+    bool uring = false;
+#endif
+#if SPEAD2_USE_PACKET_MMAP
+    bool packet_mmap = false;
+#endif
+#if SPEAD2_USE_TXTIME
+    bool txtime = false;
+    double txtime_lookahead = spead2::send::udp_stream::default_txtime_lookahead * 1e6;
 #endif
     std::string host;
     std::string port;
@@ -68,7 +87,7 @@ struct options
 
 static void usage(std::ostream &o, const po::options_description &desc)
 {
-    o << "Usage: spead2_send [options] <host> <port>\n";
+    o << "Usage: spead2_send [options] <host>[,<host>...] <port>\n";
     o << desc;
 }
 
@@ -106,12 +125,24 @@ static options parse_args(int argc, const char **argv)
         ("burst", make_opt(opts.burst), "Burst size")
         ("burst-rate-ratio", make_opt(opts.burst_rate_ratio), "Hard rate limit, relative to --rate")
         ("max-heaps", make_opt(opts.max_heaps), "Maximum heaps in flight")
+        ("interleave", make_opt(opts.interleave), "Number of heaps whose packets are interleaved")
         ("rate", make_opt(opts.rate), "Transmission rate bound (Gb/s)")
+        ("spin-time", make_opt(opts.spin_time), "Time to busy-wait before each burst (us)")
         ("ttl", make_opt(opts.ttl), "TTL for multicast target")
 #if SPEAD2_USE_IBV
         ("ibv", make_opt(opts.ibv), "Use ibverbs")
         ("ibv-vector", make_opt(opts.ibv_comp_vector), "Interrupt vector (-1 for polled)")
         ("ibv-max-poll", make_opt(opts.ibv_max_poll), "Maximum number of times to poll in a row")
+#endif
+#if SPEAD2_USE_URING
+        ("uring", make_opt(opts.uring), "Use io_uring")
+#endif
+#if SPEAD2_USE_PACKET_MMAP
+        ("packet-mmap", make_opt(opts.packet_mmap), "Use AF_PACKET transmit ring")
+#endif
+#if SPEAD2_USE_TXTIME
+        ("txtime", make_opt(opts.txtime), "Let the kernel pace packets (SO_TXTIME)")
+        ("txtime-lookahead", make_opt(opts.txtime_lookahead), "How far ahead to pass packets to the kernel with --txtime (us)")
 #endif
     ;
     hidden.add_options()
@@ -140,6 +171,22 @@ static options parse_args(int argc, const char **argv)
         }
         if (!vm.count("host") || !vm.count("port"))
             throw po::error("too few positional options have been specified on the command line");
+        bool plain_udp = !opts.tcp;
+#if SPEAD2_USE_IBV
+        plain_udp = plain_udp && !opts.ibv;
+#endif
+#if SPEAD2_USE_URING
+        plain_udp = plain_udp && !opts.uring;
+#endif
+#if SPEAD2_USE_PACKET_MMAP
+        plain_udp = plain_udp && !opts.packet_mmap;
+#endif
+        if (opts.host.find(',') != std::string::npos && !plain_udp)
+            throw po::error("multiple destinations are only supported for plain UDP");
+#if SPEAD2_USE_TXTIME
+        if (opts.txtime && !plain_udp)
+            throw po::error("--txtime is only supported for plain UDP");
+#endif
         if (!vm.count("buffer"))
         {
             if (opts.tcp)
@@ -150,6 +197,10 @@ static options parse_args(int argc, const char **argv)
 #if SPEAD2_USE_IBV
         if (opts.ibv && opts.bind.empty())
             throw po::error("--ibv requires --bind");
+#endif
+#if SPEAD2_USE_PACKET_MMAP
+        if (opts.packet_mmap && opts.bind.empty())
+            throw po::error("--packet-mmap requires --bind");
 #endif
         return opts;
     }
@@ -233,6 +284,11 @@ sender::sender(spead2::send::stream &stream, const options &opts)
         first_heap.add_item(0x1000 + i, ptr, elements * sizeof(item_t), true);
     }
     last_heap.add_end();
+
+    // The data heaps all have the same layout, so they can share a plan
+    auto plan = std::make_shared<spead2::send::heap_plan>(heaps[0], opts.packet);
+    for (auto &h : heaps)
+        h.set_plan(plan);
 }
 
 const spead2::send::heap &sender::get_heap(std::uint64_t idx) const noexcept
@@ -260,7 +316,7 @@ void sender::callback(std::uint64_t idx, const boost::system::error_code &ec, st
     {
         idx += max_heaps;
         stream.async_send_heap(get_heap(idx), [this, idx] (const boost::system::error_code &ec, std::size_t bytes_transferred) {
-            callback(idx, ec, bytes_transferred); });
+            callback(idx, ec, bytes_transferred); }, -1, spead2::send::stream::all_substreams);
     }
     else
         done_sem.put();
@@ -279,7 +335,7 @@ std::uint64_t sender::run()
     stream.get_io_service().post([this] {
         for (int i = 0; i < max_heaps; i++)
             stream.async_send_heap(get_heap(i), [this, i] (const boost::system::error_code &ec, std::size_t bytes_transferred) {
-                callback(i, ec, bytes_transferred); });
+                callback(i, ec, bytes_transferred); }, -1, spead2::send::stream::all_substreams);
     });
     for (int i = 0; i < max_heaps; i++)
         semaphore_get(done_sem);
@@ -302,6 +358,14 @@ static int run(spead2::send::stream &stream, const options &opts)
     std::cout
         << "Sent " << sent_bytes << " bytes in " << elapsed_s << " seconds, "
         << sent_bytes * 8.0e-9 / elapsed_s << " Gb/s\n";
+    spead2::send::pacing_stats stats = stream.get_pacing_stats();
+    if (stats.bursts > 0)
+    {
+        std::cout
+            << "Rate-limited bursts: " << stats.bursts
+            << ", mean lateness " << stats.total_lateness / stats.bursts * 1e6 << " us"
+            << ", max lateness " << stats.max_lateness * 1e6 << " us\n";
+    }
     return 0;
 }
 
@@ -315,6 +379,24 @@ static boost::asio::ip::basic_endpoint<Proto> get_endpoint(
     return *resolver.resolve(query);
 }
 
+/// Resolve a comma-separated list of hosts
+template <typename Proto>
+static std::vector<boost::asio::ip::basic_endpoint<Proto>> get_endpoints(
+    boost::asio::io_service &io_service, const options &opts)
+{
+    typedef boost::asio::ip::basic_resolver<Proto> resolver_type;
+    resolver_type resolver(io_service);
+    std::vector<boost::asio::ip::basic_endpoint<Proto>> endpoints;
+    std::istringstream hosts(opts.host);
+    std::string host;
+    while (std::getline(hosts, host, ','))
+    {
+        typename resolver_type::query query(host, opts.port);
+        endpoints.push_back(*resolver.resolve(query));
+    }
+    return endpoints;
+}
+
 int main(int argc, const char **argv)
 {
     options opts = parse_args(argc, argv);
@@ -322,7 +404,7 @@ int main(int argc, const char **argv)
     spead2::thread_pool thread_pool(1);
     spead2::send::stream_config config(
         opts.packet, opts.rate * 1000 * 1000 * 1000 / 8, opts.burst,
-        opts.max_heaps, opts.burst_rate_ratio);
+        opts.max_heaps, opts.burst_rate_ratio, opts.interleave, opts.spin_time * 1e-6);
     std::unique_ptr<spead2::send::stream> stream;
     auto &io_service = thread_pool.get_io_service();
     boost::asio::ip::address interface_address;
@@ -344,7 +426,8 @@ int main(int argc, const char **argv)
     }
     else
     {
-        udp::endpoint endpoint = get_endpoint<udp>(io_service, opts);
+        std::vector<udp::endpoint> endpoints = get_endpoints<udp>(io_service, opts);
+        const udp::endpoint &endpoint = endpoints[0];
 #if SPEAD2_USE_IBV
         if (opts.ibv)
         {
@@ -355,8 +438,36 @@ int main(int argc, const char **argv)
         }
         else
 #endif
+#if SPEAD2_USE_PACKET_MMAP
+        if (opts.packet_mmap)
         {
-            if (endpoint.address().is_multicast())
+            stream.reset(new spead2::send::udp_packet_mmap_stream(
+                    io_service, endpoint, config,
+                    interface_address, opts.buffer, opts.ttl));
+        }
+        else
+#endif
+#if SPEAD2_USE_URING
+        if (opts.uring)
+        {
+            stream.reset(new spead2::send::udp_uring_stream(
+                    io_service, endpoint, config, opts.buffer, interface_address));
+        }
+        else
+#endif
+        {
+            // Each heap is sent to every destination
+            if (endpoints.size() > 1)
+            {
+                if (endpoint.address().is_multicast() && endpoint.address().is_v4())
+                    stream.reset(new spead2::send::udp_stream(
+                            io_service, endpoints, config, opts.buffer,
+                            opts.ttl, interface_address));
+                else
+                    stream.reset(new spead2::send::udp_stream(
+                            io_service, endpoints, config, opts.buffer, interface_address));
+            }
+            else if (endpoint.address().is_multicast())
             {
                 if (endpoint.address().is_v4())
                     stream.reset(new spead2::send::udp_stream(
@@ -376,6 +487,11 @@ int main(int argc, const char **argv)
                 stream.reset(new spead2::send::udp_stream(
                         io_service, endpoint, config, opts.buffer, interface_address));
             }
+#if SPEAD2_USE_TXTIME
+            if (opts.txtime)
+                static_cast<spead2::send::udp_stream &>(*stream).enable_txtime(
+                    opts.txtime_lookahead * 1e-6);
+#endif
         }
     }
     return run(*stream, opts);
@@ -23,6 +23,10 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/mpl/list.hpp>
 #include <memory>
+#include <new>
+#include <stdexcept>
+#include <vector>
+#include <cstdint>
 #include <spead2/common_memory_allocator.h>
 
 namespace spead2
@@ -59,6 +63,52 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(out_of_memory, T, test_types)
     BOOST_CHECK_THROW(allocator->allocate(SIZE_MAX - 1, nullptr), std::bad_alloc);
 }
 
+/* Each option falls back gracefully if the system does not support it (for
+ * example, a non-existent NUMA node or no reserved huge pages), so the
+ * allocations must always succeed.
+ */
+BOOST_AUTO_TEST_CASE(mmap_allocator_options)
+{
+    std::vector<spead2::mmap_allocator_config> configs;
+    spead2::mmap_allocator_config config;
+    config.set_prefer_huge(true);
+    config.set_huge_page_size(2 * 1024 * 1024);
+    configs.push_back(config);
+    config.set_huge_page_size(1024 * 1024 * 1024);
+    configs.push_back(config);
+    config = spead2::mmap_allocator_config();
+    config.set_transparent_huge(true);
+    configs.push_back(config);
+    config = spead2::mmap_allocator_config();
+    config.set_numa_node(0);
+    configs.push_back(config);
+    config.set_numa_node(1000);
+    configs.push_back(config);
+    config = spead2::mmap_allocator_config();
+    config.set_lock(true);
+    configs.push_back(config);
+    config = spead2::mmap_allocator_config();
+    config.set_populate(false);
+    configs.push_back(config);
+
+    for (const auto &c : configs)
+    {
+        auto allocator = std::make_shared<spead2::mmap_allocator>(c);
+        spead2::memory_allocator::pointer ptr = allocator->allocate(12345, nullptr);
+        for (std::size_t i = 0; i < 12345; i++)
+            ptr[i] = 1;
+        ptr.reset();
+        BOOST_CHECK_THROW(allocator->allocate(SIZE_MAX - 1, nullptr), std::bad_alloc);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mmap_allocator_config_validation)
+{
+    spead2::mmap_allocator_config config;
+    BOOST_CHECK_THROW(config.set_huge_page_size(3 * 1024 * 1024), std::invalid_argument);
+    config.set_huge_page_size(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()  // memory_allocator
 BOOST_AUTO_TEST_SUITE_END()  // common
 
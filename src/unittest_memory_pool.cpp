@@ -28,6 +28,9 @@
 #include <memory>
 #include <thread>
 #include <chrono>
+#include <future>
+#include <numeric>
+#include <cstdint>
 #include <spead2/common_memory_pool.h>
 #include <spead2/common_thread_pool.h>
 #include <spead2/common_logging.h>
@@ -60,6 +63,60 @@ BOOST_AUTO_TEST_CASE(memory_pool_refill)
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
 }
 
+// Fills the pool in the background, without waiting for a low-water mark
+BOOST_AUTO_TEST_CASE(memory_pool_fill_async)
+{
+    spead2::thread_pool tpool(1);
+    spead2::mmap_allocator_config config;
+    config.set_populate(false);
+    auto allocator = std::make_shared<spead2::mmap_allocator>(config);
+    auto pool = std::make_shared<spead2::memory_pool>(
+        tpool, 1024 * 1024, 2 * 1024 * 1024, 8, 0, 0, allocator);
+    pool->fill_async(100);
+    // The thread pool has a single thread, so this runs after the refill
+    std::promise<void> done;
+    tpool.get_io_service().post([&done] { done.set_value(); });
+    done.get_future().get();
+
+    std::vector<spead2::memory_pool::pointer> pointers;
+    for (int i = 0; i < 8; i++)
+        pointers.push_back(pool->allocate(1024 * 1024, nullptr));
+    spead2::memory_pool_stats stats = pool->get_stats();
+    BOOST_CHECK_EQUAL(stats.hits, 8);
+    BOOST_CHECK_EQUAL(stats.misses, 0);
+    BOOST_CHECK_EQUAL(std::accumulate(stats.refill_histogram.begin(),
+                                      stats.refill_histogram.end(), std::uint64_t(0)), 1);
+
+    auto plain = std::make_shared<spead2::memory_pool>(1024, 2048, 8, 0);
+    BOOST_CHECK_THROW(plain->fill_async(4), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(memory_pool_stats)
+{
+    typedef spead2::memory_pool::pointer pointer;
+    auto pool = std::make_shared<spead2::memory_pool>(1024, 2048, 2, 1);
+    pool->set_warn_on_empty(false);
+    pointer p1 = pool->allocate(1500, nullptr);
+    pointer p2 = pool->allocate(1500, nullptr);
+    pointer p3 = pool->allocate(1500, nullptr);
+    pointer p4 = pool->allocate(100, nullptr);
+    p1.reset();
+    p2.reset();
+    p3.reset();    // pool is already full
+    p4.reset();
+
+    spead2::memory_pool_stats stats = pool->get_stats();
+    BOOST_CHECK_EQUAL(stats.allocations, 4);
+    BOOST_CHECK_EQUAL(stats.hits, 1);
+    BOOST_CHECK_EQUAL(stats.misses, 2);
+    BOOST_CHECK_EQUAL(stats.out_of_range, 1);
+    BOOST_CHECK_EQUAL(stats.dropped_frees, 1);
+    BOOST_CHECK_EQUAL(stats.current_free, 2);
+    BOOST_CHECK_EQUAL(stats.min_free, 0);
+    for (std::uint64_t count : stats.refill_histogram)
+        BOOST_CHECK_EQUAL(count, 0);
+}
+
 class mock_allocator : public spead2::memory_allocator
 {
 public:
@@ -186,6 +243,95 @@ BOOST_FIXTURE_TEST_CASE(memory_pool_warn_on_empty, logger_fixture)
     BOOST_CHECK_EQUAL(messages[spead2::log_level::warning].size(), 1);
 }
 
+// Memory freed by one thread is recycled by a thread allocating it
+BOOST_AUTO_TEST_CASE(memory_pool_producer_consumer)
+{
+    typedef spead2::memory_allocator::pointer pointer;
+    auto pool = std::make_shared<spead2::memory_pool>(1024, 2048, 256, 256);
+    for (int batch = 0; batch < 100; batch++)
+    {
+        std::vector<pointer> pointers;
+        for (int i = 0; i < 32; i++)
+            pointers.push_back(pool->allocate(1024, nullptr));
+        // Free them from another thread
+        std::async(std::launch::async, [&pointers] { pointers.clear(); }).get();
+    }
+    spead2::memory_pool_stats stats = pool->get_stats();
+    BOOST_CHECK_EQUAL(stats.hits, 3200);
+    BOOST_CHECK_EQUAL(stats.misses, 0);
+}
+
+// Many threads allocating and freeing concurrently
+BOOST_AUTO_TEST_CASE(memory_pool_concurrent)
+{
+    typedef spead2::memory_allocator::pointer pointer;
+    auto pool = std::make_shared<spead2::memory_pool>(1024, 2048, 128, 64);
+    pool->set_warn_on_empty(false);
+    std::vector<std::future<void>> futures;
+    for (int t = 0; t < 8; t++)
+        futures.push_back(std::async(std::launch::async, [pool, t]
+        {
+            std::vector<pointer> pointers;
+            for (int i = 0; i < 10000; i++)
+            {
+                pointers.push_back(pool->allocate(1024, nullptr));
+                if (pointers.size() > std::size_t(t))
+                    pointers.clear();
+            }
+        }));
+    for (auto &f : futures)
+        f.get();
+    spead2::memory_pool_stats stats = pool->get_stats();
+    BOOST_CHECK_EQUAL(stats.hits + stats.misses, 80000);
+    BOOST_CHECK_GT(stats.hits, 0);
+}
+
+// Allocations are served by the smallest size class that fits
+BOOST_AUTO_TEST_CASE(size_class_memory_pool)
+{
+    typedef spead2::memory_allocator::pointer pointer;
+    std::shared_ptr<mock_allocator> allocator = std::make_shared<mock_allocator>();
+    auto classes = spead2::size_class_memory_pool::power_of_two_classes(1000, 5000, 2, 0);
+    BOOST_REQUIRE_EQUAL(classes.size(), 4);
+    BOOST_CHECK_EQUAL(classes[0].size, 1024);
+    BOOST_CHECK_EQUAL(classes[3].size, 8192);
+    auto pool = std::make_shared<spead2::size_class_memory_pool>(classes, allocator);
+    pool->set_warn_on_empty(false);
+
+    pointer p1 = pool->allocate(100, nullptr);
+    pointer p2 = pool->allocate(1025, nullptr);
+    pointer p3 = pool->allocate(8193, nullptr);
+    BOOST_REQUIRE_EQUAL(allocator->records.size(), 3);
+    BOOST_CHECK_EQUAL(allocator->records[0].size, 1024);
+    BOOST_CHECK_EQUAL(allocator->records[1].size, 2048);
+    BOOST_CHECK_EQUAL(allocator->records[2].size, 8193);
+
+    // Freed memory goes back to its own class
+    std::uint8_t *ptr2 = p2.get();
+    p2.reset();
+    pointer p4 = pool->allocate(1024, nullptr);
+    pointer p5 = pool->allocate(2000, nullptr);
+    BOOST_CHECK_EQUAL(p5.get(), ptr2);
+    BOOST_CHECK_EQUAL(pool->get_stats(0).misses, 2);
+    BOOST_CHECK_EQUAL(pool->get_stats(1).hits, 1);
+    BOOST_CHECK_EQUAL(pool->get_stats(1).misses, 1);
+}
+
+BOOST_AUTO_TEST_CASE(size_class_memory_pool_validation)
+{
+    typedef spead2::size_class_memory_pool::size_class size_class;
+    using spead2::size_class_memory_pool;
+    BOOST_CHECK_THROW(size_class_memory_pool(std::vector<size_class>{}), std::invalid_argument);
+    BOOST_CHECK_THROW(size_class_memory_pool({size_class(2048, 1, 0), size_class(1024, 1, 0)}),
+                      std::invalid_argument);
+    BOOST_CHECK_THROW(size_class_memory_pool({size_class(1024, 1, 2)}), std::invalid_argument);
+    // low_water requires an io_service
+    BOOST_CHECK_THROW(size_class_memory_pool({size_class(1024, 2, 2, 1)}), std::invalid_argument);
+    spead2::thread_pool tpool;
+    size_class_memory_pool pool(tpool, {size_class(1024, 2, 2, 1)});
+    BOOST_CHECK_EQUAL(pool.get_num_classes(), 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()  // memory_pool
 BOOST_AUTO_TEST_SUITE_END()  // common
 
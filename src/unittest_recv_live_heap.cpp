@@ -28,6 +28,7 @@
 #include <algorithm>
 #include <cstdint>
 #include <spead2/recv_live_heap.h>
+#include <spead2/recv_heap.h>
 #include <spead2/recv_packet.h>
 #include <spead2/common_endian.h>
 
@@ -163,6 +164,51 @@ BOOST_AUTO_TEST_CASE(payload_ranges)
     BOOST_CHECK(!heap.add_payload_range(300, 360));
 }
 
+// Storage for the metadata of a frozen heap is reused by the next heap
+BOOST_AUTO_TEST_CASE(metadata_recycling)
+{
+    using spead2::recv::live_heap;
+    auto metadata = std::make_shared<spead2::recv::heap_metadata_pool>();
+    auto allocator = std::make_shared<spead2::memory_allocator>();
+    spead2::recv::packet_memcpy_function memcpy_function;
+
+    // Enough immediate items to need external storage for both the item
+    // pointers and the immediate values.
+    std::vector<std::uint8_t> pointers;
+    for (int i = 0; i < 12; i++)
+    {
+        item_pointer_t pointer = htobe<item_pointer_t>(
+            0x8000000000000000ULL | (item_pointer_t(0x1000 + i) << 48) | i);
+        const std::uint8_t *bytes = reinterpret_cast<const std::uint8_t *>(&pointer);
+        pointers.insert(pointers.end(), bytes, bytes + sizeof(pointer));
+    }
+    spead2::recv::packet_header packet = dummy_packet(1);
+    packet.n_items = 12;
+    packet.pointers = pointers.data();
+
+    const spead2::recv::item *items = nullptr;
+    const std::uint8_t *immediates = nullptr;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        live_heap heap(packet, 0, metadata);
+        BOOST_REQUIRE(heap.add_packet(packet, memcpy_function, *allocator));
+        BOOST_REQUIRE(heap.is_complete());
+        spead2::recv::heap frozen(std::move(heap));
+        BOOST_REQUIRE_EQUAL(frozen.get_items().size(), 12);
+        BOOST_CHECK_EQUAL(frozen.get_items()[11].immediate_value, 11);
+        if (pass == 0)
+        {
+            items = frozen.get_items().data();
+            immediates = frozen.get_items()[0].ptr;
+        }
+        else
+        {
+            BOOST_CHECK_EQUAL(frozen.get_items().data(), items);
+            BOOST_CHECK_EQUAL(frozen.get_items()[0].ptr, immediates);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()  // live_heap
 BOOST_AUTO_TEST_SUITE_END()  // recv
 
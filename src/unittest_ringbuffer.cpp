@@ -0,0 +1,417 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Unit tests for the ring buffer implementations.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <boost/test/unit_test.hpp>
+#include <boost/mpl/list.hpp>
+#include <spead2/common_ringbuffer.h>
+#include <spead2/common_ringbuffer_lockfree.h>
+#include <spead2/common_unbounded_queue.h>
+#include <spead2/common_semaphore.h>
+#include <spead2/common_thread_pool.h>
+#include <spead2/common_inproc.h>
+#include <spead2/recv_ring_stream.h>
+#include <spead2/recv_inproc.h>
+#include <spead2/send_heap.h>
+#include <spead2/send_inproc.h>
+
+namespace spead2
+{
+namespace unittest
+{
+
+BOOST_AUTO_TEST_SUITE(common)
+BOOST_AUTO_TEST_SUITE(ringbuffer)
+
+template<typename T>
+struct ringbuffer_types
+{
+    typedef boost::mpl::list<
+        spead2::ringbuffer<T>,
+        spead2::spsc_ringbuffer<T>,
+        spead2::mpmc_ringbuffer<T>> all;
+    typedef boost::mpl::list<
+        spead2::ringbuffer<T>,
+        spead2::mpmc_ringbuffer<T>> multi;
+};
+
+typedef std::unique_ptr<int> item_type;
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(non_blocking, R, ringbuffer_types<item_type>::all)
+{
+    R ring(2);
+    BOOST_CHECK_EQUAL(ring.capacity(), 2);
+    BOOST_CHECK_THROW(ring.try_pop(), spead2::ringbuffer_empty);
+    ring.try_push(item_type(new int(1)));
+    ring.try_emplace(new int(2));
+    BOOST_CHECK_EQUAL(ring.size(), 2);
+    BOOST_CHECK_THROW(ring.try_push(item_type(new int(3))), spead2::ringbuffer_full);
+    BOOST_CHECK_EQUAL(*ring.try_pop(), 1);
+    ring.try_push(item_type(new int(3)));
+    BOOST_CHECK_EQUAL(*ring.pop(), 2);
+    BOOST_CHECK_EQUAL(*ring.pop(), 3);
+    BOOST_CHECK_EQUAL(ring.size(), 0);
+}
+
+// Items already in the ring are delivered after a stop, then consumers are stopped
+BOOST_AUTO_TEST_CASE_TEMPLATE(stop, R, ringbuffer_types<item_type>::all)
+{
+    R ring(4);
+    ring.push(item_type(new int(1)));
+    ring.emplace(new int(2));
+    ring.stop();
+    BOOST_CHECK_THROW(ring.push(item_type(new int(3))), spead2::ringbuffer_stopped);
+    BOOST_CHECK_THROW(ring.try_push(item_type(new int(3))), spead2::ringbuffer_stopped);
+    BOOST_CHECK_EQUAL(*ring.pop(), 1);
+    BOOST_CHECK_EQUAL(*ring.try_pop(), 2);
+    BOOST_CHECK_THROW(ring.pop(), spead2::ringbuffer_stopped);
+    BOOST_CHECK_THROW(ring.try_pop(), spead2::ringbuffer_stopped);
+}
+
+// Stopping wakes up blocked consumers and producers
+BOOST_AUTO_TEST_CASE_TEMPLATE(stop_wakeup, R, ringbuffer_types<item_type>::all)
+{
+    R empty(1), full(1);
+    full.push(item_type(new int(1)));
+    auto consumer = std::async(std::launch::async, [&empty] { empty.pop(); });
+    auto producer = std::async(std::launch::async, [&full] { full.push(item_type(new int(2))); });
+    empty.stop();
+    full.stop();
+    BOOST_CHECK_THROW(consumer.get(), spead2::ringbuffer_stopped);
+    BOOST_CHECK_THROW(producer.get(), spead2::ringbuffer_stopped);
+}
+
+// Blocking transfer through a small ring preserves order
+BOOST_AUTO_TEST_CASE_TEMPLATE(ordered, R, ringbuffer_types<int>::all)
+{
+    constexpr int n = 100000;
+    R ring(4);
+    auto producer = std::async(std::launch::async, [&ring] {
+        for (int i = 0; i < n; i++)
+            ring.push(int(i));
+        ring.stop();
+    });
+    int expected = 0;
+    try
+    {
+        while (true)
+        {
+            int value = ring.pop();
+            if (value != expected)
+                BOOST_FAIL("expected " << expected << " but got " << value);
+            expected++;
+        }
+    }
+    catch (spead2::ringbuffer_stopped &)
+    {
+    }
+    producer.get();
+    BOOST_CHECK_EQUAL(expected, n);
+}
+
+// Every item pushed by several producers is popped exactly once
+BOOST_AUTO_TEST_CASE_TEMPLATE(multi, R, ringbuffer_types<int>::multi)
+{
+    constexpr int n_threads = 4;
+    constexpr int n = 20000;
+    R ring(8);
+    std::vector<std::future<void>> producers;
+    std::vector<std::future<std::vector<int>>> consumers;
+    for (int i = 0; i < n_threads; i++)
+    {
+        producers.push_back(std::async(std::launch::async, [&ring, i] {
+            for (int j = 0; j < n; j++)
+                ring.push(i * n + j);
+        }));
+        consumers.push_back(std::async(std::launch::async, [&ring] {
+            std::vector<int> seen;
+            try
+            {
+                while (true)
+                    seen.push_back(ring.pop());
+            }
+            catch (spead2::ringbuffer_stopped &)
+            {
+            }
+            return seen;
+        }));
+    }
+    for (auto &producer : producers)
+        producer.get();
+    ring.stop();
+    std::vector<int> count(n_threads * n);
+    for (auto &consumer : consumers)
+        for (int value : consumer.get())
+            count[value]++;
+    for (int i = 0; i < n_threads * n; i++)
+        if (count[i] != 1)
+            BOOST_FAIL("item " << i << " seen " << count[i] << " times");
+}
+
+// Batched pushes and pops transfer as many items as are available
+BOOST_AUTO_TEST_CASE_TEMPLATE(many, R, ringbuffer_types<int>::all)
+{
+    R ring(4);
+    std::vector<int> values{1, 2, 3};
+    ring.push_many(values.begin(), values.end());
+    BOOST_CHECK_EQUAL(ring.size(), 3);
+    BOOST_CHECK(ring.pop_many(0).empty());
+    std::vector<int> popped = ring.pop_many(2);
+    BOOST_CHECK_EQUAL_COLLECTIONS(popped.begin(), popped.end(), values.begin(), values.begin() + 2);
+    popped = ring.pop_many(10);
+    BOOST_CHECK_EQUAL_COLLECTIONS(popped.begin(), popped.end(), values.begin() + 2, values.end());
+    BOOST_CHECK(ring.pop_many(10, std::chrono::milliseconds(1)).empty());
+    ring.push(4);
+    ring.stop();
+    popped = ring.pop_many(10, std::chrono::seconds(0));
+    BOOST_REQUIRE_EQUAL(popped.size(), 1);
+    BOOST_CHECK_EQUAL(popped[0], 4);
+    BOOST_CHECK_THROW(ring.pop_many(10), spead2::ringbuffer_stopped);
+    BOOST_CHECK_THROW(ring.pop_many(10, std::chrono::seconds(1)), spead2::ringbuffer_stopped);
+    BOOST_CHECK_THROW(ring.push_many(values.begin(), values.end()), spead2::ringbuffer_stopped);
+}
+
+// Batches larger than the capacity are split, preserving order
+BOOST_AUTO_TEST_CASE_TEMPLATE(many_ordered, R, ringbuffer_types<int>::all)
+{
+    constexpr int n = 100000;
+    R ring(4);
+    auto producer = std::async(std::launch::async, [&ring] {
+        std::vector<int> values(7);
+        for (int i = 0; i < n; i += values.size())
+        {
+            values.resize(std::min(std::size_t(n - i), values.size()));
+            for (std::size_t j = 0; j < values.size(); j++)
+                values[j] = i + j;
+            ring.push_many(values.begin(), values.end());
+        }
+        ring.stop();
+    });
+    int expected = 0;
+    try
+    {
+        while (true)
+        {
+            for (int value : ring.pop_many(3))
+            {
+                if (value != expected)
+                    BOOST_FAIL("expected " << expected << " but got " << value);
+                expected++;
+            }
+        }
+    }
+    catch (spead2::ringbuffer_stopped &)
+    {
+    }
+    producer.get();
+    BOOST_CHECK_EQUAL(expected, n);
+}
+
+#if SPEAD2_USE_FUTEX
+// The futex semaphore works as the semaphore type of ringbuffer and unbounded_queue
+BOOST_AUTO_TEST_CASE(futex_semaphores)
+{
+    constexpr int n = 100000;
+    spead2::ringbuffer<int, spead2::semaphore_futex, spead2::semaphore_futex> ring(4);
+    spead2::unbounded_queue<int, spead2::semaphore_futex> queue;
+    auto producer = std::async(std::launch::async, [&] {
+        for (int i = 0; i < n; i++)
+            ring.push(int(i));
+        ring.stop();
+    });
+    auto forwarder = std::async(std::launch::async, [&] {
+        try
+        {
+            while (true)
+                queue.push(ring.pop());
+        }
+        catch (spead2::ringbuffer_stopped &)
+        {
+            queue.stop();
+        }
+    });
+    int expected = 0;
+    try
+    {
+        while (true)
+        {
+            int value = queue.pop();
+            if (value != expected)
+                BOOST_FAIL("expected " << expected << " but got " << value);
+            expected++;
+        }
+    }
+    catch (spead2::ringbuffer_stopped &)
+    {
+    }
+    producer.get();
+    forwarder.get();
+    BOOST_CHECK_EQUAL(expected, n);
+}
+#endif
+
+// Items from several producers all arrive, in order per producer
+BOOST_AUTO_TEST_CASE(mpsc_queue_fan_in)
+{
+    constexpr int n_threads = 4;
+    constexpr int n = 50000;
+    spead2::mpsc_unbounded_queue<std::pair<int, int>> queue;
+    std::vector<std::future<void>> producers;
+    for (int i = 0; i < n_threads; i++)
+        producers.push_back(std::async(std::launch::async, [&queue, i] {
+            for (int j = 0; j < n; j++)
+                queue.emplace(i, j);
+        }));
+    auto stopper = std::async(std::launch::async, [&] {
+        for (auto &producer : producers)
+            producer.get();
+        queue.stop();
+    });
+    std::vector<int> expected(n_threads);
+    try
+    {
+        while (true)
+        {
+            std::pair<int, int> value = queue.pop();
+            if (value.second != expected[value.first])
+                BOOST_FAIL("expected " << expected[value.first] << " but got " << value.second);
+            expected[value.first]++;
+        }
+    }
+    catch (spead2::ringbuffer_stopped &)
+    {
+    }
+    stopper.get();
+    for (int i = 0; i < n_threads; i++)
+        BOOST_CHECK_EQUAL(expected[i], n);
+}
+
+// A push that races with stop either throws or is delivered
+BOOST_AUTO_TEST_CASE(mpsc_queue_stop_race)
+{
+    constexpr int n_threads = 4;
+    for (int pass = 0; pass < 100; pass++)
+    {
+        spead2::mpsc_unbounded_queue<int> queue;
+        std::atomic<int> pushed{0};
+        std::vector<std::future<void>> producers;
+        for (int i = 0; i < n_threads; i++)
+            producers.push_back(std::async(std::launch::async, [&] {
+                try
+                {
+                    while (true)
+                    {
+                        queue.push(1);
+                        pushed++;
+                    }
+                }
+                catch (spead2::ringbuffer_stopped &)
+                {
+                }
+            }));
+        // Let the producers get going, then stop them mid-push
+        while (pushed < 100 * (pass + 1))
+            std::this_thread::yield();
+        queue.stop();
+        int popped = 0;
+        try
+        {
+            while (true)
+                popped += queue.pop();
+        }
+        catch (spead2::ringbuffer_stopped &)
+        {
+        }
+        for (auto &producer : producers)
+            producer.get();
+        BOOST_REQUIRE_EQUAL(popped, pushed.load());
+    }
+}
+
+static bool fd_readable(int fd)
+{
+    pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+// The file descriptor is only signalled after the consumer goes idle
+BOOST_AUTO_TEST_CASE(mpsc_queue_fd)
+{
+    spead2::mpsc_unbounded_queue<item_type, spead2::semaphore_fd> queue;
+    int fd = queue.get_data_sem().get_fd();
+    BOOST_CHECK(!fd_readable(fd));
+    queue.push(item_type(new int(1)));
+    BOOST_CHECK(fd_readable(fd));
+    BOOST_CHECK_EQUAL(*queue.try_pop(), 1);
+    BOOST_CHECK_THROW(queue.try_pop(), spead2::ringbuffer_empty);
+    BOOST_CHECK(!fd_readable(fd));
+    queue.push(item_type(new int(2)));
+    queue.push(item_type(new int(3)));
+    BOOST_CHECK(fd_readable(fd));
+    BOOST_CHECK_EQUAL(*queue.try_pop(), 2);
+    BOOST_CHECK_EQUAL(*queue.pop(), 3);
+    queue.push(item_type(new int(4)));
+    BOOST_CHECK_EQUAL(*queue.try_pop(), 4);
+    BOOST_CHECK_THROW(queue.try_pop(), spead2::ringbuffer_empty);
+    BOOST_CHECK(!fd_readable(fd));
+    queue.push(item_type(new int(5)));
+    queue.stop();
+    BOOST_CHECK_THROW(queue.push(item_type(new int(6))), spead2::ringbuffer_stopped);
+    BOOST_CHECK_EQUAL(*queue.try_pop(), 5);
+    BOOST_CHECK_THROW(queue.try_pop(), spead2::ringbuffer_stopped);
+    BOOST_CHECK(fd_readable(fd));
+    BOOST_CHECK_THROW(queue.pop(), spead2::ringbuffer_stopped);
+}
+
+// The lock-free ring buffers can be used by ring_stream
+BOOST_AUTO_TEST_CASE(ring_stream)
+{
+    spead2::thread_pool tp;
+    std::shared_ptr<spead2::inproc_queue> queue = std::make_shared<spead2::inproc_queue>();
+    spead2::recv::ring_stream<spead2::spsc_ringbuffer<spead2::recv::live_heap>> recv_stream(tp);
+    recv_stream.emplace_reader<spead2::recv::inproc_reader>(queue);
+
+    spead2::send::inproc_stream send_stream(tp, queue);
+    spead2::send::heap heap;
+    heap.add_item(0x1000, 1234);
+    send_stream.async_send_heap(heap, [](const boost::system::error_code &, item_pointer_t) {});
+    send_stream.flush();
+    queue->stop();
+
+    std::vector<spead2::recv::heap> received = recv_stream.pop_many(10);
+    BOOST_REQUIRE_EQUAL(received.size(), 1);
+    BOOST_REQUIRE_EQUAL(received[0].get_items().size(), 1);
+    BOOST_CHECK_EQUAL(received[0].get_items()[0].immediate_value, 1234);
+    BOOST_CHECK_THROW(recv_stream.pop(), spead2::ringbuffer_stopped);
+}
+
+BOOST_AUTO_TEST_SUITE_END()  // ringbuffer
+BOOST_AUTO_TEST_SUITE_END()  // common
+
+}} // namespace spead2::unittest
@@ -24,6 +24,8 @@
 #include <boost/mpl/list.hpp>
 #include <spead2/common_semaphore.h>
 #include <future>
+#include <chrono>
+#include <thread>
 #include <utility>
 #include <cstring>
 #include <cerrno>
@@ -40,6 +42,10 @@ BOOST_AUTO_TEST_SUITE(semaphore)
 typedef boost::mpl::list<
     spead2::semaphore_spin,
     spead2::semaphore_pipe,
+    spead2::semaphore_adaptive,
+#if SPEAD2_USE_FUTEX
+    spead2::semaphore_futex,
+#endif
 #if SPEAD2_USE_EVENTFD
     spead2::semaphore_eventfd,
 #endif
@@ -106,6 +112,22 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(single_thread, T, semaphore_types)
     BOOST_CHECK_EQUAL(semaphore_get_value(sem), 1);
 }
 
+BOOST_AUTO_TEST_CASE_TEMPLATE(get_until, T, semaphore_types)
+{
+    typedef std::chrono::steady_clock clock;
+    T sem(1);
+    BOOST_CHECK(semaphore_get_until(sem, clock::now()));
+    auto start = clock::now();
+    BOOST_CHECK(!semaphore_get_until(sem, start + std::chrono::milliseconds(20)));
+    BOOST_CHECK(clock::now() >= start + std::chrono::milliseconds(20));
+    auto worker = std::async(std::launch::async, [&sem] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        sem.put();
+    });
+    BOOST_CHECK(semaphore_get_until(sem, clock::now() + std::chrono::seconds(10)));
+    worker.get();
+}
+
 BOOST_AUTO_TEST_CASE_TEMPLATE(multi_thread, T, semaphore_types)
 {
     const std::int64_t N = 100000;
@@ -168,6 +190,27 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(poll_fd, T, semaphore_fd_types)
     BOOST_CHECK_EQUAL(result, 0);
 }
 
+// The fd is readable exactly when the semaphore is positive
+BOOST_AUTO_TEST_CASE(poll_fd_adaptive)
+{
+    spead2::semaphore_adaptive sem(1);
+    pollfd fds[1];
+    std::memset(&fds, 0, sizeof(fds));
+    fds[0].fd = sem.get_fd();
+    fds[0].events = POLLIN;
+    BOOST_CHECK_EQUAL(poll_restart(fds, 1, 0), 1);
+    sem.put();
+    semaphore_get(sem);
+    BOOST_CHECK_EQUAL(poll_restart(fds, 1, 0), 1);
+    semaphore_get(sem);
+    BOOST_CHECK_EQUAL(poll_restart(fds, 1, 0), 0);
+    sem.put();
+    BOOST_CHECK_EQUAL(poll_restart(fds, 1, 0), 1);
+    BOOST_CHECK_EQUAL(semaphore_try_get(sem), 0);
+    BOOST_CHECK_EQUAL(poll_restart(fds, 1, 0), 0);
+    BOOST_CHECK_EQUAL(semaphore_try_get(sem), -1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()  // semaphore
 BOOST_AUTO_TEST_SUITE_END()  // common
 
@@ -20,7 +20,10 @@
  * Unit tests for send_heap.
  */
 
+#include <memory>
+#include <cstdint>
 #include <boost/test/unit_test.hpp>
+#include <spead2/common_memory_pool.h>
 #include <spead2/send_heap.h>
 
 namespace spead2
@@ -55,6 +58,24 @@ BOOST_AUTO_TEST_CASE(get_item)
     BOOST_CHECK_EQUAL(item2.data.buffer.ptr, (const unsigned char *) &value2);
 }
 
+// Memory allocated through the heap goes back to the pool with the heap
+BOOST_AUTO_TEST_CASE(allocate)
+{
+    auto pool = std::make_shared<spead2::memory_pool>(0, 1024, 2, 1);
+    pool->set_warn_on_empty(false);
+    std::uint8_t *ptr;
+    {
+        spead2::send::heap h;
+        ptr = h.allocate(pool, 100);
+        h.add_item(0x1234, ptr, 100, false);
+        // The only pooled buffer is in use, so this comes from the base allocator
+        spead2::memory_allocator::pointer other = pool->allocate(100, nullptr);
+        BOOST_CHECK(other.get() != ptr);
+    }
+    spead2::memory_allocator::pointer recycled = pool->allocate(100, nullptr);
+    BOOST_CHECK_EQUAL(recycled.get(), ptr);
+}
+
 BOOST_AUTO_TEST_SUITE_END()  // heap
 BOOST_AUTO_TEST_SUITE_END()  // send
 
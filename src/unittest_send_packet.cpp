@@ -0,0 +1,277 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Unit tests for send_packet.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/buffers_iterator.hpp>
+#include <boost/test/unit_test.hpp>
+#include <spead2/send_heap.h>
+#include <spead2/send_packet.h>
+
+namespace spead2
+{
+namespace unittest
+{
+
+static constexpr std::size_t packet_size = 256;
+
+/// Generate all the packets for a heap and return their contents
+static std::vector<std::string> encode(const spead2::send::heap &h, item_pointer_t cnt)
+{
+    std::vector<std::string> out;
+    spead2::send::packet_generator gen(h, cnt, packet_size);
+    std::unique_ptr<std::uint64_t[]> scratch(
+        new std::uint64_t[spead2::send::packet_generator::max_header_size(packet_size) / 8]);
+    spead2::send::packet pkt;
+    while (gen.has_next_packet())
+    {
+        gen.next_packet(pkt, reinterpret_cast<std::uint8_t *>(scratch.get()));
+        out.emplace_back(boost::asio::buffers_begin(pkt.buffers),
+                         boost::asio::buffers_end(pkt.buffers));
+    }
+    return out;
+}
+
+/**
+ * Like @ref encode, but generate the packets in batches of (up to) @a batch
+ * with @ref packet_generator::next_packets, and check that the headers of
+ * each batch are contiguous.
+ */
+static std::vector<std::string> encode_batched(
+    const spead2::send::heap &h, item_pointer_t cnt, std::size_t batch)
+{
+    std::vector<std::string> out;
+    spead2::send::packet_generator gen(h, cnt, packet_size);
+    std::unique_ptr<std::uint64_t[]> scratch(
+        new std::uint64_t[batch * spead2::send::packet_generator::max_header_size(packet_size) / 8]);
+    std::vector<spead2::send::packet> pkts(batch);
+    std::vector<spead2::send::packet *> ptrs;
+    for (auto &pkt : pkts)
+        ptrs.push_back(&pkt);
+    while (gen.has_next_packet())
+    {
+        std::uint8_t *headers = reinterpret_cast<std::uint8_t *>(scratch.get());
+        const std::uint8_t *pos = headers;
+        std::size_t n = gen.next_packets(ptrs.data(), batch, headers);
+        BOOST_REQUIRE_GT(n, 0);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            const auto &pkt = pkts[i];
+            // Each header is followed by room for an item pointer of padding
+            BOOST_CHECK(boost::asio::buffer_cast<const std::uint8_t *>(pkt.buffers[0]) == pos);
+            pos += boost::asio::buffer_size(pkt.buffers[0]) + sizeof(item_pointer_t);
+            out.emplace_back(boost::asio::buffers_begin(pkt.buffers),
+                             boost::asio::buffers_end(pkt.buffers));
+        }
+        BOOST_CHECK(headers == pos);
+    }
+    return out;
+}
+
+struct heap_fixture
+{
+    std::vector<std::uint8_t> large, small;
+    spead2::send::heap h;
+
+    explicit heap_fixture(std::uint8_t seed, s_item_pointer_t immediate = 0x1234)
+        : large(1000), small(3)
+    {
+        for (std::size_t i = 0; i < large.size(); i++)
+            large[i] = seed + i;
+        for (std::size_t i = 0; i < small.size(); i++)
+            small[i] = seed * 3 + i;
+        h.add_item(0x1000, immediate);
+        h.add_item(0x1001, large, false);
+        h.add_item(0x1002, small, true);
+    }
+};
+
+/**
+ * Heap with the same content as @ref heap_fixture, but with the values of
+ * the addressed and small items split into fragments (including empty ones).
+ */
+struct fragmented_fixture : public heap_fixture
+{
+    std::vector<spead2::send::item_fragment> large_fragments, small_fragments;
+
+    explicit fragmented_fixture(std::uint8_t seed, s_item_pointer_t immediate = 0x1234)
+        : heap_fixture(seed, immediate)
+    {
+        large_fragments = {
+            {large.data(), 0},
+            {large.data(), 100},
+            {large.data() + 100, 1},
+            {large.data() + 101, 0},
+            {large.data() + 101, 499},
+            {large.data() + 600, 400}
+        };
+        small_fragments = {{small.data(), 1}, {small.data() + 1, 2}};
+        h.get_item(1) = spead2::send::item(0x1001, large_fragments, false);
+        h.get_item(2) = spead2::send::item(0x1002, small_fragments, true);
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(send)
+BOOST_AUTO_TEST_SUITE(packet_generator)
+
+// Fragmented items are sent as if they were contiguous
+BOOST_AUTO_TEST_CASE(fragments)
+{
+    heap_fixture f(4);
+    fragmented_fixture ff(4);
+    BOOST_CHECK_EQUAL(ff.h.get_item(1).data.buffer.length, f.large.size());
+    BOOST_CHECK_EQUAL(ff.h.get_item(1).num_fragments(), 6);
+    BOOST_CHECK(encode(ff.h, 5) == encode(f.h, 5));
+}
+
+// Batched generation produces the same packets as generating them singly
+BOOST_AUTO_TEST_CASE(batch)
+{
+    fragmented_fixture f(4);
+    auto expected = encode(f.h, 5);
+    BOOST_CHECK_GT(expected.size(), 3);
+    for (std::size_t batch : {1, 2, 3, 100})
+        BOOST_CHECK(encode_batched(f.h, 5, batch) == expected);
+
+    // Heap that needs padding
+    spead2::send::heap padded;
+    padded.add_item(0x1000, 1);
+    padded.add_item(0x1001, 2);
+    BOOST_CHECK(encode_batched(padded, 6, 4) == encode(padded, 6));
+
+    // Heap whose packets all carry item pointers
+    f.h.set_repeat_pointers(true);
+    BOOST_CHECK(encode_batched(f.h, 7, 4) == encode(f.h, 7));
+
+    // Heap with a plan
+    heap_fixture planned(9);
+    planned.h.set_plan(std::make_shared<spead2::send::heap_plan>(planned.h, packet_size));
+    BOOST_CHECK(encode_batched(planned.h, 8, 4) == encode(planned.h, 8));
+}
+
+BOOST_AUTO_TEST_SUITE_END()  // packet_generator
+
+BOOST_AUTO_TEST_SUITE(heap_plan)
+
+// A plan must produce exactly the same packets as the normal generator
+BOOST_AUTO_TEST_CASE(matches_generator)
+{
+    heap_fixture tmpl(1);
+    auto plan = std::make_shared<spead2::send::heap_plan>(tmpl.h, packet_size);
+    BOOST_CHECK_GT(plan->get_n_packets(), 1);
+
+    heap_fixture f(7, 0x5678);
+    auto expected = encode(f.h, 12345);
+    BOOST_CHECK(plan->matches(f.h, packet_size));
+    f.h.set_plan(plan);
+    BOOST_CHECK(encode(f.h, 12345) == expected);
+}
+
+// Heap with no addressed items, which needs padding
+BOOST_AUTO_TEST_CASE(padding)
+{
+    spead2::send::heap h;
+    h.add_item(0x1000, 1);
+    h.add_item(0x1001, 2);
+    auto expected = encode(h, 3);
+    h.set_plan(std::make_shared<spead2::send::heap_plan>(h, packet_size));
+    h.get_item(0).data.immediate = 4;
+    h.get_item(1).data.immediate = 5;
+    h.set_plan(nullptr);
+    auto expected2 = encode(h, 3);
+    h.set_plan(std::make_shared<spead2::send::heap_plan>(h, packet_size));
+    BOOST_CHECK(encode(h, 3) == expected2);
+    BOOST_CHECK(expected != expected2);
+}
+
+BOOST_AUTO_TEST_CASE(repeat_pointers)
+{
+    heap_fixture f(2);
+    f.h.set_repeat_pointers(true);
+    auto expected = encode(f.h, 1);
+    f.h.set_plan(std::make_shared<spead2::send::heap_plan>(f.h, packet_size));
+    BOOST_CHECK(encode(f.h, 1) == expected);
+}
+
+// A plan for a different layout must be ignored
+BOOST_AUTO_TEST_CASE(mismatch)
+{
+    heap_fixture tmpl(1);
+    auto plan = std::make_shared<spead2::send::heap_plan>(tmpl.h, packet_size);
+    heap_fixture f(3);
+    f.large.resize(500);
+    f.h.get_item(1).data.buffer.length = f.large.size();
+    BOOST_CHECK(!plan->matches(f.h, packet_size));
+    BOOST_CHECK(!plan->matches(tmpl.h, packet_size + 8));
+    auto expected = encode(f.h, 1);
+    f.h.set_plan(plan);
+    BOOST_CHECK(encode(f.h, 1) == expected);
+}
+
+// A snapshot plan sends the values captured when it was built
+BOOST_AUTO_TEST_CASE(snapshot)
+{
+    heap_fixture f(5);
+    auto expected = encode(f.h, 9);
+    auto plan = std::make_shared<spead2::send::heap_plan>(f.h, packet_size, true);
+    BOOST_CHECK(plan->is_snapshot());
+    f.h.set_plan(plan);
+    for (auto &x : f.large)
+        x = 0;
+    f.small[0] = 0;
+    f.h.get_item(0).data.immediate = 0;
+    BOOST_CHECK(encode(f.h, 9) == expected);
+}
+
+// Plans record the fragment sizes, and only match heaps with the same ones
+BOOST_AUTO_TEST_CASE(fragments)
+{
+    fragmented_fixture tmpl(1);
+    auto plan = std::make_shared<spead2::send::heap_plan>(tmpl.h, packet_size);
+
+    fragmented_fixture ff(6, 0x5678);
+    auto expected = encode(ff.h, 2);
+    BOOST_CHECK(plan->matches(ff.h, packet_size));
+    ff.h.set_plan(plan);
+    BOOST_CHECK(encode(ff.h, 2) == expected);
+
+    heap_fixture f(6, 0x5678);
+    BOOST_CHECK(!plan->matches(f.h, packet_size));
+    ff.large_fragments[1].length--;
+    ff.large_fragments[2].length++;
+    BOOST_CHECK(!plan->matches(ff.h, packet_size));
+
+    auto snapshot = std::make_shared<spead2::send::heap_plan>(tmpl.h, packet_size, true);
+    expected = encode(tmpl.h, 3);
+    tmpl.h.set_plan(snapshot);
+    for (auto &x : tmpl.large)
+        x = 0;
+    BOOST_CHECK(encode(tmpl.h, 3) == expected);
+}
+
+BOOST_AUTO_TEST_SUITE_END()  // heap_plan
+BOOST_AUTO_TEST_SUITE_END()  // send
+
+}} // namespace spead2::unittest
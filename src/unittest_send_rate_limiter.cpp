@@ -0,0 +1,153 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Unit tests for send_rate_limiter.
+ */
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <cstdint>
+#include <boost/test/unit_test.hpp>
+#include <spead2/common_thread_pool.h>
+#include <spead2/send_heap.h>
+#include <spead2/send_rate_limiter.h>
+#include <spead2/send_streambuf.h>
+
+namespace spead2
+{
+namespace unittest
+{
+
+typedef std::chrono::steady_clock clock_type;
+
+static constexpr double rate = 1e7;
+static constexpr std::size_t heap_size = 300000;
+
+static spead2::send::stream_config make_config(
+    std::shared_ptr<spead2::send::shared_rate_limiter> limiter, double weight, double min_rate = 0.0)
+{
+    spead2::send::stream_config config(1024, 0.0, 4096);
+    config.set_rate_limiter(std::move(limiter));
+    config.set_rate_weight(weight);
+    config.set_min_rate(min_rate);
+    return config;
+}
+
+/// Send a heap, with the completion time reported through the returned future
+static std::future<clock_type::time_point> start_send(
+    spead2::send::stream &stream, const spead2::send::heap &h)
+{
+    auto promise = std::make_shared<std::promise<clock_type::time_point>>();
+    auto handler = [promise](const boost::system::error_code &ec, std::size_t)
+    {
+        BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+        promise->set_value(clock_type::now());
+    };
+    stream.async_send_heap(h, handler);
+    return promise->get_future();
+}
+
+BOOST_AUTO_TEST_SUITE(send)
+BOOST_AUTO_TEST_SUITE(rate_limiter)
+
+// Busy streams divide the rate by weight, and never exceed it in total
+BOOST_AUTO_TEST_CASE(weighted)
+{
+    auto limiter = std::make_shared<spead2::send::shared_rate_limiter>(rate);
+    spead2::thread_pool tp(2);
+    std::stringbuf sb_light, sb_heavy;
+    spead2::send::streambuf_stream light(tp, sb_light, make_config(limiter, 1.0));
+    spead2::send::streambuf_stream heavy(tp, sb_heavy, make_config(limiter, 3.0));
+    BOOST_CHECK_EQUAL(limiter->get_num_streams(), 2);
+
+    std::vector<std::uint8_t> payload(heap_size);
+    spead2::send::heap h;
+    h.add_item(0x1234, payload, false);
+    auto start = clock_type::now();
+    auto light_done = start_send(light, h);
+    auto heavy_done = start_send(heavy, h);
+    auto light_time = light_done.get();
+    auto heavy_time = heavy_done.get();
+    BOOST_CHECK(heavy_time < light_time);
+    std::chrono::duration<double> elapsed = light_time - start;
+    BOOST_CHECK_GE(elapsed.count(), 2 * heap_size / rate * 0.95);
+    light.flush();
+    heavy.flush();
+    BOOST_CHECK_EQUAL(limiter->get_num_active(), 0);
+}
+
+// An idle stream does not hold on to its share
+BOOST_AUTO_TEST_CASE(redistribute)
+{
+    typedef spead2::send::shared_rate_limiter::member member;
+    spead2::send::shared_rate_limiter limiter(rate);
+    member busy, idle;
+    limiter.attach(busy, 1.0, 0.0);
+    limiter.attach(idle, 1.0, rate / 2);
+    BOOST_CHECK_EQUAL(limiter.get_num_active(), 0);
+    // With the idle stream's share withheld, this would be rate / 2
+    BOOST_CHECK_CLOSE(limiter.get_share(busy), rate, 1e-9);
+
+    limiter.set_active(idle, true);
+    BOOST_CHECK_EQUAL(limiter.get_num_active(), 1);
+    BOOST_CHECK_CLOSE(limiter.get_share(busy), rate / 4, 1e-9);
+    limiter.set_active(busy, true);
+    limiter.set_active(busy, true);   // no-op
+    BOOST_CHECK_EQUAL(limiter.get_num_active(), 2);
+    BOOST_CHECK_CLOSE(limiter.get_share(busy), rate / 4, 1e-9);
+    BOOST_CHECK_CLOSE(limiter.get_share(idle), rate * 3 / 4, 1e-9);
+
+    limiter.set_active(idle, false);
+    BOOST_CHECK_EQUAL(limiter.get_num_active(), 1);
+    BOOST_CHECK_CLOSE(limiter.get_share(busy), rate, 1e-9);
+    limiter.detach(busy);
+    limiter.detach(idle);
+    BOOST_CHECK_EQUAL(limiter.get_num_streams(), 0);
+    BOOST_CHECK_EQUAL(limiter.get_num_active(), 0);
+    BOOST_CHECK_EQUAL(limiter.get_reserved_rate(), 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(validation)
+{
+    BOOST_CHECK_THROW(spead2::send::shared_rate_limiter(0.0), std::invalid_argument);
+    auto limiter = std::make_shared<spead2::send::shared_rate_limiter>(rate);
+    spead2::thread_pool tp;
+    std::stringbuf sb1, sb2;
+    {
+        spead2::send::streambuf_stream stream1(tp, sb1, make_config(limiter, 1.0, rate * 0.75));
+        BOOST_CHECK_EQUAL(limiter->get_reserved_rate(), rate * 0.75);
+        BOOST_CHECK_THROW(
+            spead2::send::streambuf_stream(tp, sb2, make_config(limiter, 1.0, rate * 0.5)),
+            std::invalid_argument);
+        BOOST_CHECK_EQUAL(limiter->get_num_streams(), 1);
+    }
+    BOOST_CHECK_EQUAL(limiter->get_num_streams(), 0);
+    spead2::send::stream_config config;
+    BOOST_CHECK_THROW(config.set_rate_weight(0.0), std::invalid_argument);
+    BOOST_CHECK_THROW(config.set_min_rate(-1.0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END()  // rate_limiter
+BOOST_AUTO_TEST_SUITE_END()  // send
+
+}} // namespace spead2::unittest
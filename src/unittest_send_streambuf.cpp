@@ -22,8 +22,19 @@
 
 #include <array>
 #include <utility>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <cstdint>
 #include <boost/test/unit_test.hpp>
+#include <spead2/common_memory_pool.h>
 #include <spead2/send_streambuf.h>
+#include <spead2/send_packet.h>
+#include <spead2/recv_packet.h>
 
 namespace spead2
 {
@@ -72,6 +83,418 @@ BOOST_AUTO_TEST_CASE(send_fail)
     BOOST_CHECK_EQUAL(result.second, 0);
 }
 
+/* Send heaps from several threads at once, with a queue that is small enough
+ * that some of them are rejected. Every heap must either be sent or
+ * reported as would_block, and the automatic cnts must be sent in order
+ * without gaps.
+ */
+BOOST_AUTO_TEST_CASE(concurrent_producers)
+{
+    constexpr int n_threads = 4;
+    constexpr int n_heaps = 1000;
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::streambuf_stream stream(
+        tp, sb, spead2::send::stream_config(1024, 0.0, spead2::send::stream_config::default_burst_size, 8));
+    spead2::send::heap h;
+    h.add_item(0x1234, 0x5678);
+
+    std::atomic<int> n_sent{0}, n_dropped{0}, n_accepted{0};
+    std::atomic<std::size_t> bytes{0};
+    auto handler = [&](const boost::system::error_code &ec, std::size_t bytes_transferred)
+    {
+        if (ec == boost::asio::error::would_block)
+            n_dropped++;
+        else if (!ec)
+        {
+            bytes += bytes_transferred;
+            n_sent++;
+        }
+    };
+    std::vector<std::future<void>> producers;
+    for (int i = 0; i < n_threads; i++)
+        producers.push_back(std::async(std::launch::async, [&]
+        {
+            for (int j = 0; j < n_heaps; j++)
+                if (stream.async_send_heap(h, handler))
+                    n_accepted++;
+        }));
+    for (auto &f : producers)
+        f.get();
+    stream.flush();
+    // Handlers are posted, so may run slightly after flush returns
+    while (n_sent + n_dropped < n_threads * n_heaps)
+        std::this_thread::yield();
+    BOOST_CHECK_EQUAL(n_sent.load(), n_accepted.load());
+    BOOST_CHECK_EQUAL(n_sent + n_dropped, n_threads * n_heaps);
+    BOOST_CHECK_GT(n_sent.load(), 0);
+    BOOST_CHECK_EQUAL(bytes.load(), sb.str().size());
+
+    const std::string data = sb.str();
+    const std::uint8_t *ptr = reinterpret_cast<const std::uint8_t *>(data.data());
+    std::size_t remaining = data.size();
+    s_item_pointer_t expected_cnt = 1;
+    while (remaining > 0)
+    {
+        spead2::recv::packet_header header;
+        std::size_t size = spead2::recv::decode_packet(header, ptr, remaining);
+        BOOST_REQUIRE_GT(size, 0);
+        BOOST_REQUIRE_EQUAL(header.heap_cnt, expected_cnt);
+        expected_cnt++;
+        ptr += size;
+        remaining -= size;
+    }
+    BOOST_CHECK_EQUAL(expected_cnt - 1, n_sent.load());
+}
+
+/* set_cnt_sequence only affects heaps enqueued after it, even if earlier
+ * heaps have not started to be sent. Explicit cnts do not use up automatic
+ * ones.
+ */
+BOOST_AUTO_TEST_CASE(cnt_sequence)
+{
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::streambuf_stream stream(
+        tp, sb, spead2::send::stream_config(1024, 0.0, spead2::send::stream_config::default_burst_size, 8));
+    spead2::send::heap h;
+    h.add_item(0x1234, 0x5678);
+
+    std::promise<void> done;
+    std::atomic<int> n_failed{0};
+    auto handler = [&](const boost::system::error_code &ec, std::size_t)
+    {
+        if (ec)
+            n_failed++;
+    };
+    BOOST_REQUIRE(stream.async_send_heap(h, handler));
+    BOOST_REQUIRE(stream.async_send_heap(h, handler, 50));
+    BOOST_REQUIRE(stream.async_send_heap(h, handler));
+    stream.set_cnt_sequence(100, 5);
+    BOOST_REQUIRE(stream.async_send_heap(h, handler));
+    BOOST_REQUIRE(stream.async_send_heap(h, [&](const boost::system::error_code &ec, std::size_t)
+    {
+        handler(ec, 0);
+        done.set_value();
+    }));
+    done.get_future().get();
+    BOOST_CHECK_EQUAL(n_failed.load(), 0);
+
+    const std::string data = sb.str();
+    const std::uint8_t *ptr = reinterpret_cast<const std::uint8_t *>(data.data());
+    std::size_t remaining = data.size();
+    std::vector<s_item_pointer_t> cnts;
+    while (remaining > 0)
+    {
+        spead2::recv::packet_header header;
+        std::size_t size = spead2::recv::decode_packet(header, ptr, remaining);
+        BOOST_REQUIRE_GT(size, 0);
+        cnts.push_back(header.heap_cnt);
+        ptr += size;
+        remaining -= size;
+    }
+    std::vector<s_item_pointer_t> expected{1, 50, 2, 100, 105};
+    BOOST_CHECK_EQUAL_COLLECTIONS(cnts.begin(), cnts.end(), expected.begin(), expected.end());
+}
+
+/* Several threads send and flush repeatedly. A heap published while the
+ * sending thread is going idle must still be sent, or flush would hang.
+ */
+BOOST_AUTO_TEST_CASE(concurrent_flush)
+{
+    constexpr int n_threads = 4;
+    constexpr int n_rounds = 10000;
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::streambuf_stream stream(
+        tp, sb, spead2::send::stream_config(1024, 0.0, spead2::send::stream_config::default_burst_size, 64));
+    spead2::send::heap h;
+    h.add_item(0x1234, 0x5678);
+
+    std::atomic<int> n_sent{0}, n_accepted{0};
+    auto handler = [&](const boost::system::error_code &ec, std::size_t)
+    {
+        if (!ec)
+            n_sent++;
+    };
+    std::vector<std::future<void>> producers;
+    for (int i = 0; i < n_threads; i++)
+        producers.push_back(std::async(std::launch::async, [&]
+        {
+            for (int j = 0; j < n_rounds; j++)
+            {
+                if (stream.async_send_heap(h, handler))
+                    n_accepted++;
+                stream.flush();
+            }
+        }));
+    for (auto &f : producers)
+        f.get();
+    stream.flush();
+    // Handlers are posted, so may run slightly after flush returns
+    while (n_sent < n_accepted)
+        std::this_thread::yield();
+    BOOST_CHECK_EQUAL(n_accepted.load(), n_threads * n_rounds);
+}
+
+// Send a group of heaps with a single completion
+BOOST_AUTO_TEST_CASE(send_heaps)
+{
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::streambuf_stream stream(
+        tp, sb, spead2::send::stream_config(1024, 0.0, spead2::send::stream_config::default_burst_size, 4));
+    std::vector<std::uint8_t> payload(3000);
+    spead2::send::heap h1, h2;
+    h1.add_item(0x1234, 0x5678);
+    h2.add_item(0x1235, payload, false);
+
+    std::promise<std::vector<spead2::send::heap_result>> result_promise;
+    auto handler = [&](const std::vector<spead2::send::heap_result> &results)
+    {
+        result_promise.set_value(results);
+    };
+    std::vector<spead2::send::heap_reference> heaps{{h1}, {h2, 100}, {h1}};
+    BOOST_CHECK(stream.async_send_heaps(heaps, handler));
+    auto results = result_promise.get_future().get();
+    BOOST_REQUIRE_EQUAL(results.size(), 3);
+    std::size_t total = 0;
+    for (const auto &result : results)
+    {
+        BOOST_CHECK_EQUAL(result.ec, boost::system::error_code());
+        total += result.bytes_transferred;
+    }
+    BOOST_CHECK_GT(results[1].bytes_transferred, payload.size());
+    BOOST_CHECK_EQUAL(total, sb.str().size());
+
+    // Too many heaps to fit in the queue
+    std::promise<std::vector<spead2::send::heap_result>> fail_promise;
+    std::vector<spead2::send::heap_reference> too_many(5, spead2::send::heap_reference(h1));
+    BOOST_CHECK(!stream.async_send_heaps(too_many, [&](const std::vector<spead2::send::heap_result> &results)
+    {
+        fail_promise.set_value(results);
+    }));
+    results = fail_promise.get_future().get();
+    BOOST_REQUIRE_EQUAL(results.size(), 5);
+    for (const auto &result : results)
+        BOOST_CHECK_EQUAL(result.ec, boost::asio::error::would_block);
+}
+
+/* With interleaving, packets from consecutive heaps must alternate, while
+ * the heaps still complete in order.
+ */
+BOOST_AUTO_TEST_CASE(interleave)
+{
+    constexpr int n_heaps = 3;
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::stream_config config(
+        1024, 0.0, spead2::send::stream_config::default_burst_size, 4,
+        spead2::send::stream_config::default_burst_rate_ratio, n_heaps);
+    spead2::send::streambuf_stream stream(tp, sb, config);
+    std::vector<std::uint8_t> payload(5000);
+    spead2::send::heap h;
+    h.add_item(0x1234, payload, false);
+
+    std::vector<spead2::send::heap_reference> heaps;
+    for (int i = 0; i < n_heaps; i++)
+        heaps.emplace_back(h, i + 1);
+    std::promise<std::vector<spead2::send::heap_result>> result_promise;
+    stream.async_send_heaps(heaps, [&](const std::vector<spead2::send::heap_result> &results)
+    {
+        result_promise.set_value(results);
+    });
+    auto results = result_promise.get_future().get();
+    for (const auto &result : results)
+        BOOST_CHECK_EQUAL(result.ec, boost::system::error_code());
+
+    // Extract the heap cnt from each packet
+    std::string data = sb.str();
+    std::vector<int> cnts;
+    std::size_t pos = 0;
+    auto load_be = [&](std::size_t offset)
+    {
+        std::uint64_t value = 0;
+        for (int i = 0; i < 8; i++)
+            value = (value << 8) | std::uint8_t(data[offset + i]);
+        return value;
+    };
+    const std::uint64_t mask = (std::uint64_t(1) << 40) - 1;
+    while (pos < data.size())
+    {
+        std::size_t n_items = load_be(pos) & 0xffff;
+        cnts.push_back(load_be(pos + 8) & mask);
+        std::size_t payload_length = load_be(pos + 32) & mask;
+        pos += 8 + 8 * n_items + payload_length;
+    }
+    BOOST_CHECK_EQUAL(pos, data.size());
+    BOOST_REQUIRE_GE(cnts.size(), 2 * n_heaps);
+    for (int i = 0; i < 2 * n_heaps; i++)
+        BOOST_CHECK_EQUAL(cnts[i], i % n_heaps + 1);
+}
+
+/* Rate-limited sending with spinning. The burst size is smaller than a
+ * packet, so every packet is paced individually.
+ */
+BOOST_AUTO_TEST_CASE(spin_pacing)
+{
+    constexpr double rate = 1e7;
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::stream_config config(
+        1024, rate, 512, 4,
+        spead2::send::stream_config::default_burst_rate_ratio,
+        spead2::send::stream_config::default_max_interleave, 1e-4);
+    spead2::send::streambuf_stream stream(tp, sb, config);
+    std::vector<std::uint8_t> payload(50000);
+    spead2::send::heap h;
+    h.add_item(0x1234, payload, false);
+
+    std::promise<std::pair<boost::system::error_code, std::size_t>> result_promise;
+    auto handler = [&](const boost::system::error_code &ec, std::size_t bytes_transferred)
+    {
+        result_promise.set_value(std::make_pair(ec, bytes_transferred));
+    };
+    auto start = std::chrono::steady_clock::now();
+    stream.async_send_heap(h, handler);
+    auto result = result_promise.get_future().get();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    BOOST_CHECK_EQUAL(result.first, boost::system::error_code());
+    BOOST_CHECK_GE(elapsed.count(), result.second / rate * 0.99);
+
+    /* Every packet, including the last, is followed by a wait. A wait is
+     * only counted if the sender was ahead of schedule, which a slow or
+     * heavily loaded machine might not always be.
+     */
+    std::size_t n_packets = 0;
+    for (spead2::send::packet_generator gen(h, 1, 1024); gen.has_next_packet(); n_packets++)
+    {
+        spead2::send::packet pkt;
+        std::uint64_t scratch[128];
+        gen.next_packet(pkt, reinterpret_cast<std::uint8_t *>(scratch));
+    }
+    spead2::send::pacing_stats stats = stream.get_pacing_stats();
+    BOOST_CHECK_LE(stats.bursts, n_packets);
+    BOOST_CHECK_GE(stats.bursts, n_packets / 2);
+    std::uint64_t n_lateness = 0, n_gap = 0;
+    for (std::size_t i = 0; i < spead2::send::pacing_stats::histogram_buckets; i++)
+    {
+        n_lateness += stats.lateness[i];
+        n_gap += stats.gap[i];
+    }
+    BOOST_CHECK_EQUAL(n_lateness, stats.bursts);
+    BOOST_CHECK_EQUAL(n_gap, stats.bursts - 1);
+    BOOST_CHECK_LE(stats.total_lateness, stats.bursts * stats.max_lateness);
+
+    BOOST_CHECK_THROW(config.set_spin_time(-1.0), std::invalid_argument);
+}
+
+// Bursts that the rate limit does not hold back are not counted
+BOOST_AUTO_TEST_CASE(pacing_stats_unlimited)
+{
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::streambuf_stream stream(
+        tp, sb, spead2::send::stream_config(1024, 0.0, 512, 4));
+    std::vector<std::uint8_t> payload(50000);
+    spead2::send::heap h;
+    h.add_item(0x1234, payload, false);
+
+    std::promise<boost::system::error_code> result_promise;
+    stream.async_send_heap(h, [&](const boost::system::error_code &ec, std::size_t)
+    {
+        result_promise.set_value(ec);
+    });
+    BOOST_CHECK_EQUAL(result_promise.get_future().get(), boost::system::error_code());
+    BOOST_CHECK_EQUAL(stream.get_pacing_stats().bursts, 0);
+}
+
+/* A small urgent heap overtakes a large heap that is already being sent,
+ * and heaps with an out-of-range priority are rejected.
+ */
+BOOST_AUTO_TEST_CASE(priority)
+{
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    // Slow enough that the big heap is still being sent when the small one arrives
+    spead2::send::stream_config config(1024, 1e6);
+    config.set_num_priorities(2);
+    spead2::send::streambuf_stream stream(tp, sb, config);
+    std::vector<std::uint8_t> payload(100000);
+    spead2::send::heap big, small;
+    big.add_item(0x1234, payload, false);
+    small.add_item(0x1235, 1);
+
+    std::mutex order_mutex;
+    std::vector<int> order;
+    std::vector<boost::system::error_code> results;
+    std::promise<void> done;
+    auto make_handler = [&](int id)
+    {
+        // Boost.Test is not thread-safe, so results are checked afterwards
+        return [&, id](const boost::system::error_code &ec, std::size_t)
+        {
+            std::lock_guard<std::mutex> lock(order_mutex);
+            order.push_back(id);
+            results.push_back(ec);
+            if (order.size() == 2)
+                done.set_value();
+        };
+    };
+    BOOST_CHECK(stream.async_send_heap(big, make_handler(0), -1, 0, 0));
+    // Let the big heap start, so that the small one has to preempt it
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    BOOST_CHECK(stream.async_send_heap(small, make_handler(1), -1, 0, 1));
+    done.get_future().get();
+    for (const auto &ec : results)
+        BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+    BOOST_CHECK_EQUAL(order[0], 1);
+    BOOST_CHECK_EQUAL(order[1], 0);
+
+    std::promise<boost::system::error_code> bad;
+    BOOST_CHECK(!stream.async_send_heap(
+        small, [&](const boost::system::error_code &ec, std::size_t) { bad.set_value(ec); },
+        -1, 0, 2));
+    BOOST_CHECK_EQUAL(bad.get_future().get(), boost::asio::error::invalid_argument);
+    BOOST_CHECK_THROW(config.set_num_priorities(0), std::invalid_argument);
+}
+
+// A heap passed by shared_ptr is released by the time the handler runs
+BOOST_AUTO_TEST_CASE(shared_heap)
+{
+    spead2::thread_pool tp;
+    std::stringbuf sb;
+    spead2::send::streambuf_stream stream(tp, sb);
+    auto pool = std::make_shared<spead2::memory_pool>(0, 1024, 2, 0);
+    pool->set_warn_on_empty(false);
+
+    auto h = std::make_shared<spead2::send::heap>();
+    std::uint8_t *ptr = h->allocate(pool, 100);
+    h->add_item(0x1234, ptr, 100, false);
+    std::weak_ptr<spead2::send::heap> weak = h;
+    std::promise<bool> released;
+    stream.async_send_heap(
+        std::move(h),
+        [&](const boost::system::error_code &ec, std::size_t)
+        {
+            BOOST_CHECK_EQUAL(ec, boost::system::error_code());
+            released.set_value(weak.expired());
+        });
+    BOOST_CHECK(released.get_future().get());
+    // The memory is back in the pool
+    BOOST_CHECK_EQUAL(pool->allocate(100, nullptr).get(), ptr);
+
+    auto h2 = std::make_shared<spead2::send::heap>();
+    h2->add_item(0x1234, 1);
+    std::weak_ptr<spead2::send::heap> weak2 = h2;
+    std::promise<void> done;
+    std::vector<spead2::send::heap_reference> refs{spead2::send::heap_reference(std::move(h2))};
+    stream.async_send_heaps(refs, [&](const std::vector<spead2::send::heap_result> &) { done.set_value(); });
+    refs.clear();
+    done.get_future().get();
+    BOOST_CHECK(weak2.expired());
+}
+
 BOOST_AUTO_TEST_SUITE_END()  // streambuf
 BOOST_AUTO_TEST_SUITE_END()  // send
 
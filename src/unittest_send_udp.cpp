@@ -0,0 +1,158 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Unit tests for send_udp.
+ */
+
+#include <future>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <spead2/common_features.h>
+#include <spead2/common_thread_pool.h>
+#include <spead2/send_heap.h>
+#include <spead2/send_udp.h>
+
+namespace spead2
+{
+namespace unittest
+{
+
+typedef std::pair<boost::system::error_code, item_pointer_t> send_result;
+
+/// Send a heap and wait for it to complete
+static send_result send_heap(spead2::send::stream &stream, const spead2::send::heap &h,
+                             s_item_pointer_t cnt, std::size_t substream_index)
+{
+    std::promise<send_result> result_promise;
+    auto handler = [&](const boost::system::error_code &ec, item_pointer_t bytes_transferred)
+    {
+        result_promise.set_value(send_result(ec, bytes_transferred));
+    };
+    stream.async_send_heap(h, handler, cnt, substream_index);
+    return result_promise.get_future().get();
+}
+
+/// Receive all the packets waiting on a socket and return their heap cnts
+static std::vector<item_pointer_t> receive_cnts(boost::asio::ip::udp::socket &socket)
+{
+    std::vector<item_pointer_t> cnts;
+    std::uint8_t buffer[2048];
+    while (socket.available() > 0)
+    {
+        socket.receive(boost::asio::buffer(buffer));
+        // The heap cnt is the low 40 bits of the first item pointer
+        item_pointer_t cnt = 0;
+        for (int i = 11; i < 16; i++)
+            cnt = (cnt << 8) | buffer[i];
+        cnts.push_back(cnt);
+    }
+    return cnts;
+}
+
+BOOST_AUTO_TEST_SUITE(send)
+BOOST_AUTO_TEST_SUITE(udp)
+
+// Heaps are sent to the selected destination, or to all of them
+BOOST_AUTO_TEST_CASE(substreams)
+{
+    spead2::thread_pool tp;
+    boost::asio::io_service io_service;
+    boost::asio::ip::udp::endpoint bind_endpoint(boost::asio::ip::address_v4::loopback(), 0);
+    boost::asio::ip::udp::socket rx0(io_service, bind_endpoint);
+    boost::asio::ip::udp::socket rx1(io_service, bind_endpoint);
+    std::vector<boost::asio::ip::udp::endpoint> endpoints{rx0.local_endpoint(), rx1.local_endpoint()};
+    spead2::send::udp_stream stream(tp, endpoints);
+    BOOST_CHECK_EQUAL(stream.get_num_substreams(), 2);
+
+    spead2::send::heap h;
+    h.add_item(0x1000, 0x1234);
+    send_result r0 = send_heap(stream, h, 1, 0);
+    send_result r1 = send_heap(stream, h, 2, 1);
+    send_result r_all = send_heap(stream, h, 3, spead2::send::stream::all_substreams);
+    BOOST_CHECK_EQUAL(r0.first, boost::system::error_code());
+    BOOST_CHECK_EQUAL(r1.first, boost::system::error_code());
+    BOOST_CHECK_EQUAL(r_all.first, boost::system::error_code());
+    BOOST_CHECK_EQUAL(r_all.second, 2 * r0.second);
+
+    send_result r_bad = send_heap(stream, h, 4, 2);
+    BOOST_CHECK_EQUAL(r_bad.first, boost::asio::error::invalid_argument);
+
+    std::vector<item_pointer_t> expected0{1, 3}, expected1{2, 3};
+    std::vector<item_pointer_t> actual0 = receive_cnts(rx0);
+    std::vector<item_pointer_t> actual1 = receive_cnts(rx1);
+    BOOST_CHECK_EQUAL_COLLECTIONS(actual0.begin(), actual0.end(), expected0.begin(), expected0.end());
+    BOOST_CHECK_EQUAL_COLLECTIONS(actual1.begin(), actual1.end(), expected1.begin(), expected1.end());
+}
+
+BOOST_AUTO_TEST_CASE(no_endpoints)
+{
+    spead2::thread_pool tp;
+    std::vector<boost::asio::ip::udp::endpoint> endpoints;
+    BOOST_CHECK_THROW(spead2::send::udp_stream(tp, endpoints), std::invalid_argument);
+}
+
+#if SPEAD2_USE_TXTIME
+// With kernel pacing, packets must still arrive, and the stream must not run
+// further ahead of the rate limit than the lookahead allows.
+BOOST_AUTO_TEST_CASE(txtime)
+{
+    const double rate = 1e7;
+    const double lookahead = 0.005;
+    const int n_heaps = 20;
+    spead2::thread_pool tp;
+    boost::asio::io_service io_service;
+    boost::asio::ip::udp::endpoint bind_endpoint(boost::asio::ip::address_v4::loopback(), 0);
+    boost::asio::ip::udp::socket rx(io_service, bind_endpoint);
+    rx.set_option(boost::asio::socket_base::receive_buffer_size(1024 * 1024));
+    spead2::send::stream_config config(1024, rate, 4096, n_heaps);
+    spead2::send::udp_stream stream(tp, rx.local_endpoint(), config);
+    stream.enable_txtime(lookahead);
+
+    std::vector<std::uint8_t> data(10000);
+    spead2::send::heap h;
+    h.add_item(0x1000, data, false);
+    auto start = std::chrono::high_resolution_clock::now();
+    item_pointer_t bytes = 0;
+    for (int i = 0; i < n_heaps; i++)
+        bytes += send_heap(stream, h, i + 1, 0).second;
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    // The last burst may start up to the lookahead ahead of schedule
+    BOOST_CHECK_GE(elapsed.count(), (bytes - config.get_burst_size()) / rate - lookahead);
+
+    // Allow any packets scheduled for the future to arrive
+    std::this_thread::sleep_for(std::chrono::duration<double>(lookahead * 2));
+    std::vector<item_pointer_t> cnts = receive_cnts(rx);
+    std::size_t packets_per_heap = cnts.size() / n_heaps;
+    BOOST_REQUIRE_GT(packets_per_heap, 1);
+    BOOST_REQUIRE_EQUAL(cnts.size(), n_heaps * packets_per_heap);
+    for (std::size_t i = 0; i < cnts.size(); i++)
+        BOOST_CHECK_EQUAL(cnts[i], i / packets_per_heap + 1);
+}
+#endif // SPEAD2_USE_TXTIME
+
+BOOST_AUTO_TEST_SUITE_END()  // udp
+BOOST_AUTO_TEST_SUITE_END()  // send
+
+}} // namespace spead2::unittest
@@ -0,0 +1,155 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Unit tests for send_udp_packet_mmap. These need the @c CAP_NET_RAW
+ * capability and an Ethernet interface with an IPv4 address, and are
+ * skipped otherwise.
+ */
+
+#include <spead2/common_features.h>
+#if SPEAD2_USE_PACKET_MMAP
+
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <spead2/common_thread_pool.h>
+#include <spead2/send_heap.h>
+#include <spead2/send_udp_packet_mmap.h>
+
+namespace spead2
+{
+namespace unittest
+{
+
+BOOST_AUTO_TEST_SUITE(send)
+BOOST_AUTO_TEST_SUITE(udp_packet_mmap)
+
+/// Find the IPv4 address of an interface that is up, other than loopback
+static boost::asio::ip::address find_interface_address()
+{
+    ifaddrs *ifap;
+    boost::asio::ip::address result;
+    if (getifaddrs(&ifap) < 0)
+        return result;
+    for (ifaddrs *cur = ifap; cur; cur = cur->ifa_next)
+    {
+        if (cur->ifa_addr && cur->ifa_addr->sa_family == AF_INET
+            && (cur->ifa_flags & IFF_UP) && !(cur->ifa_flags & IFF_LOOPBACK))
+        {
+            const sockaddr_in *addr = reinterpret_cast<const sockaddr_in *>(cur->ifa_addr);
+            result = boost::asio::ip::address_v4(ntohl(addr->sin_addr.s_addr));
+            break;
+        }
+    }
+    freeifaddrs(ifap);
+    return result;
+}
+
+/**
+ * Create a stream, or return null (with a message) if that is not possible
+ * in this environment.
+ */
+static std::unique_ptr<spead2::send::udp_packet_mmap_stream> make_stream(
+    spead2::thread_pool &tp, const spead2::send::stream_config &config, std::size_t buffer_size)
+{
+    boost::asio::ip::address interface_address = find_interface_address();
+    if (interface_address.is_unspecified())
+    {
+        BOOST_TEST_MESSAGE("no suitable interface found");
+        return nullptr;
+    }
+    boost::asio::ip::udp::endpoint endpoint(
+        boost::asio::ip::address_v4::from_string("239.255.88.88"), 8888);
+    try
+    {
+        return std::unique_ptr<spead2::send::udp_packet_mmap_stream>(
+            new spead2::send::udp_packet_mmap_stream(
+                tp, endpoint, config, interface_address, buffer_size));
+    }
+    catch (std::runtime_error &e)
+    {
+        // Typically EPERM due to lacking CAP_NET_RAW
+        BOOST_TEST_MESSAGE("packet_mmap not available: " << e.what());
+        return nullptr;
+    }
+}
+
+/* Send many more packets than fit in a small ring, so that the stream has
+ * to wait for the kernel to release frames, and check that every heap is
+ * reported as fully sent.
+ */
+BOOST_AUTO_TEST_CASE(ring_full)
+{
+    constexpr int n_heaps = 200;
+    spead2::thread_pool tp;
+    spead2::send::stream_config config(
+        1024, 0.0, spead2::send::stream_config::default_burst_size, n_heaps);
+    auto stream = make_stream(tp, config, 8192);
+    if (!stream)
+        return;
+
+    std::vector<std::uint8_t> payload(8000);
+    spead2::send::heap h;
+    h.add_item(0x1000, payload, false);
+    int n_ok = 0;
+    std::size_t total = 0;
+    // Handlers run in order, so the last one to run is for the last heap
+    std::promise<void> done;
+    for (int i = 0; i < n_heaps; i++)
+    {
+        stream->async_send_heap(
+            h, [&, i](const boost::system::error_code &ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                    n_ok++;
+                total += bytes_transferred;
+                if (i == n_heaps - 1)
+                    done.set_value();
+            });
+    }
+    done.get_future().get();
+    BOOST_CHECK_EQUAL(n_ok, n_heaps);
+    BOOST_CHECK_GT(total, n_heaps * payload.size());
+}
+
+// Packets that the kernel would silently drop are rejected up front
+BOOST_AUTO_TEST_CASE(mtu)
+{
+    spead2::thread_pool tp;
+    // Check that a stream can be created at all
+    if (!make_stream(tp, spead2::send::stream_config(1024), 8192))
+        return;
+    spead2::send::stream_config config(65000);
+    BOOST_CHECK_THROW(make_stream(tp, config, 1024 * 1024), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END()  // udp_packet_mmap
+BOOST_AUTO_TEST_SUITE_END()  // send
+
+}} // namespace spead2::unittest
+
+#endif // SPEAD2_USE_PACKET_MMAP
@@ -0,0 +1,159 @@
+/* Copyright 2020 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Unit tests for send_udp_uring.
+ */
+
+#include <spead2/common_features.h>
+#if SPEAD2_USE_URING
+
+#include <future>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <spead2/common_thread_pool.h>
+#include <spead2/send_heap.h>
+#include <spead2/send_udp_uring.h>
+
+namespace spead2
+{
+namespace unittest
+{
+
+BOOST_AUTO_TEST_SUITE(send)
+BOOST_AUTO_TEST_SUITE(udp_uring)
+
+/* Send a multi-packet heap over the loopback interface and check that all
+ * the packets arrive, in order.
+ */
+BOOST_AUTO_TEST_CASE(send_loopback)
+{
+    spead2::thread_pool tp;
+    boost::asio::io_service io_service;
+    boost::asio::ip::udp::socket rx(
+        io_service,
+        boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    rx.set_option(boost::asio::socket_base::receive_buffer_size(1024 * 1024));
+
+    std::unique_ptr<spead2::send::udp_uring_stream> stream;
+    try
+    {
+        stream.reset(new spead2::send::udp_uring_stream(
+            tp, rx.local_endpoint(), spead2::send::stream_config(1024)));
+    }
+    catch (std::system_error &e)
+    {
+        BOOST_TEST_MESSAGE("io_uring not available: " << e.what());
+        return;
+    }
+
+    std::vector<std::uint8_t> payload(20000);
+    for (std::size_t i = 0; i < payload.size(); i++)
+        payload[i] = i & 0xff;
+    spead2::send::heap h;
+    h.add_item(0x1000, payload, false);
+
+    std::promise<std::pair<boost::system::error_code, std::size_t>> result_promise;
+    auto handler = [&](const boost::system::error_code &ec, std::size_t bytes_transferred)
+    {
+        result_promise.set_value(std::make_pair(ec, bytes_transferred));
+    };
+    stream->async_send_heap(h, handler, 1);
+    auto result = result_promise.get_future().get();
+    BOOST_CHECK_EQUAL(result.first, boost::system::error_code());
+
+    std::size_t total = 0;
+    std::uint8_t buffer[2048];
+    std::int64_t last_offset = -1;
+    while (total < result.second)
+    {
+        std::size_t n = rx.receive(boost::asio::buffer(buffer));
+        // Payload offset is the 3rd item pointer, after the 8-byte header
+        std::int64_t offset = 0;
+        for (int i = 0; i < 5; i++)
+            offset = (offset << 8) | buffer[8 + 2 * 8 + 3 + i];
+        BOOST_CHECK_GT(offset, last_offset);
+        last_offset = offset;
+        total += n;
+    }
+    BOOST_CHECK_EQUAL(total, result.second);
+}
+
+/* Send a batch in which one packet is too big for UDP, and check that only
+ * its heap fails: the packets after it must not be cancelled.
+ */
+BOOST_AUTO_TEST_CASE(send_partial_failure)
+{
+    spead2::thread_pool tp;
+    boost::asio::io_service io_service;
+    boost::asio::ip::udp::socket rx(
+        io_service,
+        boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    rx.set_option(boost::asio::socket_base::receive_buffer_size(1024 * 1024));
+
+    spead2::send::stream_config config(70000);
+    // Make sure that all the heaps go out in a single batch
+    config.set_burst_size(1024 * 1024);
+    std::unique_ptr<spead2::send::udp_uring_stream> stream;
+    try
+    {
+        stream.reset(new spead2::send::udp_uring_stream(tp, rx.local_endpoint(), config));
+    }
+    catch (std::system_error &e)
+    {
+        BOOST_TEST_MESSAGE("io_uring not available: " << e.what());
+        return;
+    }
+
+    std::vector<std::uint8_t> payload(68000);
+    spead2::send::heap small1, big, small2;
+    small1.add_item(0x1000, 1);
+    big.add_item(0x1000, payload, false);
+    small2.add_item(0x1000, 2);
+    std::vector<spead2::send::heap_reference> heaps{
+        spead2::send::heap_reference(small1),
+        spead2::send::heap_reference(big),
+        spead2::send::heap_reference(small2)
+    };
+
+    std::promise<std::vector<spead2::send::heap_result>> results_promise;
+    stream->async_send_heaps(
+        heaps,
+        [&](const std::vector<spead2::send::heap_result> &results)
+        {
+            results_promise.set_value(results);
+        });
+    auto results = results_promise.get_future().get();
+    BOOST_REQUIRE_EQUAL(results.size(), 3U);
+    BOOST_CHECK_EQUAL(results[0].ec, boost::system::error_code());
+    BOOST_CHECK_EQUAL(results[1].ec, boost::asio::error::message_size);
+    BOOST_CHECK_EQUAL(results[2].ec, boost::system::error_code());
+    BOOST_CHECK_GT(results[2].bytes_transferred, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()  // udp_uring
+BOOST_AUTO_TEST_SUITE_END()  // send
+
+}} // namespace spead2::unittest
+
+#endif // SPEAD2_USE_URING